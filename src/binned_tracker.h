@@ -186,6 +186,18 @@ public:
     return sz;
   }
 
+  // calls func with each of our partially full miniheaps
+  template <typename Func>
+  void forEachPartial(Func func) const {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    for (size_t i = 0; i < kBinnedTrackerBinCount; i++) {
+      for (auto mh : _partial[i]) {
+        func(mh);
+      }
+    }
+  }
+
   // number of MiniHeaps we are tracking
   size_t count() const {
     std::lock_guard<std::mutex> lock(_mutex);
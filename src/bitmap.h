@@ -229,6 +229,13 @@ public:
     return !(oldValue & mask);
   }
 
+  // for bitmaps over memory that is committed as it is needed: the
+  // words for the new bits must already be usable, and zero
+  inline void extend(size_t bitCount) {
+    d_assert(bitCount >= _bitCount);
+    _bitCount = bitCount;
+  }
+
   inline uint32_t inUseCount() const {
     const auto wordCount = representationSize(_bitCount) / sizeof(size_t);
     uint32_t count = 0;
@@ -251,7 +258,7 @@ protected:
     return _bitCount;
   }
 
-  const size_t _bitCount : 63;
+  size_t _bitCount : 63;
   const size_t _isDynamicallyAllocated : 1;
   word_t *_bits;
 };
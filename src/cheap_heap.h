@@ -13,6 +13,10 @@
 
 namespace mesh {
 
+// the arenas and freelists of cheap heaps are reserved up front, and
+// committed this much at a time as they fill
+static constexpr size_t kCheapHeapCommitSize = kHugePageSize;
+
 // Fast allocation for a single size-class
 template <size_t allocSize, size_t maxCount>
 class CheapHeap : public OneWayMmapHeap {
@@ -28,12 +32,14 @@ public:
 
   CheapHeap() : SuperHeap() {
     // TODO: check allocSize + maxCount doesn't overflow?
-    _arena = reinterpret_cast<char *>(SuperHeap::malloc(allocSize * maxCount));
-    _freelist = reinterpret_cast<void **>(SuperHeap::malloc(maxCount * sizeof(void *)));
+    _arena = reinterpret_cast<char *>(SuperHeap::reserve(allocSize * maxCount));
+    _freelist = reinterpret_cast<void **>(SuperHeap::reserve(maxCount * sizeof(void *)));
     hard_assert(_arena != nullptr);
     hard_assert(_freelist != nullptr);
     d_assert(reinterpret_cast<uintptr_t>(_arena) % Alignment == 0);
     d_assert(reinterpret_cast<uintptr_t>(_freelist) % Alignment == 0);
+    _arenaCommitted = _arena;
+    _freelistCommitted = reinterpret_cast<char *>(_freelist);
   }
 
   inline void *alloc() {
@@ -44,6 +50,9 @@ public:
     }
 
     const auto off = _arenaOff++;
+    if (unlikely(off >= _committedCount)) {
+      commitMore();
+    }
     return ptrFromOffset(off);
   }
 
@@ -80,10 +89,24 @@ public:
   }
 
 protected:
+  static constexpr size_t kCommitCount = (kCheapHeapCommitSize + allocSize - 1) / allocSize;
+
+  // backs the next chunk of the arena, and enough of the freelist to
+  // hold every object in the arena so far
+  void commitMore() {
+    hard_assert_msg(_committedCount < maxCount, "mesh: all %zu cheap heap objects in use", maxCount);
+    _committedCount = std::min(_committedCount + kCommitCount, maxCount);
+    SuperHeap::commitTo(_arenaCommitted, _arena + _committedCount * allocSize);
+    SuperHeap::commitTo(_freelistCommitted, reinterpret_cast<char *>(_freelist + _committedCount));
+  }
+
   char *_arena{nullptr};
   void **_freelist{nullptr};
   size_t _arenaOff{1};
   ssize_t _freelistOff{-1};
+  size_t _committedCount{0};
+  char *_arenaCommitted{nullptr};
+  char *_freelistCommitted{nullptr};
 };
 
 class DynCheapHeap : public OneWayMmapHeap {
@@ -99,6 +122,7 @@ public:
     d_assert(_allocSize % 2 == 0);
   }
 
+  // arena and freelist are reserve()d, and page aligned
   inline void init(size_t allocSize, size_t maxCount, char *arena, void **freelist) {
     _arena = arena;
     _freelist = freelist;
@@ -106,8 +130,10 @@ public:
     _maxCount = maxCount;
     hard_assert(_arena != nullptr);
     hard_assert(_freelist != nullptr);
-    hard_assert(reinterpret_cast<uintptr_t>(_arena) % Alignment == 0);
-    hard_assert(reinterpret_cast<uintptr_t>(_freelist) % Alignment == 0);
+    hard_assert(reinterpret_cast<uintptr_t>(_arena) % kPageSize == 0);
+    hard_assert(reinterpret_cast<uintptr_t>(_freelist) % kPageSize == 0);
+    _arenaCommitted = _arena;
+    _freelistCommitted = reinterpret_cast<char *>(_freelist);
   }
 
   inline void *alloc() {
@@ -118,6 +144,9 @@ public:
     }
 
     const auto off = _arenaOff++;
+    if (unlikely(off >= _committedCount)) {
+      commitMore();
+    }
     return ptrFromOffset(off);
   }
 
@@ -154,12 +183,23 @@ public:
   }
 
 protected:
+  void commitMore() {
+    hard_assert_msg(_committedCount < _maxCount, "mesh: all %zu cheap heap objects in use", _maxCount);
+    const size_t commitCount = (kCheapHeapCommitSize + _allocSize - 1) / _allocSize;
+    _committedCount = std::min(_committedCount + commitCount, _maxCount);
+    SuperHeap::commitTo(_arenaCommitted, _arena + _committedCount * _allocSize);
+    SuperHeap::commitTo(_freelistCommitted, reinterpret_cast<char *>(_freelist + _committedCount));
+  }
+
   char *_arena{nullptr};
   void **_freelist{nullptr};
   size_t _arenaOff{1};
   ssize_t _freelistOff{-1};
   size_t _allocSize{0};
   size_t _maxCount{0};
+  size_t _committedCount{0};
+  char *_arenaCommitted{nullptr};
+  char *_freelistCommitted{nullptr};
 };
 }  // namespace mesh
 
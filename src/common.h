@@ -56,19 +56,28 @@ static constexpr size_t kMaxFastLargeSize = 256 * 1024;  // 256Kb
 
 // cutoff to be considered for meshing
 static constexpr double kOccupancyCutoff = .8;
+// number of right-hand miniheaps each left-hand miniheap is probed
+// against in method::shiftedSplitting (the paper's 't')
+static constexpr size_t kMeshProbeBudget = 64;
 
 // if we have, e.g. a kernel-imposed max_map_count of 2^16 (65k) we
 // can only safely have about 30k meshes before we are at risk of
 // hitting the max_map_count limit.
 static constexpr double kMeshesPerMap = .457;
 static constexpr size_t kDefaultMaxMeshCount = 30000;
-static constexpr size_t kMaxMeshesPerIteration = 2500;
+static constexpr size_t kMaxMeshesPerIteration = 2500;  // per size class
 
 // maximum number of dirty pages to hold onto before we flush them
 // back to the OS (via MeshableArena::scavenge()
 static constexpr size_t kMaxDirtyPageThreshold = 1 << 14;  // 64 MB in pages
 static constexpr size_t kMinDirtyPageThreshold = 32;       // 128 KB in pages
 
+// below kMaxDirtyPageThreshold, dirty pages are purged gradually:
+// pages dirtied within the last decay period may linger, on a curve
+// tracked in kDirtyDecayEpochs steps (see MeshableArena::decayDirty)
+static constexpr std::chrono::milliseconds kDefaultDirtyDecay{10000};  // 10 s
+static constexpr size_t kDirtyDecayEpochs = 64;
+
 static constexpr uint32_t kSpanClassCount = 256;
 
 static constexpr int kNumBins = 25;  // 16Kb max object size
@@ -76,8 +85,38 @@ static constexpr int kDefaultMeshPeriod = 10000;
 
 static constexpr uint32_t kMinArenaExpansion = 4096;  // 16 MB in pages
 
+// spans at least this long (which only ever hold a single large
+// object) are indexed by range entries rather than per page: one per
+// aligned block of 64, 64^2 or 64^3 pages they cover whole, and one
+// per page at either end outside of any block.  That is at most a few
+// hundred entries, whatever the span's length.
+static constexpr size_t kRangeBlockShift = 6;
+static constexpr size_t kRangeLevels = 3;
+static constexpr size_t kMinRangeSpanPages = 1UL << kRangeBlockShift;  // 256 KB
+static_assert(kRangeBlockShift * (kRangeLevels + 1) >= 22, "range levels must cover an arena segment");
+
+// the spans of size class MiniHeaps are at most this long (8 16 KB
+// objects); pages of theirs whose objects are all free can be purged
+// while the MiniHeap is in use, and are tracked in a 32-bit mask
+static constexpr size_t kMaxPurgeableSpanPages = 32;
+
+// without copy_file_range, the allocated pages of the heap are copied
+// after a fork in ranges of at most this many pages
+static constexpr size_t kForkCopyChunkPages = 16384;  // 64 MB
+static constexpr size_t kMaxForkCopyThreads = 16;
+// how long the parent waits by default for a forked child to exec or
+// exit before moving to a copy of the heap, leaving the child the
+// original (see MeshableArena::setForkChildWait)
+static constexpr std::chrono::milliseconds kForkChildCopyWait{20};
+// how often a forked child waiting for its parent to move checks that
+// the parent is still there
+static constexpr std::chrono::milliseconds kForkParentCheckInterval{100};
+
 // ensures we amortize the cost of going to the global heap enough
 static constexpr uint64_t kMinStringLen = 8;
+static_assert(kMaxSize * kMinStringLen / kPageSize <= kMaxPurgeableSpanPages,
+              "size class spans must fit the purgeable page mask");
+static_assert(kMaxPurgeableSpanPages <= 32, "purgeable pages are tracked in a uint32_t");
 static constexpr size_t kMiniheapRefillGoalSize = 4 * 1024;
 static constexpr size_t kMaxMiniheapsPerShuffleVector = 8;
 
@@ -86,6 +125,29 @@ static constexpr int16_t kMaxShuffleVectorLength = 256;  // sizeof(uint8_t) << 8
 static constexpr bool kEnableShuffleOnInit = SHUFFLE_ON_INIT == 1;
 static constexpr bool kEnableShuffleOnFree = SHUFFLE_ON_FREE == 1;
 
+// MiniHeaps belong to exactly one lifetime group, and each thread
+// keeps separate ShuffleVectors per group, so objects expected to die
+// at different times don't share spans.  ShortLived is only reached
+// through an explicit hint (mesh_malloc_hint).  Compact isn't a
+// lifetime: its spans are the ones in the compact window (see
+// kCompactArenaSize), reached through mesh_malloc_compact.
+enum class LifetimeGroup : uint8_t {
+  Default = 0,
+  LongLived = 1,
+  ShortLived = 2,
+  Compact = 3,
+};
+static constexpr size_t kLifetimeGroupCount = 4;
+
+// lifetime segregation: sample about one in this many allocations
+// per thread to learn how long objects from each allocation site
+// live.  Sites are hashed into 1 << kLifetimeSiteBits slots, and
+// sites whose sampled objects live at least kLongLivedLifetime are
+// placed in the long-lived group.
+static constexpr uint32_t kLifetimeSamplePeriod = 256;
+static constexpr uint32_t kLifetimeSiteBits = 10;
+static constexpr std::chrono::milliseconds kLongLivedLifetime{1000};
+
 // madvise(DONTDUMP) the heap to make reasonable coredumps
 static constexpr bool kAdviseDump = false;
 
@@ -95,8 +157,56 @@ static constexpr std::chrono::milliseconds kMeshPeriodMs{100};  // 100 ms
 // controls aspects of miniheaps
 static constexpr size_t kMaxMeshes = 256;  // 1 per bit
 
-static constexpr size_t kArenaSize = 16ULL * 1024ULL * 1024ULL * 1024ULL;  // 16 GB
-static constexpr size_t kAltStackSize = 16 * 1024UL;                       // 16k sigaltstacks
+// pages being meshed are hashed into this many futex words that
+// faulting threads wait on (see MeshableArena::waitForMesh)
+static constexpr size_t kMeshWaitSlotCount = 4096;
+
+// the arena is a single address-space reservation of up to
+// kArenaMaxSegments segments, and no span crosses a segment
+// boundary.
+static constexpr size_t kArenaSegmentSize = 16ULL * 1024ULL * 1024ULL * 1024ULL;  // 16 GB
+static constexpr size_t kArenaMaxSegments = 64;                                   // 1 TB
+static constexpr size_t kArenaMaxSize = kArenaSegmentSize * kArenaMaxSegments;
+static constexpr uint32_t kArenaSegmentPages = kArenaSegmentSize / kPageSize;
+
+// each segment is backed by several files (shards), so that the
+// kernel's per-file locks, taken by hole punching, remapping and page
+// faults, don't serialize work on different parts of the heap.  Spans
+// may cross shards, but are only meshed with spans in the same shard.
+// Shards are created and mapped in as the heap grows into them.
+static constexpr size_t kArenaShardSize = 1ULL * 1024ULL * 1024ULL * 1024ULL;  // 1 GB
+static constexpr uint32_t kArenaShardPages = kArenaShardSize / kPageSize;
+static constexpr size_t kArenaShardsPerSegment = kArenaSegmentSize / kArenaShardSize;
+static constexpr size_t kArenaMaxShards = kArenaShardsPerSegment * kArenaMaxSegments;
+
+// objects from mesh_malloc_compact lie in the arena's first 32 GB, so
+// they can be referred to by 32-bit offsets from its start in units
+// of 1 << kCompactPointerShift bytes.  The first page is left out, so
+// an offset of 0 never refers to an object.
+static constexpr size_t kCompactPointerShift = 3;
+static constexpr size_t kCompactArenaSize = (1ULL << 32) << kCompactPointerShift;  // 32 GB
+static constexpr uint32_t kCompactArenaPages = kCompactArenaSize / kPageSize;
+static_assert(kCompactArenaSize <= kArenaMaxSize, "compact window must fit in the arena");
+static_assert(kCompactArenaSize % kArenaSegmentSize == 0, "compact window must end on a segment boundary");
+
+// shared heaps (see SharedHeap) live outside the arena, each in a
+// memfd of at most one segment, and a process can create this many
+static constexpr size_t kMaxSharedHeaps = 16;
+
+// size classes opted in to transparent huge pages get their spans
+// carved out of regions of this size and alignment, which are
+// madvise(MADV_HUGEPAGE)'d and never meshed
+static constexpr size_t kHugePageSize = 2 * 1024 * 1024;  // 2 MB
+static constexpr uint32_t kHugePagePages = kHugePageSize / kPageSize;
+// the parent moves to its copy of the heap after a fork in chunks of
+// this many pages, which line up with huge page regions
+static constexpr size_t kForkMoveChunkPages = kHugePagePages;
+
+// advise the (kHugePageSize) leaves of the arena's page maps for
+// transparent huge pages, trading up to a huge page of RSS per leaf
+// for fewer TLB misses on lookups
+static constexpr bool kPageMapHugePages = false;
+static constexpr size_t kAltStackSize = 16 * 1024UL;  // 16k sigaltstacks
 #define SIGQUIESCE (SIGRTMIN + 7)
 #define SIGDUMP (SIGRTMIN + 8)
 
@@ -3,6 +3,8 @@
 // Use of this source code is governed by the Apache License,
 // Version 2.0, that can be found in the LICENSE file.
 
+#include <stdlib.h>
+
 #include "global_heap.h"
 
 #include "meshing.h"
@@ -10,6 +12,8 @@
 
 namespace mesh {
 
+atomic<bool> LifetimeClassifier::_enabled{false};
+
 MiniHeap *GetMiniHeap(const MiniHeapID id) {
   hard_assert(id.hasValue());
 
@@ -25,7 +29,11 @@ MiniHeapID GetMiniHeapID(const MiniHeap *mh) {
   return runtime().heap().miniheapIDFor(mh);
 }
 
-void *GlobalHeap::malloc(size_t sz) {
+uintptr_t GetSpanStart(uintptr_t ptrval) {
+  return runtime().heap().spanStartFor(reinterpret_cast<const void *>(ptrval));
+}
+
+void *GlobalHeap::malloc(size_t sz, LifetimeGroup group) {
 #ifndef NDEBUG
   if (unlikely(sz <= kMaxSize)) {
     abort();
@@ -39,12 +47,16 @@ void *GlobalHeap::malloc(size_t sz) {
     return nullptr;
   }
 
-  return pageAlignedAlloc(1, pageCount);
+  return pageAlignedAlloc(1, pageCount, group);
 }
 
 void GlobalHeap::free(void *ptr) {
   auto mh = miniheapFor(ptr);
   if (unlikely(!mh)) {
+    if (auto heap = SharedHeap::heapFor(ptr)) {
+      heap->free(ptr);
+      return;
+    }
 #ifndef NDEBUG
     if (ptr != nullptr) {
       debug("FIXME: free of untracked ptr %p", ptr);
@@ -61,6 +73,10 @@ void GlobalHeap::freeFor(MiniHeap *mh, void *ptr) {
   }
 
   if (unlikely(!mh)) {
+    // objects from our shared heaps are freed with plain free()
+    if (auto heap = SharedHeap::heapFor(ptr)) {
+      heap->free(ptr);
+    }
     return;
   }
 
@@ -74,6 +90,7 @@ void GlobalHeap::freeFor(MiniHeap *mh, void *ptr) {
     // 16KB alignment.
     if (mh->maxCount() == 1) {
       freeMiniheapLocked(mh, false);
+      maybeDecayLocked();
       return;
     }
 
@@ -98,12 +115,14 @@ void GlobalHeap::freeFor(MiniHeap *mh, void *ptr) {
 
     // this may free the miniheap -- we can't safely access it after
     // this point.
-    bool shouldFlush = _littleheaps[sizeClass].postFree(mh, remaining);
+    bool shouldFlush = trackerFor(mh).postFree(mh, remaining);
     mh = nullptr;
 
     if (unlikely(shouldFlush)) {
       flushBinLocked(sizeClass);
     }
+
+    maybeDecayLocked();
   }
 
   if (shouldConsiderMesh) {
@@ -131,10 +150,45 @@ int GlobalHeap::mallctl(const char *name, void *oldp, size_t *oldlenp, void *new
     scavenge(true);
     lock.lock();
   } else if (strcmp(name, "mesh.compact") == 0) {
-    meshAllSizeClasses();
     lock.unlock();
+    meshAllSizeClasses();
     scavenge(true);
     lock.lock();
+  } else if (strncmp(name, "mesh.class.", strlen("mesh.class.")) == 0 ||
+             strncmp(name, "stats.class.", strlen("stats.class.")) == 0) {
+    return classMallctl(name, oldp, oldlenp, newp, newlen);
+  } else if (strcmp(name, "mesh.dirty_decay_ms") == 0) {
+    *statp = Super::dirtyDecay().count();
+    if (newp && newlen >= sizeof(size_t))
+      Super::setDirtyDecay(std::chrono::milliseconds{*reinterpret_cast<size_t *>(newp)});
+  } else if (strcmp(name, "mesh.fork_copy_threads") == 0) {
+    *statp = Super::forkCopyThreads();
+    if (newp && newlen >= sizeof(size_t)) {
+      // starts threads, which malloc
+      lock.unlock();
+      Super::setForkCopyThreads(*reinterpret_cast<size_t *>(newp));
+      lock.lock();
+    }
+  } else if (strcmp(name, "mesh.fork_child_wait_ms") == 0) {
+    *statp = Super::forkChildWait().count();
+    if (newp && newlen >= sizeof(size_t))
+      Super::setForkChildWait(std::chrono::milliseconds{*reinterpret_cast<size_t *>(newp)});
+  } else if (strcmp(name, "mesh.prefault") == 0) {
+    *statp = _prefaultRefills;
+    if (newp && newlen >= sizeof(size_t))
+      _prefaultRefills = *reinterpret_cast<size_t *>(newp) != 0;
+  } else if (strcmp(name, "mesh.prefault_threshold") == 0) {
+    *statp = _prefaultThreshold;
+    if (newp && newlen >= sizeof(size_t))
+      _prefaultThreshold = *reinterpret_cast<size_t *>(newp);
+  } else if (strcmp(name, "stats.prefaulted") == 0) {
+    *statp = Super::prefaultedPageCount() * kPageSize;
+  } else if (strcmp(name, "stats.partial_purged") == 0) {
+    *statp = Super::partialPurgedPageCount() * kPageSize;
+  } else if (strcmp(name, "mesh.lifetime_segregation") == 0) {
+    *statp = LifetimeClassifier::enabled();
+    if (newp && newlen >= sizeof(size_t))
+      LifetimeClassifier::setEnabled(*reinterpret_cast<size_t *>(newp) != 0);
   } else if (strcmp(name, "arena") == 0) {
     // not sure what this should do
   } else if (strcmp(name, "stats.resident") == 0) {
@@ -145,33 +199,110 @@ int GlobalHeap::mallctl(const char *name, void *oldp, size_t *oldlenp, void *new
   } else if (strcmp(name, "stats.active") == 0) {
     // all miniheaps at least partially full
     size_t sz = 0;
-    for (size_t i = 0; i < kNumBins; i++) {
-      const auto count = _littleheaps[i].nonEmptyCount();
-      if (count == 0)
-        continue;
-      sz += count * _littleheaps[i].objectSize() * _littleheaps[i].objectCount();
+    for (const auto &group : _littleheaps) {
+      for (size_t i = 0; i < kNumBins; i++) {
+        const auto count = group[i].nonEmptyCount();
+        if (count == 0)
+          continue;
+        sz += count * group[i].objectSize() * group[i].objectCount();
+      }
     }
     *statp = sz;
   } else if (strcmp(name, "stats.allocated") == 0) {
     // TODO: revisit this
     // same as active for us, for now -- memory not returned to the OS
     size_t sz = 0;
-    for (size_t i = 0; i < kNumBins; i++) {
-      const auto &bin = _littleheaps[i];
-      const auto count = bin.nonEmptyCount();
-      if (count == 0)
-        continue;
-      sz += bin.objectSize() * bin.allocatedObjectCount();
+    for (const auto &group : _littleheaps) {
+      for (size_t i = 0; i < kNumBins; i++) {
+        const auto &bin = group[i];
+        const auto count = bin.nonEmptyCount();
+        if (count == 0)
+          continue;
+        sz += bin.objectSize() * bin.allocatedObjectCount();
+      }
     }
     *statp = sz;
   }
   return 0;
 }
 
+int GlobalHeap::classMallctl(const char *name, void *oldp, size_t *oldlenp, void *newp, size_t newlen) {
+  const bool isStat = name[0] == 's';
+  const char *classStr = name + (isStat ? strlen("stats.class.") : strlen("mesh.class."));
+
+  char *end = nullptr;
+  const auto sizeClass = strtoul(classStr, &end, 10);
+  if (end == classStr || *end != '.' || sizeClass >= kNumBins)
+    return -1;
+  const char *knob = end + 1;
+
+  auto statp = reinterpret_cast<size_t *>(oldp);
+  auto newVal = reinterpret_cast<const size_t *>(newp);
+  const bool hasNew = newp != nullptr && newlen >= sizeof(size_t);
+
+  if (isStat) {
+    const auto &stats = _meshStats[sizeClass];
+    if (strcmp(knob, "passes") == 0) {
+      *statp = stats.passCount;
+    } else if (strcmp(knob, "candidates") == 0) {
+      *statp = stats.candidateCount;
+    } else if (strcmp(knob, "meshes_found") == 0) {
+      *statp = stats.foundCount;
+    } else if (strcmp(knob, "meshes") == 0) {
+      *statp = stats.meshCount;
+    } else {
+      return -1;
+    }
+    return 0;
+  }
+
+  auto &policy = _meshPolicy[sizeClass];
+  if (strcmp(knob, "size") == 0) {
+    *statp = SizeMap::ByteSizeForClass(sizeClass);
+  } else if (strcmp(knob, "enabled") == 0) {
+    *statp = policy.enabled;
+    if (hasNew)
+      policy.enabled = kMeshingEnabled && *newVal != 0;
+  } else if (strcmp(knob, "occupancy_cutoff") == 0) {
+    // a double, rather than a size_t, in (0, 1]
+    static_assert(sizeof(double) <= sizeof(size_t), "mallctl values must fit in a size_t");
+    *reinterpret_cast<double *>(oldp) = policy.occupancyCutoff;
+    if (hasNew) {
+      const auto cutoff = *reinterpret_cast<const double *>(newp);
+      if (!(cutoff > 0 && cutoff <= 1))
+        return -1;
+      policy.occupancyCutoff = cutoff;
+    }
+  } else if (strcmp(knob, "probe_budget") == 0) {
+    *statp = policy.probeBudget;
+    if (hasNew) {
+      if (*newVal == 0)
+        return -1;
+      policy.probeBudget = *newVal;
+    }
+  } else if (strcmp(knob, "max_meshes") == 0) {
+    *statp = policy.maxMeshesPerPass;
+    if (hasNew)
+      policy.maxMeshesPerPass = *newVal;
+  } else if (strcmp(knob, "huge_pages") == 0) {
+    *statp = policy.hugePages;
+    if (hasNew)
+      policy.hugePages = *newVal != 0;
+  } else {
+    return -1;
+  }
+
+  return 0;
+}
+
 void GlobalHeap::meshLocked(MiniHeap *dst, MiniHeap *&src) {
   const size_t dstSpanSize = dst->spanSize();
   const auto dstSpanStart = reinterpret_cast<void *>(dst->getSpanStart(arenaBegin()));
 
+  // src's objects are copied into dst's free slots
+  Super::forgetPurgedPages(dst->span(), false);
+  Super::forgetPurgedPages(src->span(), false);
+
   src->forEachMeshed([&](const MiniHeap *mh) {
     // marks srcSpans read-only
     const auto srcSpan = reinterpret_cast<void *>(mh->getSpanStart(arenaBegin()));
@@ -193,42 +324,104 @@ void GlobalHeap::meshLocked(MiniHeap *dst, MiniHeap *&src) {
 
   // make sure we adjust what bin the destination is in -- it might
   // now be full and not a candidate for meshing
-  _littleheaps[dst->sizeClass()].postFree(dst, dst->inUseCount());
+  trackerFor(dst).postFree(dst, dst->inUseCount());
   untrackMiniheapLocked(src);
 }
 
-void GlobalHeap::meshAllSizeClasses() {
-  Super::scavenge(false);
+bool GlobalHeap::stillMeshableLocked(const MiniHeap *a, const MiniHeap *b) const {
+  // a miniheap freed since the snapshot no longer owns its span's
+  // pages (the struct itself stays readable)
+  const auto owned = [&](const MiniHeap *mh) {
+    const auto spanStart = reinterpret_cast<void *>(mh->getSpanStart(arenaBegin()));
+    return Super::contains(spanStart) && Super::isTracked(spanStart) && Super::lookupMiniheap(spanStart) == mh;
+  };
+  if (!owned(a) || !owned(b)) {
+    return false;
+  }
 
-  if (!_lastMeshEffective.load(std::memory_order::memory_order_acquire)) {
-    return;
+  if (a->isMeshed() || b->isMeshed() || !a->isMeshingCandidate() || !b->isMeshingCandidate()) {
+    return false;
   }
 
-  if (Super::aboveMeshThreshold()) {
-    return;
+  if (a->sizeClass() != b->sizeClass() || a->lifetimeGroup() != b->lifetimeGroup() ||
+      a->arenaShard() != b->arenaShard()) {
+    return false;
+  }
+
+  if (a->meshCount() + b->meshCount() > kMaxMeshes) {
+    return false;
   }
 
-  _lastMeshEffective = 1;
+  return bitmapsMeshable(a->bitmap().bits(), b->bitmap().bits(), a->bitmap().byteCount());
+}
+
+void GlobalHeap::meshAllSizeClasses() {
+  // one bin's candidates in the snapshot
+  struct CandidateRange {
+    size_t sizeClass;
+    size_t begin;
+    size_t count;
+    MeshPolicy policy;
+  };
+
+  internal::vector<MeshCandidate> candidates{};
+  internal::vector<CandidateRange> ranges{};
+
+  {
+    lock_guard<mutex> lock(_miniheapLock);
+
+    Super::scavenge(false);
+
+    if (!_lastMeshEffective.load(std::memory_order::memory_order_acquire)) {
+      return;
+    }
+
+    if (Super::aboveMeshThreshold()) {
+      return;
+    }
 
-  // const auto start = time::now();
-  size_t partialCount = 0;
+    _lastMeshEffective = 1;
 
+    // first, clear out any free memory we might have
+    for (size_t i = 0; i < kNumBins; i++) {
+      flushBinLocked(i);
+    }
+
+    for (size_t i = 0; i < kNumBins; i++) {
+      if (!_meshPolicy[i].enabled)
+        continue;
+
+      auto &stats = _meshStats[i];
+      stats.passCount++;
+
+      // only mesh miniheaps within the same lifetime group
+      for (auto &group : _littleheaps) {
+        const size_t begin = candidates.size();
+        const size_t count = method::snapshotCandidates(_fastPrng, group[i], _meshPolicy[i], candidates);
+        stats.candidateCount += count;
+        if (count > 1)
+          ranges.push_back(CandidateRange{i, begin, count, _meshPolicy[i]});
+      }
+    }
+  }
+
+  // the search is the bulk of a pass, and allocation and free
+  // continue while it runs
   internal::vector<std::pair<MiniHeap *, MiniHeap *>> mergeSets;
+  internal::vector<size_t> foundCounts(ranges.size());
 
-  // first, clear out any free memory we might have
-  for (size_t i = 0; i < kNumBins; i++) {
-    flushBinLocked(i);
+  auto meshFound = function<void(std::pair<MiniHeap *, MiniHeap *> &&)>(
+      [&](std::pair<MiniHeap *, MiniHeap *> &&miniheaps) { mergeSets.push_back(std::move(miniheaps)); });
+
+  for (size_t r = 0; r < ranges.size(); r++) {
+    const auto &range = ranges[r];
+    foundCounts[r] = method::shiftedSplitting(&candidates[range.begin], range.count, range.policy, meshFound);
   }
 
-  auto meshFound =
-      function<void(std::pair<MiniHeap *, MiniHeap *> &&)>([&](std::pair<MiniHeap *, MiniHeap *> &&miniheaps) {
-        if (std::get<0>(miniheaps)->isMeshingCandidate() && std::get<0>(miniheaps)->isMeshingCandidate())
-          mergeSets.push_back(std::move(miniheaps));
-      });
+  lock_guard<mutex> lock(_miniheapLock);
 
-  for (size_t i = 0; i < kNumBins; i++) {
-    partialCount += _littleheaps[i].partialSize();
-    method::shiftedSplitting(_fastPrng, _littleheaps[i], meshFound);
+  for (size_t r = 0; r < ranges.size(); r++) {
+    _meshStats[ranges[r].sizeClass].foundCount += foundCounts[r];
   }
 
   // we consider this effective if more than ~ 1 MB saved
@@ -240,28 +433,77 @@ void GlobalHeap::meshAllSizeClasses() {
     return;
   }
 
-  _stats.meshCount += mergeSets.size();
-
   for (auto &mergeSet : mergeSets) {
+    // the heap changed under the search: either miniheap may since
+    // have been freed, meshed or attached, or had objects allocated
+    if (!stillMeshableLocked(std::get<0>(mergeSet), std::get<1>(mergeSet))) {
+      continue;
+    }
+
     // merge _into_ the one with a larger mesh count, potentially
     // swapping the order of the pair
     const auto aCount = std::get<0>(mergeSet)->meshCount();
     const auto bCount = std::get<1>(mergeSet)->meshCount();
-    if (aCount + bCount > kMaxMeshes) {
-      continue;
-    } else if (aCount < bCount) {
+    if (aCount < bCount) {
       mergeSet = std::pair<MiniHeap *, MiniHeap *>(std::get<1>(mergeSet), std::get<0>(mergeSet));
     }
 
+    _stats.meshCount++;
+    _meshStats[std::get<0>(mergeSet)->sizeClass()].meshCount++;
     meshLocked(std::get<0>(mergeSet), std::get<1>(mergeSet));
   }
 
   Super::scavenge(false);
 
   _lastMesh = time::now();
+}
 
-  // const std::chrono::duration<double> duration = _lastMesh - start;
-  // debug("mesh took %f, found %zu", duration.count(), mergeSets.size());
+void GlobalHeap::purgeFreeMiniheapPagesLocked() {
+  for (size_t i = 0; i < kNumBins; i++) {
+    const size_t objectSize = SizeMap::ByteSizeForClass(i);
+
+    for (auto &group : _littleheaps) {
+      group[i].forEachPartial([&](MiniHeap *mh) {
+        // single page spans are freed whole once empty, and longer
+        // ones than the page mask covers aren't purged piecemeal
+        const auto span = mh->span();
+        if (span.length <= 1 || span.length > kMaxPurgeableSpanPages) {
+          return;
+        }
+        // the objects of attached MiniHeaps are handed out without
+        // the lock, and those of meshed ones share pages
+        if (mh->isAttached() || mh->isMeshed() || mh->hasMeshed() || mh->isHugePage()) {
+          return;
+        }
+
+        const auto &bitmap = mh->bitmap();
+        const size_t maxCount = mh->maxCount();
+
+        uint32_t freePages = 0;
+        for (size_t page = 0; page < span.length; page++) {
+          const size_t first = page * kPageSize / objectSize;
+          // the tail of the last page past the final object is never
+          // touched
+          if (first >= maxCount) {
+            break;
+          }
+          const size_t last = std::min(((page + 1) * kPageSize - 1) / objectSize, maxCount - 1);
+
+          bool empty = true;
+          for (size_t off = first; off <= last && empty; off++) {
+            empty = !bitmap.isSet(off);
+          }
+          if (empty) {
+            freePages |= 1U << page;
+          }
+        }
+
+        if (freePages != 0) {
+          Super::purgeSpanPages(span, freePages);
+        }
+      });
+    }
+  }
 }
 
 void GlobalHeap::dumpStats(int level, bool beDetailed) const {
@@ -281,8 +523,17 @@ void GlobalHeap::dumpStats(int level, bool beDetailed) const {
   debug("MH Free  Count:     %zu\n", (size_t)_stats.mhFreeCount);
   debug("MH High Water Mark: %zu\n", (size_t)_stats.mhHighWaterMark);
   if (level > 1) {
-    for (size_t i = 0; i < kNumBins; i++)
-      _littleheaps[i].dumpStats(beDetailed);
+    for (const auto &group : _littleheaps)
+      for (size_t i = 0; i < kNumBins; i++)
+        group[i].dumpStats(beDetailed);
+
+    for (size_t i = 0; i < kNumBins; i++) {
+      const auto &stats = _meshStats[i];
+      if (stats.passCount == 0)
+        continue;
+      debug("class %2zu: %zu passes, %zu candidates, %zu found, %zu meshed\n", i, stats.passCount,
+            stats.candidateCount, stats.foundCount, stats.meshCount);
+    }
   }
 }
 }  // namespace mesh
@@ -12,8 +12,11 @@
 
 #include "binned_tracker.h"
 #include "internal.h"
+#include "lifetime_classifier.h"
 #include "meshable_arena.h"
+#include "meshing.h"
 #include "mini_heap.h"
+#include "shared_heap.h"
 
 #include "heaplayers.h"
 
@@ -48,14 +51,17 @@ public:
   GlobalHeap()
       : _maxObjectSize(SizeMap::ByteSizeForClass(kNumBins - 1)),
         _fastPrng(internal::seed(), internal::seed()),
-        _lastMesh{time::now()} {
+        _lastMesh{time::now()},
+        _lastPagePurge{time::now()} {
   }
 
   inline void dumpStrings() const {
     lock_guard<mutex> lock(_miniheapLock);
 
-    for (size_t i = 0; i < kNumBins; i++) {
-      _littleheaps[i].printOccupancy();
+    for (size_t g = 0; g < kLifetimeGroupCount; g++) {
+      for (size_t i = 0; i < kNumBins; i++) {
+        _littleheaps[g][i].printOccupancy();
+      }
     }
   }
 
@@ -69,21 +75,42 @@ public:
     lock_guard<mutex> lock(_miniheapLock);
 
     Super::scavenge(force);
+    if (force) {
+      purgeFreeMiniheapPagesLocked();
+    }
   }
 
   void dumpStats(int level, bool beDetailed) const;
 
   // must be called with exclusive _mhRWLock held
   inline MiniHeap *ATTRIBUTE_ALWAYS_INLINE allocMiniheapLocked(int sizeClass, size_t pageCount, size_t objectCount,
-                                                               size_t objectSize, size_t pageAlignment = 1) {
+                                                               size_t objectSize, size_t pageAlignment = 1,
+                                                               LifetimeGroup group = LifetimeGroup::Default) {
     d_assert(0 < pageCount);
 
     void *buf = _mhAllocator.alloc();
     d_assert(buf != nullptr);
 
     // allocate out of the arena
+    const bool compact = group == LifetimeGroup::Compact;
+    const bool hugePage = !compact && sizeClass >= 0 && _meshPolicy[sizeClass].hugePages;
+    const bool prefault = sizeClass >= 0 ? _prefaultRefills
+                                         : _prefaultThreshold > 0 && pageCount * kPageSize >= _prefaultThreshold;
     Span span{0, 0};
-    char *spanBegin = Super::pageAlloc(span, pageCount, pageAlignment);
+    char *spanBegin = nullptr;
+    if (compact) {
+      d_assert(pageAlignment == 1);
+      spanBegin = Super::compactPageAlloc(span, pageCount, prefault);
+      // the compact window is full
+      if (spanBegin == nullptr) {
+        _mhAllocator.free(buf);
+        return nullptr;
+      }
+    } else if (hugePage) {
+      spanBegin = Super::hugePageAlloc(span, pageCount);
+    } else {
+      spanBegin = Super::pageAlloc(span, pageCount, pageAlignment, prefault);
+    }
     d_assert(spanBegin != nullptr);
     d_assert((reinterpret_cast<uintptr_t>(spanBegin) / kPageSize) % pageAlignment == 0);
 
@@ -91,6 +118,9 @@ public:
     Super::trackMiniHeap(span, miniheapID);
 
     MiniHeap *mh = new (buf) MiniHeap(arenaBegin(), span, objectCount, objectSize);
+    mh->setLifetimeGroup(group);
+    if (hugePage)
+      mh->setHugePage();
 
     if (sizeClass >= 0)
       trackMiniheapLocked(mh);
@@ -102,10 +132,14 @@ public:
     return mh;
   }
 
-  inline void *pageAlignedAlloc(size_t pageAlignment, size_t pageCount) {
+  inline void *pageAlignedAlloc(size_t pageAlignment, size_t pageCount,
+                                LifetimeGroup group = LifetimeGroup::Default) {
     lock_guard<mutex> lock(_miniheapLock);
 
-    MiniHeap *mh = allocMiniheapLocked(-1, pageCount, 1, pageCount * kPageSize, pageAlignment);
+    MiniHeap *mh = allocMiniheapLocked(-1, pageCount, 1, pageCount * kPageSize, pageAlignment, group);
+    if (unlikely(mh == nullptr)) {
+      return nullptr;
+    }
 
     d_assert(mh->maxCount() == 1);
     d_assert(mh->spanSize() == pageCount * kPageSize);
@@ -119,7 +153,7 @@ public:
   inline void releaseMiniheapLocked(MiniHeap *mh, int sizeClass) {
     // ensure this flag is always set with the miniheap lock held
     mh->unsetAttached();
-    _littleheaps[sizeClass].postFree(mh, mh->inUseCount());
+    trackerFor(mh).postFree(mh, mh->inUseCount());
   }
 
   template <uint32_t Size>
@@ -137,7 +171,7 @@ public:
 
   template <uint32_t Size>
   inline void allocSmallMiniheaps(int sizeClass, uint32_t objectSize, FixedArray<MiniHeap, Size> &miniheaps,
-                                  pid_t current) {
+                                  pid_t current, LifetimeGroup group = LifetimeGroup::Default) {
     lock_guard<mutex> lock(_miniheapLock);
 
     d_assert(sizeClass >= 0);
@@ -161,7 +195,10 @@ public:
     d_assert(miniheaps.size() == 0);
 
     // check our bins for a miniheap to reuse
-    auto bytesFree = _littleheaps[sizeClass].selectForReuse(miniheaps, current);
+    auto bytesFree = trackerFor(group, sizeClass).selectForReuse(miniheaps, current);
+    for (auto mh : miniheaps) {
+      Super::forgetPurgedPages(mh->span(), _prefaultRefills);
+    }
     if (bytesFree >= kMiniheapRefillGoalSize || miniheaps.full()) {
       return;
     }
@@ -174,7 +211,11 @@ public:
     const size_t pageCount = PageCount(objectSize * objectCount);
 
     while (bytesFree < kMiniheapRefillGoalSize && !miniheaps.full()) {
-      auto mh = allocMiniheapLocked(sizeClass, pageCount, objectCount, objectSize);
+      auto mh = allocMiniheapLocked(sizeClass, pageCount, objectCount, objectSize, 1, group);
+      // only the compact group can run out of arena
+      if (unlikely(mh == nullptr)) {
+        break;
+      }
       d_assert(!mh->isAttached());
       mh->setAttached(current);
       miniheaps.append(mh);
@@ -185,7 +226,7 @@ public:
   }
 
   // large, page-multiple allocations
-  void *ATTRIBUTE_NEVER_INLINE malloc(size_t sz);
+  void *ATTRIBUTE_NEVER_INLINE malloc(size_t sz, LifetimeGroup group = LifetimeGroup::Default);
 
   inline MiniHeap *miniheapFor(const void *ptr) const {
     auto mh = reinterpret_cast<MiniHeap *>(Super::lookupMiniheap(ptr));
@@ -202,13 +243,21 @@ public:
     return MiniHeapID{_mhAllocator.offsetFor(mh)};
   }
 
+  inline BinnedTracker &trackerFor(LifetimeGroup group, int sizeClass) {
+    return _littleheaps[static_cast<size_t>(group)][sizeClass];
+  }
+
+  inline BinnedTracker &trackerFor(const MiniHeap *mh) {
+    return trackerFor(mh->lifetimeGroup(), mh->sizeClass());
+  }
+
   void trackMiniheapLocked(MiniHeap *mh) {
-    _littleheaps[mh->sizeClass()].add(mh);
+    trackerFor(mh).add(mh);
   }
 
   void untrackMiniheapLocked(MiniHeap *mh) {
     _stats.mhAllocCount -= 1;
-    _littleheaps[mh->sizeClass()].remove(mh);
+    trackerFor(mh).remove(mh);
   }
 
   void freeFor(MiniHeap *mh, void *ptr);
@@ -247,7 +296,9 @@ public:
     for (size_t i = 0; i < last; i++) {
       MiniHeap *mh = toFree[i];
       const bool isMeshed = mh->isMeshed();
-      const auto type = isMeshed ? internal::PageType::Meshed : internal::PageType::Dirty;
+      auto type = isMeshed ? internal::PageType::Meshed : internal::PageType::Dirty;
+      if (mh->isHugePage())
+        type = internal::PageType::HugePage;
       Super::free(reinterpret_cast<void *>(mh->getSpanStart(arenaBegin())), spanSize, type);
       _stats.mhFreeCount++;
       freeMiniheapAfterMeshLocked(mh, untrack);
@@ -257,9 +308,11 @@ public:
   }
 
   inline void flushBinLocked(size_t sizeClass) {
-    auto emptyMiniheaps = _littleheaps[sizeClass].getFreeMiniheaps();
-    for (size_t i = 0; i < emptyMiniheaps.size(); i++) {
-      freeMiniheapLocked(emptyMiniheaps[i], false);
+    for (size_t g = 0; g < kLifetimeGroupCount; g++) {
+      auto emptyMiniheaps = _littleheaps[g][sizeClass].getFreeMiniheaps();
+      for (size_t i = 0; i < emptyMiniheaps.size(); i++) {
+        freeMiniheapLocked(emptyMiniheaps[i], false);
+      }
     }
   }
 
@@ -273,6 +326,8 @@ public:
     auto mh = miniheapFor(ptr);
     if (likely(mh)) {
       return mh->objectSize();
+    } else if (auto heap = SharedHeap::heapFor(ptr)) {
+      return heap->getSize(ptr);
     } else {
       return 0;
     }
@@ -289,6 +344,15 @@ public:
     _meshPeriodMs = period;
   }
 
+  // prefault the clean pages of spans for new size class MiniHeaps,
+  // and of large allocations of at least largeThreshold bytes (0
+  // leaves large allocations alone)
+  void setPrefault(bool refills, size_t largeThreshold) {
+    lock_guard<mutex> lock(_miniheapLock);
+    _prefaultRefills = refills;
+    _prefaultThreshold = largeThreshold;
+  }
+
   void lock() {
     _miniheapLock.lock();
     // internal::Heap().lock();
@@ -303,6 +367,10 @@ public:
   // after call to meshLocked() completes src is a nullptr
   void ATTRIBUTE_NEVER_INLINE meshLocked(MiniHeap *dst, MiniHeap *&src);
 
+  // whether a pair found by meshAllSizeClasses' unlocked search can
+  // still be meshed -- must be called LOCKED
+  bool stillMeshableLocked(const MiniHeap *a, const MiniHeap *b) const;
+
   inline void ATTRIBUTE_ALWAYS_INLINE maybeMesh() {
     if (!kMeshingEnabled) {
       return;
@@ -323,9 +391,16 @@ public:
       return;
     }
 
-    lock_guard<mutex> lock(_miniheapLock);
+    // the pass stays due until a thread outside of a critical section
+    // (or the purger) gets here
+    if (unlikely(Super::inCriticalSection())) {
+      Super::deferWork();
+      return;
+    }
 
     {
+      lock_guard<mutex> lock(_miniheapLock);
+
       // ensure if two threads tried to grab the mesh lock at the same
       // time, the second one bows out gracefully without meshing
       // twice in a row.
@@ -335,30 +410,127 @@ public:
       if (unlikely(duration < _meshPeriodMs)) {
         return;
       }
-    }
 
-    _lastMesh = now;
+      _lastMesh = now;
+    }
 
     meshAllSizeClasses();
   }
 
-  inline bool okToProceed(void *ptr) const {
+  // returns one queued dirty span to the OS; false if none are
+  // queued.  The lock is only held to take the span off the queue and
+  // to hand it to the clean pages afterwards.
+  bool purgeQueuedSpan() {
+    Span span(0, 0);
+    {
+      lock_guard<mutex> lock(_miniheapLock);
+      if (!Super::takePurgeWork(span)) {
+        return false;
+      }
+    }
+
+    Super::purgeSpan(span);
+
     lock_guard<mutex> lock(_miniheapLock);
+    Super::finishPurge(span);
+    return true;
+  }
 
-    if (ptr == nullptr)
+  // the meshing and purging critical sections deferred to the purger
+  // thread (see MeshableArena::deferWork)
+  void runDeferredWork() {
+    {
+      lock_guard<mutex> lock(_miniheapLock);
+      Super::purgeExcessDirty();
+      maybeDecayLocked();
+    }
+    maybeMesh();
+  }
+
+  // body of the background purger thread
+  void ATTRIBUTE_NEVER_INLINE purgeLoop() {
+    while (true) {
+      const auto seq = Super::purgeSeq();
+      if (Super::takeDeferredWork()) {
+        runDeferredWork();
+        continue;
+      }
+      if (!purgeQueuedSpan()) {
+        Super::waitForPurgeWork(seq);
+      }
+    }
+  }
+
+  // once per decay epoch, retire the empty miniheaps cached in the
+  // bins (their spans join the dirty pages) and purge the dirty pages
+  // that have aged past the decay curve -- must be called LOCKED
+  inline void maybeDecayLocked() {
+    const auto now = time::now();
+    const bool epochElapsed = Super::decayEpochElapsed(now);
+    // free pages of MiniHeaps still in use are left for a whole decay
+    // period between passes, and never less than a mesh period: each
+    // pass walks every partial MiniHeap with a multi-page span
+    const bool pagePurgeDue = now - _lastPagePurge >= std::max(Super::dirtyDecay(), kMeshPeriodMs);
+    if (likely(!epochElapsed && !pagePurgeDue)) {
+      return;
+    }
+
+    if (unlikely(Super::inCriticalSection())) {
+      Super::deferWork();
+      return;
+    }
+
+    if (epochElapsed) {
+      flushAllBins();
+      Super::decayDirty(now);
+    }
+
+    if (pagePurgeDue) {
+      _lastPagePurge = now;
+      purgeFreeMiniheapPagesLocked();
+    }
+  }
+
+  inline bool okToProceed(void *ptr) {
+    if (ptr == nullptr || !contains(ptr))
       return false;
 
-    return miniheapFor(ptr) != nullptr;
+    if (unlikely(forkInProgress())) {
+      // wait for the part of the arena we faulted on to be moved out
+      // from under our forked child
+      Super::waitForForkMove(ptr);
+    }
+
+    // wait only for the span we faulted on to be finalized
+    Super::waitForMesh(ptr);
+
+    return Super::isTracked(ptr);
   }
 
-  inline internal::vector<MiniHeap *> meshingCandidates(int sizeClass) const {
-    return _littleheaps[sizeClass].meshingCandidates(kOccupancyCutoff);
+  inline internal::vector<MiniHeap *> meshingCandidates(int sizeClass,
+                                                        LifetimeGroup group = LifetimeGroup::Default) const {
+    const auto &tracker = _littleheaps[static_cast<size_t>(group)][sizeClass];
+    return tracker.meshingCandidates(_meshPolicy[sizeClass].occupancyCutoff);
+  }
+
+  LifetimeClassifier &lifetimeClassifier() {
+    return _lifetimeClassifier;
   }
 
 private:
-  // check for meshes in all size classes -- must be called LOCKED
+  // check for meshes in all size classes -- must be called UNLOCKED.
+  // Candidates are copied with the lock held, searched for meshable
+  // pairs without it, and the pairs meshed with it held again.
   void meshAllSizeClasses();
 
+  // return the pages of partially full, multi-page MiniHeaps whose
+  // objects are all free to the OS -- must be called LOCKED
+  void purgeFreeMiniheapPagesLocked();
+
+  // handles the "mesh.class.<n>.*" and "stats.class.<n>.*" mallctl
+  // namespaces -- must be called LOCKED
+  int classMallctl(const char *name, void *oldp, size_t *oldlenp, void *newp, size_t newlen);
+
   const size_t _maxObjectSize;
   atomic_size_t _lastMeshEffective{0};
   atomic_size_t _meshPeriod{kDefaultMeshPeriod};
@@ -368,7 +540,18 @@ private:
 
   MWC _fastPrng;
 
-  BinnedTracker _littleheaps[kNumBins];
+  // MiniHeaps of different lifetime groups are tracked (and meshed)
+  // separately, so a partially-full long-lived span is never handed
+  // out for short-lived objects
+  BinnedTracker _littleheaps[kLifetimeGroupCount][kNumBins];
+
+  bool _prefaultRefills{false};
+  size_t _prefaultThreshold{0};
+
+  MeshPolicy _meshPolicy[kNumBins]{};
+  MeshClassStats _meshStats[kNumBins]{};
+
+  LifetimeClassifier _lifetimeClassifier{};
 
   mutable mutex _miniheapLock{};
 
@@ -377,6 +560,7 @@ private:
   std::chrono::milliseconds _meshPeriodMs{kMeshPeriodMs};
   // XXX: should be atomic, but has exception spec?
   time::time_point _lastMesh;
+  time::time_point _lastPagePurge;
 };
 }  // namespace mesh
 
@@ -13,6 +13,7 @@
 #endif
 
 #include <atomic>
+#include <set>
 #include <unordered_set>
 
 #include <signal.h>
@@ -49,7 +50,8 @@ enum PageType {
   Clean = 0,
   Dirty = 1,
   Meshed = 2,
-  Unknown = 3,
+  HugePage = 3,
+  Unknown = 4,
 };
 }  // namespace internal
 
@@ -86,6 +88,7 @@ private:
 class MiniHeap;
 MiniHeap *GetMiniHeap(const MiniHeapID id);
 MiniHeapID GetMiniHeapID(const MiniHeap *mh);
+uintptr_t GetSpanStart(uintptr_t ptrval);
 
 typedef uint32_t Offset;
 typedef uint32_t Length;
@@ -161,6 +164,19 @@ inline void *MaskToPage(const void *ptr) {
 
 // efficiently copy data from srcFd to dstFd
 int copyFile(int dstFd, int srcFd, off_t off, size_t sz);
+// copy sz bytes at off in srcFd to the same offset in dstFd in the
+// kernel, without using either file position (so can be called
+// concurrently on the same fds).  Returns 0, or -1 and errno (ENOSYS,
+// EXDEV, ...) if it couldn't be done.
+int copyFileRange(int dstFd, int srcFd, off_t off, size_t sz);
+
+// block while *word == val (or until woken, spuriously or not).
+// shared is for words in memory shared with other processes.
+void futexWait(std::atomic<uint32_t> *word, uint32_t val, bool shared = false);
+// like futexWait, but gives up after timeout
+void futexWaitFor(std::atomic<uint32_t> *word, uint32_t val, std::chrono::milliseconds timeout, bool shared = false);
+// wake all threads blocked in futexWait on word
+void futexWake(std::atomic<uint32_t> *word, bool shared = false);
 
 // for mesh-internal data structures, like heap metadata
 class Heap : public ExactlyOneHeap<LockedHeap<PosixLockType, PartitionedHeap>> {
@@ -199,6 +215,9 @@ using unordered_set = std::unordered_set<K, hash<K>, equal_to<K>, STLAllocator<K
 template <typename K, typename V>
 using map = std::map<K, V, std::less<K>, STLAllocator<pair<const K, V>, Heap>>;
 
+template <typename K, typename Compare = std::less<K>>
+using set = std::set<K, Compare, STLAllocator<K, Heap>>;
+
 typedef std::basic_string<char, std::char_traits<char>, STLAllocator<char, Heap>> string;
 
 template <typename T>
@@ -5,6 +5,7 @@
 
 #include <stdlib.h>
 
+#include "plasma/mesh.h"
 #include "runtime.h"
 #include "thread_local_heap.h"
 
@@ -26,6 +27,44 @@ static __attribute__((constructor)) void libmesh_init() {
     runtime().setMeshPeriodMs(std::chrono::milliseconds{period});
   }
 
+  char *decayStr = getenv("MESH_DIRTY_DECAY_MS");
+  if (decayStr) {
+    long decay = strtol(decayStr, nullptr, 10);
+    if (decay < 0) {
+      decay = 0;
+    }
+    runtime().setDirtyDecay(std::chrono::milliseconds{decay});
+  }
+
+  char *prefaultStr = getenv("MESH_PREFAULT");
+  char *prefaultThresholdStr = getenv("MESH_PREFAULT_THRESHOLD");
+  if (prefaultStr || prefaultThresholdStr) {
+    const bool refills = prefaultStr && atoi(prefaultStr);
+    const size_t threshold = prefaultThresholdStr ? strtoul(prefaultThresholdStr, nullptr, 10) : 0;
+    runtime().setPrefault(refills, threshold);
+  }
+
+  char *forkCopyStr = getenv("MESH_FORK_COPY_THREADS");
+  if (forkCopyStr)
+    runtime().setForkCopyThreads(strtoul(forkCopyStr, nullptr, 10));
+
+  char *forkWaitStr = getenv("MESH_FORK_CHILD_WAIT_MS");
+  if (forkWaitStr) {
+    long wait = strtol(forkWaitStr, nullptr, 10);
+    if (wait < 0) {
+      wait = 0;
+    }
+    runtime().setForkChildWait(std::chrono::milliseconds{wait});
+  }
+
+  char *purgeStr = getenv("MESH_BACKGROUND_PURGE");
+  if (purgeStr && atoi(purgeStr))
+    runtime().startPurgeThread();
+
+  char *segregateStr = getenv("MESH_LIFETIME_SEGREGATION");
+  if (segregateStr && atoi(segregateStr))
+    LifetimeClassifier::setEnabled(true);
+
   char *bgThread = getenv("MESH_BACKGROUND_THREAD");
   if (!bgThread)
     return;
@@ -64,6 +103,12 @@ static void *cxxNewSlowpath(size_t sz) {
 
 ATTRIBUTE_NEVER_INLINE
 static void freeSlowpath(void *ptr) {
+  ThreadLocalHeap *localHeap = ThreadLocalHeap::UnparkHeap();
+  if (unlikely(localHeap != nullptr)) {
+    localHeap->free(ptr);
+    return;
+  }
+
   // instead of instantiating a thread-local heap on free, just free
   // to the global heap directly
   runtime().heap().free(ptr);
@@ -92,6 +137,26 @@ static void *memalignSlowpath(size_t alignment, size_t size) {
   ThreadLocalHeap *localHeap = ThreadLocalHeap::GetHeap();
   return localHeap->memalign(alignment, size);
 }
+
+static inline LifetimeGroup groupForHint(mesh_hint_t hint) {
+  switch (hint) {
+  case MESH_HINT_SHORT_LIVED:
+    return LifetimeGroup::ShortLived;
+  case MESH_HINT_LONG_LIVED:
+    return LifetimeGroup::LongLived;
+  default:
+    return LifetimeGroup::Default;
+  }
+}
+
+static void *cxxNewHint(size_t sz, mesh_hint_t hint) {
+  void *ptr = mesh_malloc_hint(sz, hint);
+  if (unlikely(ptr == nullptr && sz != 0)) {
+    throw std::bad_alloc();
+  }
+
+  return ptr;
+}
 }  // namespace mesh
 
 extern "C" MESH_EXPORT CACHELINE_ALIGNED_FN void *mesh_malloc(size_t sz) {
@@ -100,6 +165,10 @@ extern "C" MESH_EXPORT CACHELINE_ALIGNED_FN void *mesh_malloc(size_t sz) {
     return mesh::allocSlowpath(sz);
   }
 
+  if (unlikely(LifetimeClassifier::enabled())) {
+    return localHeap->segregatedMalloc(sz, __builtin_return_address(0));
+  }
+
   return localHeap->malloc(sz);
 }
 #define xxmalloc mesh_malloc
@@ -166,6 +235,43 @@ extern "C" MESH_EXPORT CACHELINE_ALIGNED_FN void *mesh_calloc(size_t count, size
   return localHeap->calloc(count, size);
 }
 
+extern "C" MESH_EXPORT void *mesh_malloc_hint(size_t sz, mesh_hint_t hint) {
+  ThreadLocalHeap *localHeap = ThreadLocalHeap::GetHeap();
+  return localHeap->groupMalloc(sz, mesh::groupForHint(hint));
+}
+
+static_assert(MESH_COMPACT_SHIFT == mesh::kCompactPointerShift, "plasma/mesh.h out of sync with common.h");
+
+extern "C" MESH_EXPORT void *mesh_malloc_compact(size_t sz) {
+  ThreadLocalHeap *localHeap = ThreadLocalHeap::GetHeap();
+  void *ptr = localHeap->groupMalloc(sz, LifetimeGroup::Compact);
+  if (unlikely(ptr == nullptr)) {
+    errno = ENOMEM;
+  }
+  return ptr;
+}
+
+extern "C" MESH_EXPORT void *mesh_compact_base(void) {
+  return mesh::runtime().heap().arenaBegin();
+}
+
+MESH_EXPORT void *operator new(size_t sz, mesh_hint_t hint) {
+  return mesh::cxxNewHint(sz, hint);
+}
+
+MESH_EXPORT void *operator new[](size_t sz, mesh_hint_t hint) {
+  return mesh::cxxNewHint(sz, hint);
+}
+
+// only called if a constructor throws after a hinted operator new
+MESH_EXPORT void operator delete(void *ptr, mesh_hint_t hint) noexcept {
+  mesh_free(ptr);
+}
+
+MESH_EXPORT void operator delete[](void *ptr, mesh_hint_t hint) noexcept {
+  mesh_free(ptr);
+}
+
 extern "C" {
 #ifdef __linux__
 size_t MESH_EXPORT mesh_usable_size(void *ptr) __attribute__((weak, alias("mesh_malloc_usable_size")));
@@ -212,6 +318,46 @@ int MESH_EXPORT mesh_mallctl(const char *name, void *oldp, size_t *oldlenp, void
   return mesh::runtime().heap().mallctl(name, oldp, oldlenp, newp, newlen);
 }
 
+void MESH_EXPORT mesh_critical_enter(void) {
+  mesh::GlobalHeap::enterCritical();
+}
+
+void MESH_EXPORT mesh_critical_exit(void) {
+  mesh::GlobalHeap::exitCritical();
+}
+
+static inline mesh::SharedHeap *sharedHeap(mesh_shared_heap_t *heap) {
+  return reinterpret_cast<mesh::SharedHeap *>(heap);
+}
+
+extern "C" MESH_EXPORT mesh_shared_heap_t *mesh_shared_heap_create(const char *name, size_t capacity) {
+  return reinterpret_cast<mesh_shared_heap_t *>(mesh::SharedHeap::create(name, capacity));
+}
+
+extern "C" MESH_EXPORT mesh_shared_heap_t *mesh_shared_heap_recv(int sock) {
+  return reinterpret_cast<mesh_shared_heap_t *>(mesh::SharedHeap::recv(sock));
+}
+
+extern "C" MESH_EXPORT int mesh_shared_heap_send(mesh_shared_heap_t *heap, int sock) {
+  return sharedHeap(heap)->send(sock);
+}
+
+extern "C" MESH_EXPORT void *mesh_shared_malloc(mesh_shared_heap_t *heap, size_t sz) {
+  return sharedHeap(heap)->malloc(sz);
+}
+
+extern "C" MESH_EXPORT void *mesh_shared_heap_base(mesh_shared_heap_t *heap) {
+  return sharedHeap(heap)->base();
+}
+
+extern "C" MESH_EXPORT int mesh_shared_heap_fd(mesh_shared_heap_t *heap) {
+  return sharedHeap(heap)->fd();
+}
+
+extern "C" MESH_EXPORT void mesh_shared_heap_close(mesh_shared_heap_t *heap) {
+  mesh::SharedHeap::destroy(sharedHeap(heap));
+}
+
 #ifdef __linux__
 
 int MESH_EXPORT epoll_wait(int __epfd, struct epoll_event *__events, int __maxevents, int __timeout) {
@@ -0,0 +1,151 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2019 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+#pragma once
+#ifndef MESH__LIFETIME_CLASSIFIER_H
+#define MESH__LIFETIME_CLASSIFIER_H
+
+#include <atomic>
+
+#include "internal.h"
+
+#include "rng/mwc.h"
+
+namespace mesh {
+
+// Learns how long objects from each allocation site live, from a
+// small sample of allocations, and maps sites to lifetime groups.
+// Sites are keyed by a hash of the caller's return address; two sites
+// hashing to the same slot simply share an estimate.
+class LifetimeClassifier {
+private:
+  DISALLOW_COPY_AND_ASSIGN(LifetimeClassifier);
+
+public:
+  static constexpr size_t kSiteCount = 1 << kLifetimeSiteBits;
+
+  LifetimeClassifier() {
+  }
+
+  static inline bool ATTRIBUTE_ALWAYS_INLINE enabled() {
+    return _enabled.load(std::memory_order_relaxed);
+  }
+
+  static void setEnabled(bool enabled) {
+    _enabled.store(enabled, std::memory_order_relaxed);
+  }
+
+  static inline uint32_t siteFor(const void *returnAddress) {
+    const auto key = reinterpret_cast<uintptr_t>(returnAddress);
+    return static_cast<uint32_t>((key * 0x9E3779B97F4A7C15ULL) >> (64 - kLifetimeSiteBits));
+  }
+
+  inline LifetimeGroup groupFor(uint32_t site) const {
+    d_assert(site < kSiteCount);
+    const auto estimate = _lifetimeMs[site].load(std::memory_order_relaxed);
+    return estimate >= kLongLivedLifetime.count() ? LifetimeGroup::LongLived : LifetimeGroup::Default;
+  }
+
+  // fold an observed lifetime into the site's moving average; a site's
+  // first sample seeds it, so one long-lived sample is enough to
+  // classify a new site.  Racing updates from different threads just
+  // lose a sample.
+  inline void record(uint32_t site, uint32_t lifetimeMs) {
+    d_assert(site < kSiteCount);
+    auto &estimate = _lifetimeMs[site];
+    const auto old = estimate.load(std::memory_order_relaxed);
+    if (old == 0) {
+      estimate.store(lifetimeMs > 0 ? lifetimeMs : 1, std::memory_order_relaxed);
+      return;
+    }
+    estimate.store(old - old / 8 + lifetimeMs / 8, std::memory_order_relaxed);
+  }
+
+private:
+  atomic<uint32_t> _lifetimeMs[kSiteCount]{};
+
+  static atomic<bool> _enabled;
+};
+
+// per-thread record of sampled, still-live allocations.  Only frees
+// on the allocating thread are observed.
+class LifetimeSampler {
+private:
+  DISALLOW_COPY_AND_ASSIGN(LifetimeSampler);
+
+public:
+  static constexpr size_t kSlotCount = 8;
+
+  LifetimeSampler() {
+  }
+
+  inline bool ATTRIBUTE_ALWAYS_INLINE shouldSample() {
+    return --_countdown == 0;
+  }
+
+  void sample(LifetimeClassifier &classifier, MWC &prng, void *ptr, uint32_t site) {
+    // jitter the period so periodic allocation patterns can't hide
+    _countdown = prng.inRange(1, 2 * kLifetimeSamplePeriod - 1);
+
+    const auto now = time::now();
+    // a free slot, or one whose object was freed on another thread
+    // and has just been handed out again
+    Slot *slot = nullptr;
+    for (auto &candidate : _slots) {
+      if (candidate.ptr == nullptr || candidate.ptr == ptr) {
+        slot = &candidate;
+        break;
+      }
+    }
+    // with every slot taken, evict a sample that has lived well past
+    // the long-lived threshold: that lower bound on its lifetime is all
+    // we learn from it, and it has to sit clearly above the threshold
+    // for the site's average to cross it.  Otherwise drop this sample
+    // rather than lose one that may still turn out to be long-lived.
+    for (size_t i = 0; slot == nullptr && i < kSlotCount; i++) {
+      const auto age = elapsedMs(_slots[i].start, now);
+      if (age >= 2 * kLongLivedLifetime.count()) {
+        classifier.record(_slots[i].site, age);
+        slot = &_slots[i];
+      }
+    }
+    if (slot == nullptr) {
+      return;
+    }
+
+    slot->ptr = ptr;
+    slot->site = site;
+    slot->start = now;
+  }
+
+  inline void onFree(LifetimeClassifier &classifier, const void *ptr) {
+    for (size_t i = 0; i < kSlotCount; i++) {
+      Slot &slot = _slots[i];
+      if (slot.ptr == ptr) {
+        classifier.record(slot.site, elapsedMs(slot.start, time::now()));
+        slot.ptr = nullptr;
+        return;
+      }
+    }
+  }
+
+private:
+  static inline uint32_t elapsedMs(time::time_point start, time::time_point now) {
+    const auto ms = chrono::duration_cast<chrono::milliseconds>(now - start).count();
+    return ms > UINT32_MAX ? UINT32_MAX : static_cast<uint32_t>(ms);
+  }
+
+  struct Slot {
+    const void *ptr{nullptr};
+    uint32_t site{0};
+    time::time_point start{};
+  };
+
+  Slot _slots[kSlotCount]{};
+  uint32_t _countdown{kLifetimeSamplePeriod};
+};
+}  // namespace mesh
+
+#endif  // MESH__LIFETIME_CLASSIFIER_H
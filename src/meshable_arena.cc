@@ -19,7 +19,10 @@
 #include <linux/memfd.h>
 #endif
 
+#include <poll.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
 
 #include <algorithm>
 
@@ -28,11 +31,14 @@
 #include "mini_heap.h"
 
 #include "runtime.h"
+#include "thread_local_heap.h"
 
 namespace mesh {
 
 static void *arenaInstance;
 
+__thread uint32_t MeshableArena::_criticalDepth ATTR_INITIAL_EXEC;
+
 static const char *const TMP_DIRS[] = {
     "/dev/shm",
     "/tmp",
@@ -42,24 +48,20 @@ MeshableArena::MeshableArena() : SuperHeap() {
   d_assert(arenaInstance == nullptr);
   arenaInstance = this;
 
-  int fd = -1;
-  if (kMeshingEnabled) {
-    fd = openSpanFile(kArenaSize);
-    if (fd < 0) {
-      debug("mesh: opening arena file failed.\n");
-      abort();
-    }
-  }
-  _fd = fd;
-  _arenaBegin = SuperHeap::map(kArenaSize, kMapShared, fd);
-  _mhIndex = reinterpret_cast<atomic<MiniHeapID> *>(SuperHeap::malloc(indexSize()));
-
-  hard_assert(_arenaBegin != nullptr);
-  hard_assert(_mhIndex != nullptr);
-
-  if (kAdviseDump) {
-    madvise(_arenaBegin, kArenaSize, MADV_DONTDUMP);
-  }
+  // reserve address space for every segment up front, so page
+  // offsets stay contiguous as the arena grows.  The arena starts on
+  // a huge page boundary so that huge page regions are aligned both
+  // in memory and in the shard files.
+  auto reservation = reinterpret_cast<char *>(
+      mmap(nullptr, kArenaMaxSize + kHugePageSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0));
+  hard_assert_msg(reservation != MAP_FAILED, "mesh: arena reservation failed: %d", errno);
+  const auto head = (kHugePageSize - reinterpret_cast<uintptr_t>(reservation) % kHugePageSize) % kHugePageSize;
+  if (head > 0)
+    munmap(reservation, head);
+  munmap(reservation + head + kArenaMaxSize, kHugePageSize - head);
+  _arenaBegin = reservation + head;
+  std::fill(std::begin(_childFds), std::end(_childFds), -1);
+  addShard();
 
   // debug("MeshableArena(%p): fd:%4d\t%p-%p\n", this, fd, _arenaBegin, arenaEnd());
 
@@ -100,65 +102,91 @@ char *MeshableArena::openSpanDir(int pid) {
   return nullptr;
 }
 
-void MeshableArena::expandArena(Length minPagesAdded) {
-  const size_t pageCount = std::max(minPagesAdded, kMinArenaExpansion);
-
-  Span expansion(_end, pageCount);
-  _end += pageCount;
+void MeshableArena::addShard() {
+  ensureForkCopied();
 
-  if (unlikely(_end >= kArenaSize / kPageSize)) {
-    debug("Mesh: arena exhausted: current arena size is %.1f GB; recompile with larger arena size.",
-          kArenaSize / 1024.0 / 1024.0 / 1024.0);
+  const size_t shard = shardCount();
+  if (unlikely(shard >= kArenaMaxShards)) {
+    debug("Mesh: arena exhausted: all %zu segments (%.1f GB) in use.", kArenaMaxSegments,
+          kArenaMaxSize / 1024.0 / 1024.0 / 1024.0);
     abort();
   }
 
-  _clean[expansion.spanClass()].push_back(expansion);
+  int fd = -1;
+  if (kMeshingEnabled) {
+    fd = openSpanFile(kArenaShardSize);
+    if (fd < 0) {
+      debug("mesh: opening arena file failed.\n");
+      abort();
+    }
+  }
+
+  void *shardBegin = ptrFromOffset(shard * kArenaShardPages);
+  void *ptr = mmap(shardBegin, kArenaShardSize, HL_MMAP_PROTECTION_MASK, kMapShared | MAP_FIXED, fd, 0);
+  hard_assert_msg(ptr != MAP_FAILED, "mesh: mapping arena shard failed: %d", errno);
+  if (kAdviseDump) {
+    madvise(shardBegin, kArenaShardSize, MADV_DONTDUMP);
+  }
+  _shardFds[shard] = fd;
+
+  const size_t pageCount = (shard + 1) * kArenaShardPages;
+  commitTo(_meshedBitmapCommitted, reinterpret_cast<char *>(_meshedBitmap.mut_bits()) +
+                                       bitmap::representationSize(pageCount));
+  _meshedBitmap.extend(pageCount);
+
+  _shardCount.store(shard + 1, std::memory_order_release);
 }
 
-bool MeshableArena::findPagesInner(internal::vector<Span> freeSpans[kSpanClassCount], const size_t i,
-                                   const Length pageCount, Span &result) {
-  internal::vector<Span> &spanList = freeSpans[i];
-  if (spanList.empty())
-    return false;
+bool MeshableArena::canExpandArena(Length minPagesAdded) const {
+  const Length segmentRest = kArenaSegmentPages - _end % kArenaSegmentPages;
+  const size_t end = segmentRest < minPagesAdded ? _end + segmentRest : _end;
+  return end + minPagesAdded <= kArenaMaxSize / kPageSize;
+}
 
-  size_t oldLen = spanList.size();
+void MeshableArena::expandArena(Length minPagesAdded) {
+  hard_assert_msg(minPagesAdded <= kArenaSegmentPages, "Mesh: %u page allocation is larger than an arena segment",
+                  minPagesAdded);
+
+  // spans can't cross segments: if the request doesn't fit in what
+  // is left of this segment, free the rest and start the next one
+  Length segmentRest = kArenaSegmentPages - _end % kArenaSegmentPages;
+  if (segmentRest < minPagesAdded) {
+    _clean.add(Span(_end, segmentRest));
+    _end += segmentRest;
+    segmentRest = kArenaSegmentPages;
+  }
 
-  if (i == kSpanClassCount - 1 && spanList.back().length < pageCount) {
-    // the final span class contains (and is the only class to
-    // contain) variable-size spans, so we need to make sure we
-    // search through all candidates in this case.
-    for (size_t j = 0; j < spanList.size() - 1; j++) {
-      if (spanList[j].length >= pageCount) {
-        std::swap(spanList[j], spanList.back());
-        break;
-      }
-    }
+  const Length pageCount = std::min(std::max(minPagesAdded, kMinArenaExpansion), segmentRest);
 
-    // check that we found something in the above loop. this would be
-    // our last loop iteration anyway
-    if (spanList.back().length < pageCount) {
-      return false;
-    }
+  Span expansion(_end, pageCount);
+  _end += pageCount;
+
+  while (shardCount() * kArenaShardPages < _end) {
+    addShard();
   }
 
-  Span span = spanList.back();
-  spanList.pop_back();
+  _clean.add(expansion);
+}
 
-#ifndef NDEBUG
-  d_assert_msg(oldLen == spanList.size() + 1, "pageCount:%zu,%zu -- %zu/%zu", pageCount, i, oldLen, spanList.size());
-  for (size_t j = 0; j < spanList.size(); j++) {
-    d_assert(spanList[j] != span);
+bool MeshableArena::findPagesInner(SpanFreeList &freeSpans, const Length pageCount, const Length pageAlignment,
+                                   Span &result, const Length minOffset) {
+  if (pageAlignment > 1) {
+    // alignment is of the address, not the offset: the arena is
+    // huge page aligned, but alignments may be larger than that
+    const Length alignPhase = (ptrvalFromOffset(0) / kPageSize) % pageAlignment;
+    return freeSpans.findAlignedFit(pageCount, pageAlignment, alignPhase, result, minOffset);
   }
-#endif
 
-  // this invariant should be maintained
-  d_assert(span.length >= i + 1);
+  Span span(0, 0);
+  if (!freeSpans.findBestFit(pageCount, span, minOffset))
+    return false;
+
   d_assert(span.length >= pageCount);
 
   // put the part we don't need back in the reuse pile
   Span rest = span.splitAfter(pageCount);
   if (!rest.empty()) {
-    freeSpans[rest.spanClass()].push_back(rest);
+    freeSpans.add(rest);
   }
   d_assert(span.length == pageCount);
 
@@ -166,80 +194,70 @@ bool MeshableArena::findPagesInner(internal::vector<Span> freeSpans[kSpanClassCo
   return true;
 }
 
-bool MeshableArena::findPages(const Length pageCount, Span &result, internal::PageType &type) {
+bool MeshableArena::findPages(const Length pageCount, const Length pageAlignment, const Length minOffset, Span &result,
+                              internal::PageType &type) {
   // Search through all dirty spans first.  We don't worry about
   // fragmenting dirty pages, as being able to reuse dirty pages means
   // we don't increase RSS.
-  for (size_t i = Span(0, pageCount).spanClass(); i < kSpanClassCount; i++) {
-    if (findPagesInner(_dirty, i, pageCount, result)) {
-      type = internal::PageType::Dirty;
-      return true;
-    }
+  if (findPagesInner(_dirty, pageCount, pageAlignment, result, minOffset)) {
+    type = internal::PageType::Dirty;
+    _dirtyPageCount -= result.length;
+    return true;
   }
 
   // if no dirty pages are available, search clean pages.  An allocated
   // clean page (once it is written to) means an increased RSS.
-  for (size_t i = Span(0, pageCount).spanClass(); i < kSpanClassCount; i++) {
-    if (findPagesInner(_clean, i, pageCount, result)) {
-      type = internal::PageType::Clean;
-      return true;
-    }
+  if (findPagesInner(_clean, pageCount, pageAlignment, result, minOffset)) {
+    type = internal::PageType::Clean;
+    return true;
   }
 
   return false;
 }
 
-Span MeshableArena::reservePages(const Length pageCount, const Length pageAlignment) {
+bool MeshableArena::findCompactPages(const Length pageCount, Span &result, internal::PageType &type) {
+  if (_dirty.findLowestFit(pageCount, 1, kCompactArenaPages, result)) {
+    type = internal::PageType::Dirty;
+    _dirtyPageCount -= result.length;
+    return true;
+  }
+
+  if (_clean.findLowestFit(pageCount, 1, kCompactArenaPages, result)) {
+    type = internal::PageType::Clean;
+    return true;
+  }
+
+  return false;
+}
+
+Span MeshableArena::reservePages(const Length pageCount, const Length pageAlignment, internal::PageType &type) {
   d_assert(pageCount >= 1);
 
-  internal::PageType flags(internal::PageType::Unknown);
+  type = internal::PageType::Unknown;
   Span result(0, 0);
-  auto ok = findPages(pageCount, result, flags);
+  // once the arena extends past the compact window, ordinary spans
+  // are placed above it while the arena can grow, leaving the window
+  // to mesh_malloc_compact
+  auto ok = findPages(pageCount, pageAlignment, ordinaryMinOffset(), result, type);
+  // enough extra that the new span holds an aligned range wherever it
+  // lands
+  const Length expansion = pageCount + pageAlignment - 1;
+  if (!ok && canExpandArena(expansion)) {
+    expandArena(expansion);
+    ok = findPages(pageCount, pageAlignment, ordinaryMinOffset(), result, type);
+  }
   if (!ok) {
-    expandArena(pageCount);
-    ok = findPages(pageCount, result, flags);
-    hard_assert(ok);
+    ok = findPages(pageCount, pageAlignment, 0, result, type);
   }
+  hard_assert(ok);
 
   d_assert(!result.empty());
-  d_assert(flags != internal::PageType::Unknown);
-
-  if (unlikely(pageAlignment > 1 && ((ptrvalFromOffset(result.offset) / kPageSize) % pageAlignment != 0))) {
-    freeSpan(result, flags);
-    // recurse once, asking for enough extra space that we are sure to
-    // be able to find an aligned offset of pageCount pages within.
-    result = reservePages(pageCount + 2 * pageAlignment, 1);
-
-    const size_t alignment = pageAlignment * kPageSize;
-    const uintptr_t alignedPtr = (ptrvalFromOffset(result.offset) + alignment - 1) & ~(alignment - 1);
-    const auto alignedOff = offsetFor(reinterpret_cast<void *>(alignedPtr));
-    d_assert(alignedOff >= result.offset);
-    d_assert(alignedOff < result.offset + result.length);
-    const auto unwantedPageCount = alignedOff - result.offset;
-    auto alignedResult = result.splitAfter(unwantedPageCount);
-    d_assert(alignedResult.offset == alignedOff);
-    freeSpan(result, flags);
-    const auto excess = alignedResult.splitAfter(pageCount);
-    freeSpan(excess, flags);
-    result = alignedResult;
-  }
+  d_assert(type != internal::PageType::Unknown);
+  d_assert((ptrvalFromOffset(result.offset) / kPageSize) % pageAlignment == 0);
 
   return result;
 }
 
-template <typename Func>
-static void forEachFree(const internal::vector<Span> freeSpans[kSpanClassCount], const Func func) {
-  for (size_t i = 0; i < kSpanClassCount; i++) {
-    if (freeSpans[i].empty())
-      continue;
-
-    for (size_t j = 0; j < freeSpans[i].size(); j++) {
-      auto span = freeSpans[i][j];
-      func(span);
-    }
-  }
-}
-
 internal::RelaxedBitmap MeshableArena::allocatedBitmap(bool includeDirty) const {
   internal::RelaxedBitmap bitmap(_end);
 
@@ -261,14 +279,16 @@ internal::RelaxedBitmap MeshableArena::allocatedBitmap(bool includeDirty) const
     }
   };
 
-  if (includeDirty)
-    forEachFree(_dirty, unmarkPages);
-  forEachFree(_clean, unmarkPages);
+  if (includeDirty) {
+    _dirty.forEach(unmarkPages);
+    _hugeFree.forEach(unmarkPages);
+  }
+  _clean.forEach(unmarkPages);
 
   return bitmap;
 }
 
-char *MeshableArena::pageAlloc(Span &result, size_t pageCount, size_t pageAlignment) {
+char *MeshableArena::pageAlloc(Span &result, size_t pageCount, size_t pageAlignment, bool prefault) {
   if (pageCount == 0) {
     return nullptr;
   }
@@ -278,12 +298,13 @@ char *MeshableArena::pageAlloc(Span &result, size_t pageCount, size_t pageAlignm
   d_assert(pageCount >= 1);
   d_assert(pageCount < std::numeric_limits<Length>::max());
 
-  auto span = reservePages(pageCount, pageAlignment);
+  internal::PageType type(internal::PageType::Unknown);
+  auto span = reservePages(pageCount, pageAlignment, type);
   d_assert(isAligned(span, pageAlignment));
 
   d_assert(contains(ptrFromOffset(span.offset)));
 #ifndef NDEBUG
-  if (_mhIndex[span.offset].load().hasValue()) {
+  if (loadIndex(span.offset).hasValue()) {
     mesh::debug("----\n");
     auto mh = reinterpret_cast<MiniHeap *>(miniheapForArenaOffset(span.offset));
     mh->dumpDebug();
@@ -296,10 +317,171 @@ char *MeshableArena::pageAlloc(Span &result, size_t pageCount, size_t pageAlignm
     madvise(ptr, pageCount * kPageSize, MADV_DODUMP);
   }
 
+  // dirty pages are already backed by the file and mapped
+  if (prefault && type == internal::PageType::Clean) {
+    this->prefault(span);
+  }
+
   result = span;
   return ptr;
 }
 
+void MeshableArena::prefault(const Span &span) {
+  ensureForkCopied();
+  ensureForkMoved(span);
+
+  void *ptr = ptrFromOffset(span.offset);
+
+  if (likely(!_populateUnsupported)) {
+    if (madvise(ptr, span.byteLength(), MADV_POPULATE_WRITE) == 0) {
+      _prefaultedPageCount += span.length;
+      return;
+    }
+    // anything but EINVAL (e.g. ENOMEM) is left to the first touch
+    if (errno != EINVAL) {
+      return;
+    }
+    _populateUnsupported = true;
+  }
+
+#ifndef __APPLE__
+  // older kernels: at least allocate the pages of the file up front,
+  // so first touches are cheap faults mapping pages already in the
+  // page cache
+  forEachShardPart(span, [&](const Span &part) {
+    if (fallocate(fdFor(part.offset), 0, fileOffsetFor(part.offset), part.byteLength()) == 0) {
+      _prefaultedPageCount += part.length;
+    }
+  });
+#endif
+}
+
+void MeshableArena::purgeSpanPages(const Span &span, uint32_t freePages) {
+  d_assert(span.length <= kMaxPurgeableSpanPages);
+  if (unlikely(span.length > kMaxPurgeableSpanPages)) {
+    return;
+  }
+
+  const auto it = _purgedPages.find(span.offset);
+  const uint32_t toPurge = freePages & ~(it != _purgedPages.end() ? it->second : 0);
+  if (toPurge == 0) {
+    return;
+  }
+
+  forEachPageRun(span, toPurge, [&](const Span &run) {
+    purgeSpan(run);
+    _partialPurgedPageCount += run.length;
+  });
+  _purgedPages[span.offset] |= toPurge;
+}
+
+void MeshableArena::forgetPurgedPagesSlowpath(const Span &span, bool prefault) {
+  auto it = _purgedPages.find(span.offset);
+  if (it == _purgedPages.end()) {
+    return;
+  }
+
+  if (prefault) {
+    forEachPageRun(span, it->second, [&](const Span &run) { this->prefault(run); });
+  }
+  _purgedPages.erase(it);
+}
+
+char *MeshableArena::hugePageAlloc(Span &result, size_t pageCount) {
+  d_assert(pageCount >= 1);
+  hard_assert(pageCount <= kHugePagePages);
+
+  if (!findPagesInner(_hugeFree, pageCount, 1, result)) {
+    internal::PageType type(internal::PageType::Unknown);
+    auto region = reservePages(kHugePagePages, kHugePagePages, type);
+    d_assert(isAligned(region, kHugePagePages));
+
+    auto ptr = ptrFromOffset(region.offset);
+    // start from an empty stretch of the file, so the first touch can
+    // fault in a whole huge page rather than find 4k pages in place
+    freePhys(ptr, kHugePageSize);
+    madvise(ptr, kHugePageSize, MADV_HUGEPAGE);
+
+    _hugeRegions.push_back(region.offset);
+    _hugeFree.add(region);
+
+    const auto ok = findPagesInner(_hugeFree, pageCount, 1, result);
+    hard_assert(ok);
+  }
+
+  d_assert(contains(ptrFromOffset(result.offset)));
+  return reinterpret_cast<char *>(ptrFromOffset(result.offset));
+}
+
+char *MeshableArena::compactPageAlloc(Span &result, size_t pageCount, bool prefault) {
+  d_assert(pageCount >= 1);
+
+  internal::PageType type(internal::PageType::Unknown);
+  if (!findCompactPages(pageCount, result, type)) {
+    // the arena only grows into the window until it has covered it
+    if (_end >= kCompactArenaPages) {
+      return nullptr;
+    }
+    expandArena(pageCount);
+    if (!findCompactPages(pageCount, result, type)) {
+      return nullptr;
+    }
+  }
+
+  d_assert(result.offset + result.length <= kCompactArenaPages);
+  d_assert(contains(ptrFromOffset(result.offset)));
+
+  char *ptr = reinterpret_cast<char *>(ptrFromOffset(result.offset));
+
+  if (kAdviseDump) {
+    madvise(ptr, pageCount * kPageSize, MADV_DODUMP);
+  }
+
+  if (prefault && type == internal::PageType::Clean) {
+    this->prefault(result);
+  }
+
+  return ptr;
+}
+
+void MeshableArena::releaseHugePageRegions() {
+  if (_hugeFree.empty()) {
+    return;
+  }
+
+  internal::vector<Span> freeSpans{};
+  _hugeFree.forEach([&](const Span &span) { freeSpans.push_back(span); });
+  _hugeFree.clear();
+
+  // regions are aligned, so a free span covering an aligned region's
+  // worth of pages means that region is entirely unused
+  for (const auto &span : freeSpans) {
+    Offset off = span.offset;
+    const Offset end = span.offset + span.length;
+    Offset regionOff = (off + kHugePagePages - 1) / kHugePagePages * kHugePagePages;
+
+    for (; regionOff + kHugePagePages <= end; regionOff += kHugePagePages) {
+      if (regionOff > off)
+        _hugeFree.add(Span(off, regionOff - off));
+
+      const Span region(regionOff, kHugePagePages);
+      freePhys(ptrFromOffset(region.offset), kHugePageSize);
+      // a fresh mapping drops the MADV_HUGEPAGE advice
+      resetSpanMapping(region);
+      _clean.add(region);
+
+      auto it = std::find(_hugeRegions.begin(), _hugeRegions.end(), region.offset);
+      d_assert(it != _hugeRegions.end());
+      _hugeRegions.erase(it);
+
+      off = regionOff + kHugePagePages;
+    }
+
+    if (off < end)
+      _hugeFree.add(Span(off, end - off));
+  }
+}
+
 void MeshableArena::free(void *ptr, size_t sz, internal::PageType type) {
   if (unlikely(!contains(ptr))) {
     debug("invalid free of %p/%zu", ptr, sz);
@@ -314,19 +496,134 @@ void MeshableArena::free(void *ptr, size_t sz, internal::PageType type) {
   freeSpan(span, type);
 }
 
+void MeshableArena::purgeDirty(size_t pageCount) {
+  while (pageCount > 0 && !_dirty.empty()) {
+    Span span(0, 0);
+    const auto ok = _dirty.findBestFit(1, span);
+    d_assert(ok);
+
+    if (span.length > pageCount) {
+      _dirty.add(span.splitAfter(pageCount));
+    }
+
+    d_assert(_dirtyPageCount >= span.length);
+    _dirtyPageCount -= span.length;
+    pageCount -= span.length;
+
+    if (_backgroundPurge) {
+      _purgeQueue.push_back(span);
+      _purgeQueuePageCount += span.length;
+    } else {
+      purgeSpan(span);
+      _clean.add(span);
+    }
+  }
+
+  if (_backgroundPurge && !_purgeQueue.empty()) {
+    _purgeSeq.fetch_add(1, std::memory_order_release);
+    internal::futexWake(&_purgeSeq);
+  }
+}
+
+bool MeshableArena::takePurgeWork(Span &span) {
+  d_assert(_purging.empty());
+  if (_purgeQueue.empty()) {
+    return false;
+  }
+
+  span = _purgeQueue.back();
+  _purgeQueue.pop_back();
+  _purging = span;
+  return true;
+}
+
+void MeshableArena::finishPurge(const Span &span) {
+  d_assert(_purging == span);
+  _purging = Span(0, 0);
+
+  d_assert(_purgeQueuePageCount >= span.length);
+  _purgeQueuePageCount -= span.length;
+  _clean.add(span);
+}
+
+void MeshableArena::purgeSpan(const Span &span) {
+  auto ptr = ptrFromOffset(span.offset);
+  auto sz = span.byteLength();
+  madvise(ptr, sz, MADV_DONTNEED);
+  freePhys(ptr, sz);
+}
+
+bool MeshableArena::advanceDecayEpochs(time::time_point now) {
+  const auto epochLength = decayEpochLength();
+  if (epochLength.count() == 0 || now < _decayEpochStart) {
+    return false;
+  }
+
+  const auto elapsed = static_cast<size_t>((now - _decayEpochStart) / epochLength);
+  if (elapsed == 0) {
+    return false;
+  }
+
+  // pages dirtied in epochs that fall off the end of the ring are
+  // older than the decay period, and no longer allowed to linger
+  for (size_t i = 0; i < std::min(elapsed, kDirtyDecayEpochs); i++) {
+    _decayEpoch = (_decayEpoch + 1) % kDirtyDecayEpochs;
+    _dirtyBacklog[_decayEpoch] = 0;
+  }
+  _decayEpochStart += epochLength * elapsed;
+
+  return true;
+}
+
+void MeshableArena::decayDirty(time::time_point now) {
+  const auto epochLength = decayEpochLength();
+  if (epochLength.count() == 0) {
+    purgeDirty(_dirtyPageCount);
+    std::fill(std::begin(_dirtyBacklog), std::end(_dirtyBacklog), 0);
+    _decayEpochStart = now;
+    return;
+  }
+
+  if (!advanceDecayEpochs(now)) {
+    return;
+  }
+
+  // pages that have since been reused or purged shouldn't count
+  // towards the limit; take them to be the oldest ones
+  size_t backlog = 0;
+  for (const auto pages : _dirtyBacklog) {
+    backlog += pages;
+  }
+  for (size_t age = kDirtyDecayEpochs - 1; backlog > _dirtyPageCount; age--) {
+    auto &pages = _dirtyBacklog[(_decayEpoch + kDirtyDecayEpochs - age) % kDirtyDecayEpochs];
+    const auto trim = std::min(pages, backlog - _dirtyPageCount);
+    pages -= trim;
+    backlog -= trim;
+  }
+
+  // of the pages dirtied age epochs ago, 1 - smoothstep(age / epochs)
+  // may linger: all of the current epoch's, and almost none of those
+  // about to expire
+  double limit = 0;
+  for (size_t age = 0; age < kDirtyDecayEpochs; age++) {
+    const double x = static_cast<double>(age) / kDirtyDecayEpochs;
+    const double weight = 1.0 - x * x * (3.0 - 2.0 * x);
+    limit += weight * _dirtyBacklog[(_decayEpoch + kDirtyDecayEpochs - age) % kDirtyDecayEpochs];
+  }
+
+  const auto allowed = static_cast<size_t>(limit);
+  if (_dirtyPageCount > allowed) {
+    purgeDirty(_dirtyPageCount - allowed);
+  }
+}
+
 void MeshableArena::partialScavenge() {
-  forEachFree(_dirty, [&](const Span &span) {
-    auto ptr = ptrFromOffset(span.offset);
-    auto sz = span.byteLength();
-    madvise(ptr, sz, MADV_DONTNEED);
-    freePhys(ptr, sz);
-    // don't coalesce, just add to clean
-    _clean[span.spanClass()].push_back(span);
+  _dirty.forEach([&](const Span &span) {
+    purgeSpan(span);
+    _clean.add(span);
   });
 
-  for (size_t i = 0; i < kSpanClassCount; i++) {
-    _dirty[i].clear();
-  }
+  _dirty.clear();
 
   _dirtyPageCount = 0;
 }
@@ -336,114 +633,70 @@ void MeshableArena::scavenge(bool force) {
     return;
   }
 
-  // the inverse of the allocated bitmap is all of the spans in _clear
-  // (since we just MADV_DONTNEED'ed everything in dirty)
-  auto bitmap = allocatedBitmap(false);
-  bitmap.invert();
-
-  auto markPages = [&](const Span &span) {
-    for (size_t k = 0; k < span.length; k++) {
-#ifndef NDEBUG
-      if (bitmap.isSet(span.offset + k)) {
-        debug("arena: bit %zu already set (%zu/%zu) %zu\n", k, span.offset, span.length, bitmap.bitCount());
-      }
-#endif
-      bitmap.tryToSet(span.offset + k);
-    }
-  };
-
-  // first, untrack the spans in the meshed bitmap and mark them in
-  // the (method-local) unallocated bitmap
+  // free lists coalesce on insert, so released spans merge with their
+  // clean neighbours here without rebuilding anything arena-wide.
+  // First, restore the identity mapping of spans that were meshed.
   std::for_each(_toReset.begin(), _toReset.end(), [&](Span span) {
     untrackMeshed(span);
-    markPages(span);
     resetSpanMapping(span);
+    _clean.add(span);
   });
 
   // now that we've finally reset to identity all delayed-reset
   // mappings, empty the list
   _toReset.clear();
 
-  _meshedPageCount = _meshedBitmap.inUseCount();
+  releaseHugePageRegions();
+
+  _meshedPageCount = _meshedBitmapCount;
   if (_meshedPageCount > _meshedPageCountHWM) {
     _meshedPageCountHWM = _meshedPageCount;
     // TODO: find rss at peak
   }
 
-  forEachFree(_dirty, [&](const Span &span) {
-    auto ptr = ptrFromOffset(span.offset);
-    auto sz = span.byteLength();
-    madvise(ptr, sz, MADV_DONTNEED);
-    freePhys(ptr, sz);
-    markPages(span);
-  });
-
-  for (size_t i = 0; i < kSpanClassCount; i++) {
-    _dirty[i].clear();
-  }
-
-  _dirtyPageCount = 0;
-
-  for (size_t i = 0; i < kSpanClassCount; i++) {
-    _clean[i].clear();
-  }
-
-  // coalesce adjacent spans
-  Span current(0, 0);
-  for (auto const &i : bitmap) {
-    if (i == current.offset + current.length) {
-      current.length++;
-      continue;
-    }
-
-    // should only be empty the first time/iteration through
-    if (!current.empty()) {
-      _clean[current.spanClass()].push_back(current);
-      // debug("  clean: %4zu/%4zu\n", current.offset, current.length);
-    }
-
-    current = Span(i, 1);
-  }
-
-  // should only be empty the first time/iteration through
-  if (!current.empty()) {
-    _clean[current.spanClass()].push_back(current);
-    // debug("  clean: %4zu/%4zu\n", current.offset, current.length);
-  }
-#ifndef NDEBUG
-  auto newBitmap = allocatedBitmap();
-  newBitmap.invert();
-
-  const size_t *bits1 = bitmap.bits();
-  const size_t *bits2 = newBitmap.bits();
-  for (size_t i = 0; i < bitmap.byteCount() / sizeof(size_t); i++) {
-    if (bits1[i] != bits2[i]) {
-      debug("bitmaps don't match %zu:\n", i);
-      debug("\t%s\n", bitmap.to_string().c_str());
-      debug("\t%s\n", newBitmap.to_string().c_str());
-      hard_assert(false);
-    }
+  // outside of an explicit scavenge, dirty pages are only purged as
+  // they age out
+  if (force) {
+    partialScavenge();
+  } else {
+    decayDirty(time::now());
   }
-#endif
 }
 
 void MeshableArena::freePhys(void *ptr, size_t sz) {
+  ensureForkCopied();
   d_assert(contains(ptr));
   d_assert(sz > 0);
 
   d_assert(sz / CPUInfo::PageSize > 0);
   d_assert(sz % CPUInfo::PageSize == 0);
 
-  const off_t off = reinterpret_cast<char *>(ptr) - reinterpret_cast<char *>(_arenaBegin);
+  const Span span(offsetFor(ptr), sz / kPageSize);
+  d_assert(span.offset % kArenaSegmentPages + span.length <= kArenaSegmentPages);
+  ensureForkMoved(span);
 #ifndef __APPLE__
-  int result = fallocate(_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, sz);
-  d_assert(result == 0);
+  forEachShardPart(span, [&](const Span &part) {
+    int result = fallocate(fdFor(part.offset), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, fileOffsetFor(part.offset),
+                           part.byteLength());
+    d_assert(result == 0);
+  });
 #else
 #warning macOS version of fallocate goes here
 #endif
 }
 
 void MeshableArena::beginMesh(void *keep, void *remove, size_t sz) {
+  ensureForkCopied();
+  ensureForkMoved(Span(offsetFor(keep), sz / kPageSize));
+  ensureForkMoved(Span(offsetFor(remove), sz / kPageSize));
+
+  // publish that these pages are being meshed before they become
+  // read-only, so any thread faulting on them finds a non-zero count
+  const auto removeOff = offsetFor(remove);
+  for (size_t i = 0; i < sz / kPageSize; i++) {
+    meshWaitSlot(removeOff + i).fetch_add(1, std::memory_order_acq_rel);
+  }
+
   int r = mprotect(remove, sz, PROT_READ);
   hard_assert(r == 0);
 }
@@ -454,7 +707,7 @@ void MeshableArena::finalizeMesh(void *keep, void *remove, size_t sz) {
   const auto removeOff = offsetFor(remove);
 
   const Length pageCount = sz / kPageSize;
-  const MiniHeapID keepID = _mhIndex[keepOff].load(std::memory_order_acquire);
+  const MiniHeapID keepID = loadIndex(keepOff);
   for (size_t i = 0; i < pageCount; i++) {
     setIndex(removeOff + i, keepID);
   }
@@ -462,12 +715,53 @@ void MeshableArena::finalizeMesh(void *keep, void *remove, size_t sz) {
   const Span removedSpan{removeOff, pageCount};
   trackMeshed(removedSpan);
 
-  void *ptr = mmap(remove, sz, HL_MMAP_PROTECTION_MASK, kMapShared | MAP_FIXED, _fd, keepOff * kPageSize);
+  // meshes are kept within a shard, see MiniHeap::arenaShard
+  d_assert(keepOff / kArenaShardPages == (keepOff + pageCount - 1) / kArenaShardPages);
+
+  void *ptr = mmap(remove, sz, HL_MMAP_PROTECTION_MASK, kMapShared | MAP_FIXED, fdFor(keepOff), fileOffsetFor(keepOff));
   hard_assert_msg(ptr != MAP_FAILED, "mesh remap failed: %d", errno);
   freePhys(remove, sz);
 
   int r = mprotect(remove, sz, PROT_READ | PROT_WRITE);
   hard_assert(r == 0);
+
+  // the span is writable again: release anyone who faulted on it
+  for (size_t i = 0; i < pageCount; i++) {
+    auto &slot = meshWaitSlot(removeOff + i);
+    uint32_t old = slot.load(std::memory_order_relaxed);
+    uint32_t next;
+    do {
+      d_assert((old & kMeshWaitCountMask) > 0);
+      next = old - 1 + kMeshWaitGeneration;
+      if ((next & kMeshWaitCountMask) == 0)
+        next &= ~kMeshWaitWaiters;
+    } while (!slot.compare_exchange_weak(old, next, std::memory_order_acq_rel, std::memory_order_relaxed));
+
+    if (old & kMeshWaitWaiters)
+      internal::futexWake(&slot);
+  }
+}
+
+void MeshableArena::waitForMesh(const void *ptr) {
+  auto &slot = meshWaitSlot(offsetFor(ptr));
+
+  uint32_t val = slot.load(std::memory_order_acquire);
+  while ((val & kMeshWaitCountMask) != 0) {
+    // a mesh of some page hashing to this slot is in progress; it may
+    // not be ours, but waiting for it is bounded by a single span copy
+    if (!(val & kMeshWaitWaiters) &&
+        !slot.compare_exchange_weak(val, val | kMeshWaitWaiters, std::memory_order_acq_rel, std::memory_order_acquire))
+      continue;
+
+    internal::futexWait(&slot, val | kMeshWaitWaiters);
+
+    const uint32_t next = slot.load(std::memory_order_acquire);
+    // any finalizeMesh bumps the generation -- retry the access
+    // rather than waiting out meshes of unrelated pages
+    if ((next & ~(kMeshWaitCountMask | kMeshWaitWaiters)) != (val & ~(kMeshWaitCountMask | kMeshWaitWaiters)))
+      return;
+    val = next;
+  }
 }
 
 int MeshableArena::openShmSpanFile(size_t sz) {
@@ -475,7 +769,10 @@ int MeshableArena::openShmSpanFile(size_t sz) {
   char buf[buf_len];
   memset(buf, 0, buf_len);
 
-  _spanDir = openSpanDir(getpid());
+  // one directory per process, shared by all shard files
+  if (_spanDir == nullptr) {
+    _spanDir = openSpanDir(getpid());
+  }
   d_assert(_spanDir != nullptr);
 
   sprintf(buf, "%s/XXXXXX", _spanDir);
@@ -563,17 +860,37 @@ void MeshableArena::prepareForFork() {
     return;
   }
 
+  // a child forking before it has its own copy of the heap
+  ensureForkCopied();
+
+  // one fork at a time: we may still be moving after the last one
+  _forkLock.lock();
+
   // debug("%d: prepare fork", getpid());
   runtime().heap().lock();
   runtime().lock();
 
-  int r = mprotect(_arenaBegin, kArenaSize, PROT_READ);
+  _forkInProgress.store(true, std::memory_order_release);
+  _forkMoveState.store(ForkMovePending, std::memory_order_release);
+  int r = mprotect(_arenaBegin, mappedSize(), PROT_READ);
   hard_assert(r == 0);
 
-  int err = pipe(_forkPipe);
+  // close-on-exec, so a child that execs (or exits) before using the
+  // heap lets us know by closing its end.  A socket rather than a
+  // pipe, so the child can hurry us along without risking SIGPIPE.
+  int err = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, _forkPipe);
   if (err == -1) {
     abort();
   }
+
+  _forkShardCount = shardCount();
+  for (size_t s = 0; s < _forkShardCount; s++) {
+    _childFds[s] = openSpanFile(kArenaShardSize);
+  }
+
+  void *state = mmap(nullptr, kPageSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  hard_assert_msg(state != MAP_FAILED, "mesh: fork state mmap failed: %d", errno);
+  _forkCopyState = new (state) atomic<uint32_t>{ForkMovePending};
 }
 
 void MeshableArena::afterForkParent() {
@@ -582,36 +899,355 @@ void MeshableArena::afterForkParent() {
   }
 
   close(_forkPipe[1]);
+  _forkPipe[1] = -1;
 
-  char buf[8];
-  memset(buf, 0, 8);
+  // wait for our child to exec or exit -- until then it may read the
+  // heap, which has to stay as it was at the fork.  If it does neither
+  // soon, or asks us to on its first use of the heap, move to a copy
+  // of the heap ourselves, leaving it the files it has mapped.
+  struct pollfd pfd {};
+  pfd.fd = _forkPipe[0];
+  pfd.events = POLLIN;
+  const int waitMs = std::min<std::chrono::milliseconds::rep>(_forkChildWait.count(), INT_MAX);
+  int ready;
+  while ((ready = poll(&pfd, 1, waitMs)) == -1 && errno == EINTR) {
+  }
+  ssize_t len = -1;
+  if (ready > 0) {
+    char buf[4];
+    while ((len = read(_forkPipe[0], buf, sizeof(buf))) == -1 && errno == EINTR) {
+    }
+  }
 
-  // wait for our child to close + reopen memory.  Without this
-  // fence, we may experience memory corruption?
+  // EOF: the child is gone, and there is nothing to move
+  if (len == 0) {
+    int r = mprotect(_arenaBegin, mappedSize(), PROT_READ | PROT_WRITE);
+    hard_assert(r == 0);
+  } else if (internal::copyFileRange(_childFds[0], _shardFds[0], 0, kPageSize) != 0) {
+    // without copy_file_range (pre-4.5 kernels), copy everything up
+    // front with the heap locked
+    copyAllocatedPages(_childFds, _shardFds);
+    for (size_t s = 0; s < _forkShardCount; s++) {
+      std::swap(_shardFds[s], _childFds[s]);
+    }
+    remapSegments();
+  } else {
+    for (size_t s = 0; s < _forkShardCount; s++) {
+      std::swap(_shardFds[s], _childFds[s]);
+    }
+    const auto allocated = allocatedBitmap();
+    _forkAllocated = &allocated;
+
+    if (_forkChunks == nullptr) {
+      void *chunks = mmap(nullptr, kForkChunkCount * sizeof(atomic<uint32_t>), PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      hard_assert_msg(chunks != MAP_FAILED, "mesh: fork chunk mmap failed: %d", errno);
+      _forkChunks = reinterpret_cast<atomic<uint32_t> *>(chunks);
+    }
+    _forkChunksInUse = mappedSize() / kPageSize / kForkMoveChunkPages;
+
+    // past the end of the heap there is nothing to copy, so those
+    // parts of each shard move in one go
+    const size_t heapChunks = (_end + kForkMoveChunkPages - 1) / kForkMoveChunkPages;
+    for (size_t c = 0; c < _forkChunksInUse; c++) {
+      _forkChunks[c].store(c < heapChunks ? ForkChunkUnmoved : ForkChunkMoved, std::memory_order_relaxed);
+    }
+    for (const auto regionOff : _hugeRegions) {
+      d_assert(regionOff % kForkMoveChunkPages == 0);
+      _forkChunks[regionOff / kForkMoveChunkPages].store(ForkChunkUnmovedHuge, std::memory_order_relaxed);
+    }
+    for (size_t s = 0; s < shardCount(); s++) {
+      const Offset shardEnd = (s + 1) * kArenaShardPages;
+      const Offset tail = std::max<Offset>(s * kArenaShardPages, heapChunks * kForkMoveChunkPages);
+      if (tail < shardEnd) {
+        void *ptr = mmap(ptrFromOffset(tail), static_cast<size_t>(shardEnd - tail) * kPageSize, HL_MMAP_PROTECTION_MASK,
+                         kMapShared | MAP_FIXED, _shardFds[s], fileOffsetFor(tail));
+        hard_assert_msg(ptr != MAP_FAILED, "map failed: %d", errno);
+      }
+    }
+
+    moveMeshedForkChunks();
 
-  while (read(_forkPipe[0], buf, 4) == EAGAIN) {
+    // the rest moves with the heap unlocked: threads touching a chunk
+    // before we get to it move it themselves.  Syscalls writing to an
+    // unmoved chunk don't fault, and get EFAULT (see waitForForkMove).
+    _forkMoveState.store(ForkMoveMoving, std::memory_order_release);
+    internal::futexWake(&_forkMoveState);
+    runtime().unlock();
+    runtime().heap().unlock();
+
+    moveAllForkChunks();
+    _forkAllocated = nullptr;
   }
-  close(_forkPipe[0]);
 
-  d_assert(strcmp(buf, "ok") == 0);
+  // the files our child still uses (or the new ones, unused).  Shards
+  // added once the heap was unlocked have none.
+  closeChildFds();
+
+  _forkCopyState->store(ForkMoveDone, std::memory_order_release);
+  internal::futexWake(_forkCopyState, true);
+  munmap(_forkCopyState, kPageSize);
+  _forkCopyState = nullptr;
 
+  close(_forkPipe[0]);
   _forkPipe[0] = -1;
-  _forkPipe[1] = -1;
 
-  // only after the child has finished copying the heap is it safe to
-  // go back to read/write
-  int r = mprotect(_arenaBegin, kArenaSize, PROT_READ | PROT_WRITE);
-  hard_assert(r == 0);
+  const bool locked = _forkMoveState.load(std::memory_order_relaxed) == ForkMovePending;
+  _forkMoveState.store(ForkMoveDone, std::memory_order_release);
+  internal::futexWake(&_forkMoveState);
+  _forkInProgress.store(false, std::memory_order_release);
 
   // debug("%d: after fork parent", getpid());
-  runtime().unlock();
-  runtime().heap().unlock();
+  if (locked) {
+    runtime().unlock();
+    runtime().heap().unlock();
+  }
+  _forkLock.unlock();
 }
 
 void MeshableArena::doAfterForkChild() {
   afterForkChild();
 }
 
+void MeshableArena::waitForForkMove(const void *ptr) {
+  uint32_t state;
+  while ((state = _forkMoveState.load(std::memory_order_acquire)) == ForkMovePending) {
+    internal::futexWait(&_forkMoveState, ForkMovePending);
+  }
+
+  if (state == ForkMoveMoving) {
+    moveForkChunk(offsetFor(ptr) / kForkMoveChunkPages, true);
+  }
+}
+
+void MeshableArena::moveMeshedForkChunks() {
+  // a meshed page is mapped from the file of the span it is meshed
+  // with, so its chunk and that span's can only move together
+  internal::vector<size_t> chunks{};
+  auto claim = [&](Offset off, Length pageCount) {
+    for (size_t c = off / kForkMoveChunkPages; c <= (off + pageCount - 1) / kForkMoveChunkPages; c++) {
+      if (_forkChunks[c].load(std::memory_order_relaxed) == ForkChunkMoving) {
+        continue;
+      }
+      // huge page regions are never meshed
+      d_assert(_forkChunks[c].load(std::memory_order_relaxed) == ForkChunkUnmoved);
+      _forkChunks[c].store(ForkChunkMoving, std::memory_order_relaxed);
+      chunks.push_back(c);
+    }
+  };
+
+  for (auto const &i : _meshedBitmap) {
+    claim(i, 1);
+    const auto mh = reinterpret_cast<MiniHeap *>(miniheapForArenaOffset(i));
+    claim(offsetFor(reinterpret_cast<void *>(mh->getSpanStart(arenaBegin()))), mh->spanSize() / kPageSize);
+  }
+
+  // inaccessible until the meshes are re-done, so nobody reads a
+  // meshed page's own (stale) file page in the meantime
+  for (const auto c : chunks) {
+    copyForkChunk(c);
+    const Offset off = c * kForkMoveChunkPages;
+    void *ptr = mmap(ptrFromOffset(off), kForkMoveChunkPages * kPageSize, PROT_NONE, kMapShared | MAP_FIXED,
+                     fdFor(off), fileOffsetFor(off));
+    hard_assert_msg(ptr != MAP_FAILED, "map failed: %d", errno);
+  }
+
+  remapMeshes();
+
+  for (const auto c : chunks) {
+    int r = mprotect(ptrFromOffset(c * kForkMoveChunkPages), kForkMoveChunkPages * kPageSize, PROT_READ | PROT_WRITE);
+    hard_assert(r == 0);
+    _forkChunks[c].store(ForkChunkMoved, std::memory_order_release);
+  }
+}
+
+void MeshableArena::moveForkChunk(size_t c, bool wait) {
+  // chunks of shards added since the fork were never shared
+  if (c >= _forkChunksInUse) {
+    return;
+  }
+
+  auto &state = _forkChunks[c];
+  uint32_t s = state.load(std::memory_order_acquire);
+  while (s == ForkChunkUnmoved || s == ForkChunkUnmovedHuge) {
+    const bool huge = s == ForkChunkUnmovedHuge;
+    if (!state.compare_exchange_weak(s, ForkChunkMoving, std::memory_order_acq_rel)) {
+      continue;
+    }
+
+    copyForkChunk(c);
+
+    // the copy has the same contents, so readers don't notice the
+    // switch, and writers no longer fault
+    const Offset off = c * kForkMoveChunkPages;
+    void *ptr = mmap(ptrFromOffset(off), kForkMoveChunkPages * kPageSize, HL_MMAP_PROTECTION_MASK,
+                     kMapShared | MAP_FIXED, fdFor(off), fileOffsetFor(off));
+    hard_assert_msg(ptr != MAP_FAILED, "map failed: %d", errno);
+    if (huge) {
+      madvise(ptr, kHugePageSize, MADV_HUGEPAGE);
+    }
+
+    state.store(ForkChunkMoved, std::memory_order_release);
+    internal::futexWake(&state);
+    return;
+  }
+
+  while (wait && (s = state.load(std::memory_order_acquire)) == ForkChunkMoving) {
+    internal::futexWait(&state, ForkChunkMoving);
+  }
+}
+
+void MeshableArena::copyForkChunk(size_t c) {
+  const Offset begin = c * kForkMoveChunkPages;
+  const Offset end = std::min<Offset>(begin + kForkMoveChunkPages, _forkAllocated->bitCount());
+  const int dstFd = fdFor(begin);
+  const int srcFd = _childFds[begin / kArenaShardPages];
+
+  Offset start = begin;
+  Length length = 0;
+  auto copyRange = [&]() {
+    if (length == 0)
+      return;
+    const int result =
+        internal::copyFileRange(dstFd, srcFd, fileOffsetFor(start), static_cast<size_t>(length) * kPageSize);
+    hard_assert_msg(result == 0, "mesh: copying heap after fork failed: %d", errno);
+  };
+  for (Offset i = begin; i < end; i++) {
+    if (!_forkAllocated->isSet(i)) {
+      continue;
+    }
+    if (length > 0 && start + length == i) {
+      length++;
+      continue;
+    }
+    copyRange();
+    start = i;
+    length = 1;
+  }
+  copyRange();
+}
+
+void MeshableArena::moveForkChunks() {
+  for (size_t c = _forkNextChunk++; c < _forkChunksInUse; c = _forkNextChunk++) {
+    moveForkChunk(c, false);
+  }
+}
+
+void MeshableArena::setForkCopyThreads(size_t threads) {
+  lock_guard<mutex> lock(_forkLock);
+
+  _forkCopyThreads = std::max(std::min(threads, kMaxForkCopyThreads), static_cast<size_t>(1));
+
+  // not when they're needed: creating a thread mallocs, which in the
+  // middle of a move may wait on a chunk only that thread would move
+  while (_forkMoveWorkers + 1 < _forkCopyThreads) {
+    pthread_t thread;
+    const int ret = pthread_create(&thread, nullptr, forkMoveWorker, reinterpret_cast<void *>(_forkMoveWorkers));
+    if (ret != 0) {
+      debug("fork move thread creation failed (%d), moving with fewer threads.\n", ret);
+      break;
+    }
+    pthread_detach(thread);
+    _forkMoveWorkers++;
+  }
+}
+
+void *MeshableArena::forkMoveWorker(void *arg) {
+  auto self = reinterpret_cast<MeshableArena *>(arenaInstance);
+  const auto index = reinterpret_cast<uintptr_t>(arg);
+
+  uint32_t seen = self->_forkMoveSeq.load(std::memory_order_acquire);
+  while (true) {
+    internal::futexWait(&self->_forkMoveSeq, seen);
+    const uint32_t seq = self->_forkMoveSeq.load(std::memory_order_acquire);
+    if (seq == seen) {
+      continue;
+    }
+    seen = seq;
+
+    // fewer threads may have been asked for since we were started
+    if (index + 1 >= self->forkCopyThreads()) {
+      continue;
+    }
+
+    // a worker that only gets here once the move is over must not
+    // touch the chunks: moveAllForkChunks clears _forkMoveActive
+    // before it waits for _forkMoveBusy to drop to zero
+    self->_forkMoveBusy++;
+    if (self->_forkMoveActive) {
+      self->moveForkChunks();
+    }
+    if (--self->_forkMoveBusy == 0) {
+      internal::futexWake(&self->_forkMoveBusy);
+    }
+  }
+
+  return nullptr;
+}
+
+void MeshableArena::moveAllForkChunks() {
+  _forkNextChunk = 0;
+
+  // wake the workers started by setForkCopyThreads.  This thread
+  // moves chunks too, and picks up all the work if there are none.
+  _forkMoveActive = true;
+  _forkMoveSeq++;
+  internal::futexWake(&_forkMoveSeq);
+
+  moveForkChunks();
+
+  _forkMoveActive = false;
+  uint32_t busy;
+  while ((busy = _forkMoveBusy) != 0) {
+    internal::futexWait(&_forkMoveBusy, busy);
+  }
+
+  // chunks claimed by the threads that touched them may still be
+  // moving
+  for (size_t c = 0; c < _forkChunksInUse; c++) {
+    moveForkChunk(c, true);
+  }
+}
+
+void MeshableArena::closeChildFds() {
+  for (size_t s = 0; s < _forkShardCount; s++) {
+    if (_childFds[s] >= 0) {
+      close(_childFds[s]);
+      _childFds[s] = -1;
+    }
+  }
+  _forkShardCount = 0;
+}
+
+void MeshableArena::copyAllocatedPages(const int *dstFds, const int *srcFds) {
+  // coalesce allocated pages into ranges, which never cross a shard
+  const auto bitmap = allocatedBitmap();
+  Offset start = 0;
+  Length length = 0;
+  auto copyRange = [&]() {
+    if (length == 0)
+      return;
+    const auto shard = start / kArenaShardPages;
+    const size_t sz = static_cast<size_t>(length) * kPageSize;
+    for (size_t copied = 0; copied < sz;) {
+      const int result = internal::copyFile(dstFds[shard], srcFds[shard], fileOffsetFor(start) + copied,
+                                            std::min(sz - copied, static_cast<size_t>(kForkCopyChunkPages) * kPageSize));
+      hard_assert_msg(result > 0, "mesh: copying heap after fork failed: %d", errno);
+      copied += result;
+    }
+  };
+  for (auto const &i : bitmap) {
+    if (length > 0 && start + length == i && i % kArenaShardPages != 0) {
+      length++;
+      continue;
+    }
+    copyRange();
+    start = i;
+    length = 1;
+  }
+  copyRange();
+}
+
 void MeshableArena::afterForkChild() {
   runtime().updatePid();
 
@@ -627,87 +1263,143 @@ void MeshableArena::afterForkChild() {
   // debug("%d: after fork child", getpid());
   runtime().unlock();
   runtime().heap().unlock();
+  _forkLock.unlock();
 
   close(_forkPipe[0]);
+  _forkPipe[0] = -1;
 
-  char *oldSpanDir = _spanDir;
-
-  // open new file for the arena
-  int newFd = openSpanFile(kArenaSize);
-
-  struct stat fileinfo;
-  memset(&fileinfo, 0, sizeof(fileinfo));
-  fstat(newFd, &fileinfo);
-  d_assert(fileinfo.st_size >= 0 && (size_t)fileinfo.st_size == kArenaSize);
-
-  const int oldFd = _fd;
+  // the span dir (if any) is our parent's to clean up
+  internal::Heap().free(_spanDir);
+  _spanDir = nullptr;
+
+  // the arena stays read-only (as our parent left it) until we first
+  // use it, and this thread's heap is set aside until its first call
+  // into mesh
+  _forkMoveState.store(ForkMoveDone, std::memory_order_release);
+  _forkCopyPending.store(true, std::memory_order_release);
+  ThreadLocalHeap::ParkHeap();
+
+  // nor did the fork move workers: until mesh.fork_copy_threads is set
+  // again, our forks are moved by the forking thread alone
+  _forkCopyThreads = 1;
+  _forkMoveWorkers = 0;
+  _forkMoveBusy = 0;
+  _forkMoveActive = false;
+
+  // the purger thread didn't survive the fork: put spans it hadn't
+  // finished with back in the dirty list, and purge synchronously
+  if (!_purging.empty()) {
+    _purgeQueue.push_back(_purging);
+    _purging = Span(0, 0);
+  }
+  for (const auto &span : _purgeQueue) {
+    _dirty.add(span);
+    _dirtyPageCount += span.length;
+  }
+  _purgeQueue.clear();
+  _purgeQueuePageCount = 0;
+  _backgroundPurge = false;
+  _deferredWork = false;
+}
 
-  const auto bitmap = allocatedBitmap();
-  for (auto const &i : bitmap) {
-    int result = internal::copyFile(newFd, oldFd, i * kPageSize, kPageSize);
-    d_assert(result == CPUInfo::PageSize);
+void MeshableArena::finishForkCopy() {
+  lock_guard<mutex> lock(_forkCopyLock);
+  if (!forkCopyPending()) {
+    return;
   }
 
-  int r = mprotect(_arenaBegin, kArenaSize, PROT_READ | PROT_WRITE);
+  // our parent moves off the files we have mapped, if it hasn't
+  // already -- ask it not to wait for us to exec first
+  uint32_t state = _forkCopyState->load(std::memory_order_acquire);
+  if (state == ForkMovePending) {
+    while (send(_forkPipe[1], "go", strlen("go"), MSG_NOSIGNAL) == -1 && errno == EINTR) {
+    }
+  }
+  // nobody would wake us if our parent died before it was done, but
+  // then it closes its end of the socket
+  struct pollfd pfd {};
+  pfd.fd = _forkPipe[1];
+  pfd.events = POLLIN;
+  while ((state = _forkCopyState->load(std::memory_order_acquire)) != ForkMoveDone) {
+    internal::futexWaitFor(_forkCopyState, state, kForkParentCheckInterval, true);
+    if (_forkCopyState->load(std::memory_order_acquire) == ForkMoveDone) {
+      break;
+    }
+    // our parent never writes to the socket, so anything to read is EOF
+    if (poll(&pfd, 1, 0) > 0) {
+      state = _forkCopyState->load(std::memory_order_acquire);
+      hard_assert_msg(state == ForkMoveDone, "mesh: parent exited while moving off the heap after fork (%u)", state);
+    }
+  }
+  int r = mprotect(_arenaBegin, mappedSize(), PROT_READ | PROT_WRITE);
   hard_assert(r == 0);
 
-  // remap the new region over the old
-  void *ptr = mmap(_arenaBegin, kArenaSize, HL_MMAP_PROTECTION_MASK, kMapShared | MAP_FIXED, newFd, 0);
-  hard_assert_msg(ptr != MAP_FAILED, "map failed: %d", errno);
+  // the files our parent moved to
+  closeChildFds();
+  munmap(_forkCopyState, kPageSize);
+  _forkCopyState = nullptr;
 
-  // re-do the meshed mappings
-  {
-    internal::unordered_set<MiniHeap *> seenMiniheaps{};
+  close(_forkPipe[1]);
+  _forkPipe[1] = -1;
 
-    for (auto const &i : _meshedBitmap) {
-      MiniHeap *mh = reinterpret_cast<MiniHeap *>(miniheapForArenaOffset(i));
-      if (seenMiniheaps.find(mh) != seenMiniheaps.end()) {
-        continue;
-      }
-      seenMiniheaps.insert(mh);
+  _forkInProgress.store(false, std::memory_order_release);
+  _forkCopyPending.store(false, std::memory_order_release);
+}
 
-      const auto meshCount = mh->meshCount();
-      d_assert(meshCount > 1);
+void MeshableArena::remapSegments() {
+  for (size_t s = 0; s < shardCount(); s++) {
+    void *shardBegin = ptrFromOffset(s * kArenaShardPages);
+    void *ptr = mmap(shardBegin, kArenaShardSize, HL_MMAP_PROTECTION_MASK, kMapShared | MAP_FIXED, _shardFds[s], 0);
+    hard_assert_msg(ptr != MAP_FAILED, "map failed: %d", errno);
+  }
 
-      const auto sz = mh->spanSize();
-      const auto keep = reinterpret_cast<void *>(mh->getSpanStart(arenaBegin()));
-      const auto keepOff = offsetFor(keep);
+  // the new mappings don't carry the old advice
+  for (const auto regionOff : _hugeRegions) {
+    madvise(ptrFromOffset(regionOff), kHugePageSize, MADV_HUGEPAGE);
+  }
 
-      const auto base = mh;
-      base->forEachMeshed([&](const MiniHeap *mh) {
-        if (!mh->isMeshed())
-          return false;
+  remapMeshes();
+}
 
-        const auto remove = reinterpret_cast<void *>(mh->getSpanStart(arenaBegin()));
-        const auto removeOff = offsetFor(remove);
+void MeshableArena::remapMeshes() {
+  internal::unordered_set<MiniHeap *> seenMiniheaps{};
 
-#ifndef NDEBUG
-        const Length pageCount = sz / kPageSize;
-        for (size_t i = 0; i < pageCount; i++) {
-          d_assert(_mhIndex[removeOff + i].load().value() == _mhIndex[keepOff].load().value());
-        }
-#endif
+  for (auto const &i : _meshedBitmap) {
+    MiniHeap *mh = reinterpret_cast<MiniHeap *>(miniheapForArenaOffset(i));
+    if (seenMiniheaps.find(mh) != seenMiniheaps.end()) {
+      continue;
+    }
+    seenMiniheaps.insert(mh);
 
-        void *ptr = mmap(remove, sz, HL_MMAP_PROTECTION_MASK, kMapShared | MAP_FIXED, _fd, keepOff * kPageSize);
+    const auto meshCount = mh->meshCount();
+    d_assert(meshCount > 1);
 
-        hard_assert_msg(ptr != MAP_FAILED, "mesh remap failed: %d", errno);
+    const auto sz = mh->spanSize();
+    const auto keep = reinterpret_cast<void *>(mh->getSpanStart(arenaBegin()));
+    const auto keepOff = offsetFor(keep);
 
+    const auto base = mh;
+    base->forEachMeshed([&](const MiniHeap *mh) {
+      if (!mh->isMeshed())
         return false;
-      });
-    }
-  }
 
-  _fd = newFd;
+      const auto remove = reinterpret_cast<void *>(mh->getSpanStart(arenaBegin()));
+      const auto removeOff = offsetFor(remove);
 
-  internal::Heap().free(oldSpanDir);
+#ifndef NDEBUG
+      const Length pageCount = sz / kPageSize;
+      for (size_t i = 0; i < pageCount; i++) {
+        d_assert(loadIndex(removeOff + i).value() == loadIndex(keepOff).value());
+      }
+#endif
 
-  close(oldFd);
+      void *ptr =
+          mmap(remove, sz, HL_MMAP_PROTECTION_MASK, kMapShared | MAP_FIXED, fdFor(keepOff), fileOffsetFor(keepOff));
 
-  while (write(_forkPipe[1], "ok", strlen("ok")) == EAGAIN) {
-  }
-  close(_forkPipe[1]);
+      hard_assert_msg(ptr != MAP_FAILED, "mesh remap failed: %d", errno);
 
-  _forkPipe[0] = -1;
-  _forkPipe[1] = -1;
+      return false;
+    });
+  }
 }
 }  // namespace mesh
@@ -35,6 +35,8 @@
 #include "bitmap.h"
 
 #include "mmap_heap.h"
+#include "page_map.h"
+#include "span_free_list.h"
 
 #ifndef MADV_DONTDUMP
 #define MADV_DONTDUMP 0
@@ -44,6 +46,15 @@
 #define MADV_DODUMP 0
 #endif
 
+#ifndef MADV_HUGEPAGE
+#define MADV_HUGEPAGE 0
+#endif
+
+// Linux 5.14+; older kernels reject it with EINVAL
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
 namespace mesh {
 
 class MeshableArena : public mesh::OneWayMmapHeap {
@@ -56,33 +67,236 @@ public:
 
   explicit MeshableArena();
 
+  // true if ptr is in one of the shards mapped so far
   inline bool contains(const void *ptr) const {
     auto arena = reinterpret_cast<uintptr_t>(_arenaBegin);
     auto ptrval = reinterpret_cast<uintptr_t>(ptr);
-    return arena <= ptrval && ptrval < arena + kArenaSize;
+    return arena <= ptrval && ptrval < arena + mappedSize();
+  }
+
+  inline size_t shardCount() const {
+    return _shardCount.load(std::memory_order_acquire);
+  }
+
+  // segments with at least one shard mapped
+  inline size_t segmentCount() const {
+    return (shardCount() + kArenaShardsPerSegment - 1) / kArenaShardsPerSegment;
+  }
+
+  inline size_t mappedSize() const {
+    return shardCount() * kArenaShardSize;
+  }
+
+  // with prefault set, a span of clean pages is faulted in with one
+  // call here rather than a page at a time on first touch
+  char *pageAlloc(Span &result, size_t pageCount, size_t pageAlignment = 1, bool prefault = false);
+  // like pageAlloc, but carves the span out of a kHugePageSize-aligned
+  // region advised for transparent huge pages.  Spans allocated here
+  // must be freed with PageType::HugePage.
+  char *hugePageAlloc(Span &result, size_t pageCount);
+  // like pageAlloc, but the span is the lowest free one in the compact
+  // window (see kCompactArenaSize).  Returns nullptr once no free span
+  // there is long enough.
+  char *compactPageAlloc(Span &result, size_t pageCount, bool prefault = false);
+
+  inline size_t hugePageRegionCount() const {
+    return _hugeRegions.size();
+  }
+
+  inline size_t dirtyPageCount() const {
+    return _dirtyPageCount;
+  }
+
+  inline size_t prefaultedPageCount() const {
+    return _prefaultedPageCount;
+  }
+
+  // pages of live spans, whose objects are all free, returned to the
+  // OS by purgeSpanPages.  The span's MiniHeap must be detached, and
+  // not meshed.
+  void purgeSpanPages(const Span &span, uint32_t freePages);
+
+  // objects may be placed on a span's purged pages again.  They read
+  // as zero, like clean pages, and with prefault set are faulted back
+  // in with one call per run of them.
+  inline void forgetPurgedPages(const Span &span, bool prefault) {
+    if (likely(_purgedPages.empty())) {
+      return;
+    }
+    forgetPurgedPagesSlowpath(span, prefault);
+  }
+
+  inline size_t partialPurgedPageCount() const {
+    return _partialPurgedPageCount;
+  }
+
+  // a decay period of zero purges dirty pages as soon as possible
+  inline void setDirtyDecay(std::chrono::milliseconds decay) {
+    _dirtyDecay = decay;
+  }
+
+  inline std::chrono::milliseconds dirtyDecay() const {
+    return _dirtyDecay;
+  }
+
+  // never with a decay period of zero: then freeSpan purges dirty
+  // pages itself, and there are no epochs to advance
+  inline bool decayEpochElapsed(time::time_point now) const {
+    const auto epochLength = decayEpochLength();
+    return epochLength.count() != 0 && now - _decayEpochStart >= epochLength;
+  }
+
+  // advance the decay epochs up to now, and purge the dirty pages in
+  // excess of what the decay curve allows to linger
+  void decayDirty(time::time_point now);
+
+  // with background purging on, dirty spans being purged are only
+  // queued here, and a purger thread (see GlobalHeap::purgeLoop)
+  // returns them to the OS without holding the heap lock.  Queued
+  // spans are in neither the dirty nor the clean lists.
+  inline void setBackgroundPurge(bool enabled) {
+    _backgroundPurge = enabled;
+  }
+
+  inline bool backgroundPurge() const {
+    return _backgroundPurge;
+  }
+
+  // mesh_critical_enter/exit nest, per thread.  While a thread is
+  // inside one, its frees leave meshing and purging to the next free
+  // outside of one, or with background purging on, to the purger
+  // thread (see deferWork).
+  static inline void enterCritical() {
+    _criticalDepth++;
   }
 
-  char *pageAlloc(Span &result, size_t pageCount, size_t pageAlignment = 1);
+  static inline void exitCritical() {
+    d_assert(_criticalDepth > 0);
+    if (likely(_criticalDepth > 0)) {
+      _criticalDepth--;
+    }
+  }
+
+  static inline bool inCriticalSection() {
+    return _criticalDepth > 0;
+  }
+
+  // hands the maintenance a critical section skipped to the purger
+  // thread, if there is one.  Lock-free, and wakes the purger only
+  // once per batch of deferred work.
+  inline void deferWork() {
+    if (!_backgroundPurge.load(std::memory_order_relaxed)) {
+      return;
+    }
+    if (_deferredWork.exchange(true, std::memory_order_acq_rel)) {
+      return;
+    }
+    _purgeSeq.fetch_add(1, std::memory_order_release);
+    internal::futexWake(&_purgeSeq);
+  }
+
+  // purger side: whether maintenance has been deferred to it since
+  // the last call
+  inline bool takeDeferredWork() {
+    return _deferredWork.exchange(false, std::memory_order_acq_rel);
+  }
+
+  // purge the dirty pages over kMaxDirtyPageThreshold -- must be
+  // called LOCKED
+  inline void purgeExcessDirty() {
+    if (_dirtyPageCount > maxDirtyPageCount()) {
+      purgeDirty(_dirtyPageCount - maxDirtyPageCount());
+    }
+  }
+
+  // how many threads move the parent's heap to new files after a fork.
+  // The extra ones are started here, ahead of any fork, and sleep in
+  // between.  Not with the heap locked.
+  void setForkCopyThreads(size_t threads);
+
+  inline size_t forkCopyThreads() const {
+    return _forkCopyThreads.load(std::memory_order_relaxed);
+  }
+
+  // how long the parent waits for a forked child to exec or exit
+  // before moving off its files.  The fork doesn't return until then,
+  // and the heap stays locked and read-only; 0 starts moving right
+  // away, even for a child about to exec.
+  inline void setForkChildWait(std::chrono::milliseconds wait) {
+    _forkChildWait = wait;
+  }
+
+  inline std::chrono::milliseconds forkChildWait() const {
+    return _forkChildWait;
+  }
+
+  inline size_t purgeQueuePageCount() const {
+    return _purgeQueuePageCount;
+  }
+
+  // purger side: called LOCKED to take the next queued span, then
+  // purgeSpan() unlocked, then finishPurge() LOCKED
+  bool takePurgeWork(Span &span);
+  void finishPurge(const Span &span);
+  // madvise + punch a hole for the span's pages
+  void purgeSpan(const Span &span);
+
+  inline uint32_t purgeSeq() const {
+    return _purgeSeq.load(std::memory_order_acquire);
+  }
+
+  // blocks unless spans have been queued since seq was read
+  inline void waitForPurgeWork(uint32_t seq) {
+    internal::futexWait(&_purgeSeq, seq);
+  }
 
   void free(void *ptr, size_t sz, internal::PageType type);
 
   inline void trackMiniHeap(const Span span, MiniHeapID id) {
+    // large spans get range entries plus an index entry for their
+    // first page, so tracking them costs about the same whatever their
+    // size
+    if (span.length >= kMinRangeSpanPages) {
+      d_assert(_rangeSpans.find(span.offset) == _rangeSpans.end());
+      _rangeSpans[span.offset] = span.length;
+      _rangeCount.store(_rangeSpans.size(), std::memory_order_release);
+      forEachRangeEntry(span, [&](atomic<MiniHeapID> &entry) {
+        d_assert(!entry.load(std::memory_order_relaxed).hasValue());
+        entry.store(id, std::memory_order_release);
+      });
+      setIndex(span.offset, id);
+      return;
+    }
+
     // now that we know they are available, set the empty pages to
     // in-use.  This is safe because this whole function is called
     // under the GlobalHeap lock, so there is no chance of concurrent
     // modification between the loop above and the one below.
     for (size_t i = 0; i < span.length; i++) {
 #ifndef NDEBUG
-      d_assert(!_mhIndex[span.offset + i].load(std::memory_order_acquire).hasValue());
+      d_assert(!loadIndex(span.offset + i).hasValue());
       // auto mh = reinterpret_cast<MiniHeap *>(miniheapForArenaOffset(span.offset + i));
       // mh->dumpDebug();
 #endif
+      // meshed spans all have the same length, so a page's position
+      // within its span stays valid after it is meshed
+      _pageInSpan.at(span.offset + i) = i < kMaxPageInSpan ? i : kMaxPageInSpan;
       setIndex(span.offset + i, id);
     }
   }
 
+  // start of the span (possibly one of several meshed together)
+  // containing ptr, without walking the MiniHeap's mesh chain.  ptr
+  // must be in bounds and within a small-object span.
+  inline uintptr_t spanStartFor(const void *ptr) const {
+    const auto off = offsetFor(ptr);
+    const auto pageInSpan = *_pageInSpan.find(off);
+    d_assert(pageInSpan < kMaxPageInSpan);
+    return ptrvalFromOffset(off - pageInSpan);
+  }
+
   inline void *miniheapForArenaOffset(Offset arenaOff) const {
-    const MiniHeapID mhOff = _mhIndex[arenaOff].load(std::memory_order_acquire);
+    const MiniHeapID mhOff = indexFor(arenaOff);
     d_assert(mhOff.hasValue());
     const auto result = _mhAllocator.ptrFromOffset(mhOff.value());
     // debug("lookup ok for (%zu) %zu %p\n", arenaOff, mhOff, result);
@@ -104,6 +318,51 @@ public:
   void beginMesh(void *keep, void *remove, size_t sz);
   void finalizeMesh(void *keep, void *remove, size_t sz);
 
+  // called from the segfault handler: blocks until an in-progress
+  // mesh of the page containing ptr (if any) has been finalized, so
+  // threads wait on the span they touched rather than the whole pass.
+  void waitForMesh(const void *ptr);
+
+  // the arena is read-only while forking, and then in the parent for
+  // as long as it is moving to new files (see waitForForkMove)
+  inline bool forkInProgress() const {
+    return _forkInProgress.load(std::memory_order_acquire);
+  }
+
+  // called from the segfault handler while forkInProgress: unless the
+  // forked child execs or exits first, the parent moves to a copy of
+  // the heap in new files, leaving the child the files it has mapped.
+  // It does so a chunk at a time with the heap unlocked, so a thread
+  // touching the arena only waits for the chunk containing ptr.
+  // Writes by the kernel on a thread's behalf (read, recv, pread and
+  // the like into a heap buffer) don't fault, so they never get here:
+  // into a chunk not yet moved they fail with EFAULT.
+  void waitForForkMove(const void *ptr);
+
+  // a forked child keeps the files it was forked with, but can't write
+  // to them until its parent has moved off them.  Until then the arena
+  // stays read-only, and the first write to it, call into mesh, or
+  // heap operation that would change the files calls finishForkCopy,
+  // which waits for the parent.  As in the parent, the kernel writing
+  // to the heap before then fails with EFAULT.
+  inline bool forkCopyPending() const {
+    return _forkCopyPending.load(std::memory_order_acquire);
+  }
+
+  inline void ensureForkCopied() {
+    if (unlikely(forkCopyPending())) {
+      finishForkCopy();
+    }
+  }
+
+  void finishForkCopy();
+
+  // lock-free check of whether the page containing ptr (which must be
+  // in bounds) belongs to a live miniheap
+  inline bool isTracked(const void *ptr) const {
+    return indexFor(offsetFor(ptr)).hasValue();
+  }
+
   inline bool aboveMeshThreshold() const {
     return _meshedPageCount > _maxMeshCount;
   }
@@ -137,16 +396,86 @@ public:
     return reinterpret_cast<char *>(_arenaBegin);
   }
   void *arenaEnd() const {
-    return reinterpret_cast<char *>(_arenaBegin) + kArenaSize;
+    return reinterpret_cast<char *>(_arenaBegin) + mappedSize();
   }
 
   void doAfterForkChild();
 
 private:
   void expandArena(Length minPagesAdded);
-  bool findPages(Length pageCount, Span &result, internal::PageType &type);
-  bool findPagesInner(internal::vector<Span> freeSpans[kSpanClassCount], size_t i, Length pageCount, Span &result);
-  Span reservePages(Length pageCount, Length pageAlignment);
+  // false once the arena has no room left for minPagesAdded pages
+  bool canExpandArena(Length minPagesAdded) const;
+  // the lowest offset ordinary spans are placed at while the arena
+  // can grow: past the compact window, once the arena extends beyond it
+  inline Length ordinaryMinOffset() const {
+    return _end > kCompactArenaPages ? kCompactArenaPages : 0;
+  }
+  // map in the next shard of the reservation, from a file of its own
+  void addShard();
+
+  // the file backing the shard that page off is in, and the position
+  // of the page within that file
+  inline int fdFor(Offset off) const {
+    return _shardFds[off / kArenaShardPages];
+  }
+
+  static inline off_t fileOffsetFor(Offset off) {
+    return static_cast<off_t>(off % kArenaShardPages) * kPageSize;
+  }
+
+  // calls func with each part of span within a single shard, for file
+  // operations on spans that may cross shards
+  template <typename Func>
+  static inline void forEachShardPart(const Span &span, const Func &func) {
+    Offset off = span.offset;
+    const Offset end = span.offset + span.length;
+    while (off < end) {
+      const Offset partEnd = std::min<Offset>(end, (off / kArenaShardPages + 1) * kArenaShardPages);
+      func(Span(off, partEnd - off));
+      off = partEnd;
+    }
+  }
+  bool findPages(Length pageCount, Length pageAlignment, Length minOffset, Span &result, internal::PageType &type);
+  bool findCompactPages(Length pageCount, Span &result, internal::PageType &type);
+  bool findPagesInner(SpanFreeList &freeSpans, Length pageCount, Length pageAlignment, Span &result,
+                      Length minOffset = 0);
+  Span reservePages(Length pageCount, Length pageAlignment, internal::PageType &type);
+  // copy the allocated pages of the arena between two sets of
+  // shard files, without copy_file_range
+  void copyAllocatedPages(const int *dstFds, const int *srcFds);
+  void prefault(const Span &span);
+  void forgetPurgedPagesSlowpath(const Span &span, bool prefault);
+  // calls func with each run of pages set in pageMask, as a span
+  template <typename Func>
+  static inline void forEachPageRun(const Span &span, uint32_t pageMask, Func func) {
+    for (Length i = 0; i < span.length;) {
+      if ((pageMask & (1U << i)) == 0) {
+        i++;
+        continue;
+      }
+      Length end = i + 1;
+      while (end < span.length && (pageMask & (1U << end)) != 0) {
+        end++;
+      }
+      func(Span(span.offset + i, end - i));
+      i = end;
+    }
+  }
+  // hand huge page regions with no spans left in them back to the
+  // arena's clean pages
+  void releaseHugePageRegions();
+  // return up to pageCount dirty pages to the OS, smallest spans first
+  void purgeDirty(size_t pageCount);
+  // move the current decay epoch up to now; false if it hasn't changed
+  bool advanceDecayEpochs(time::time_point now);
+
+  inline size_t maxDirtyPageCount() const {
+    return _dirtyDecay.count() != 0 ? kMaxDirtyPageThreshold : 0;
+  }
+
+  inline std::chrono::nanoseconds decayEpochLength() const {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(_dirtyDecay) / kDirtyDecayEpochs;
+  }
   void freePhys(void *ptr, size_t sz);
   internal::RelaxedBitmap allocatedBitmap(bool includeDirty = true) const;
 
@@ -156,12 +485,27 @@ private:
     return ptrvalFromOffset(span.offset) % (pageAlignment * kPageSize) == 0;
   }
 
-  static constexpr size_t indexSize() {
-    // one pointer per page in our arena
-    return sizeof(Offset) * (kArenaSize / kPageSize);
-  }
+  // pages further than this into a span aren't tracked exactly.
+  // Only large spans could be that long, and those are indexed by
+  // range entries, which don't record positions at all.
+  static constexpr uint16_t kMaxPageInSpan = UINT16_MAX;
 
   inline void clearIndex(const Span &span) {
+    // spans this long can only have been indexed by range entries (if
+    // they were tracked at all, rather than being excess pages from an
+    // aligned allocation)
+    if (span.length >= kMinRangeSpanPages) {
+      auto it = _rangeSpans.find(span.offset);
+      if (it != _rangeSpans.end()) {
+        d_assert(it->second == span.length);
+        _rangeSpans.erase(it);
+        setIndex(span.offset, MiniHeapID{0});
+        forEachRangeEntry(span, [](atomic<MiniHeapID> &entry) { entry.store(MiniHeapID{0}, std::memory_order_release); });
+        _rangeCount.store(_rangeSpans.size(), std::memory_order_release);
+      }
+      return;
+    }
+
     for (size_t i = 0; i < span.length; i++) {
       // clear the miniheap pointers we were tracking
       setIndex(span.offset + i, MiniHeapID{0});
@@ -176,25 +520,44 @@ private:
     // this happens when we are trying to get an aligned allocation
     // and returning excess back to the arena
     if (flags == internal::PageType::Clean) {
-      _clean[span.spanClass()].push_back(span);
+      _clean.add(span);
       return;
     }
 
     clearIndex(span);
+    if (unlikely(!_purgedPages.empty())) {
+      _purgedPages.erase(span.offset);
+    }
 
     if (flags == internal::PageType::Dirty) {
       if (kAdviseDump) {
         madvise(ptrFromOffset(span.offset), span.length * kPageSize, MADV_DONTDUMP);
       }
       d_assert(span.length > 0);
-      _dirty[span.spanClass()].push_back(span);
+      _dirty.add(span);
       _dirtyPageCount += span.length;
-      if (_dirtyPageCount > kMaxDirtyPageThreshold) {
-        partialScavenge();
+      if (_dirtyDecay.count() != 0) {
+        // record the pages against the epoch they were really dirtied in
+        advanceDecayEpochs(time::now());
+        _dirtyBacklog[_decayEpoch] += span.length;
+      }
+      // regardless of the decay curve, never hold more than this many
+      // dirty pages -- but only purge the excess, not everything.
+      // With no decay, that is this span (and any left over from a
+      // critical section).
+      if (_dirtyPageCount > maxDirtyPageCount()) {
+        if (unlikely(inCriticalSection())) {
+          deferWork();
+        } else {
+          purgeExcessDirty();
+        }
       }
     } else if (flags == internal::PageType::Meshed) {
       // delay restoring the identity mapping
       _toReset.push_back(span);
+    } else if (flags == internal::PageType::HugePage) {
+      // keep the pages in their region (and huge page) for reuse
+      _hugeFree.add(span);
     }
   }
 
@@ -221,8 +584,78 @@ private:
   }
 
   inline void setIndex(size_t off, MiniHeapID val) {
-    d_assert(off < indexSize());
-    _mhIndex[off].store(val, std::memory_order_release);
+    _mhIndex.at(off).store(val, std::memory_order_release);
+  }
+
+  // lock-free: pages that have never been tracked have no miniheap
+  inline MiniHeapID loadIndex(size_t off) const {
+    const auto entry = _mhIndex.find(off);
+    if (unlikely(entry == nullptr)) {
+      return MiniHeapID{};
+    }
+    return entry->load(std::memory_order_acquire);
+  }
+
+  // the miniheap owning page off, lock-free.  A single load for
+  // small-object spans and for the first and last pages of large
+  // ones; any other page of a large span is found through the range
+  // entry for one of the blocks containing it.
+  inline MiniHeapID indexFor(Offset off) const {
+    const auto id = loadIndex(off);
+    if (likely(id.hasValue() || _rangeCount.load(std::memory_order_acquire) == 0)) {
+      return id;
+    }
+    return rangeIndexFor(off);
+  }
+
+  inline MiniHeapID rangeIndexFor(Offset off) const {
+    for (size_t level = 0; level < kRangeLevels; level++) {
+      off >>= kRangeBlockShift;
+      const auto entry = _rangeIndex[level].find(off);
+      if (entry == nullptr) {
+        continue;
+      }
+      const auto id = entry->load(std::memory_order_acquire);
+      if (id.hasValue()) {
+        return id;
+      }
+    }
+    return MiniHeapID{};
+  }
+
+  // calls f on the index entries that cover span: the range entries
+  // for the biggest aligned blocks inside it, and the page entries
+  // for the pages at either end that aren't in a block.  Called
+  // LOCKED.
+  template <typename Func>
+  inline void forEachRangeEntry(const Span &span, const Func &f) {
+    static constexpr size_t kBlockMask = (1UL << kRangeBlockShift) - 1;
+    size_t begin = span.offset;
+    size_t end = span.offset + span.length;
+    size_t level = 0;
+    for (; level < kRangeLevels; level++) {
+      const size_t blockBegin = (begin + kBlockMask) & ~kBlockMask;
+      const size_t blockEnd = end & ~kBlockMask;
+      if (blockBegin >= blockEnd) {
+        break;
+      }
+      for (size_t i = begin; i < blockBegin; i++) {
+        f(entryAt(level, i));
+      }
+      for (size_t i = blockEnd; i < end; i++) {
+        f(entryAt(level, i));
+      }
+      begin = blockBegin >> kRangeBlockShift;
+      end = blockEnd >> kRangeBlockShift;
+    }
+    for (size_t i = begin; i < end; i++) {
+      f(entryAt(level, i));
+    }
+  }
+
+  // level 0 is the page index itself
+  inline atomic<MiniHeapID> &entryAt(size_t level, size_t i) {
+    return level == 0 ? _mhIndex.at(i) : _rangeIndex[level - 1].at(i);
   }
 
   static void staticAtExit();
@@ -243,7 +676,9 @@ private:
     for (size_t i = 0; i < span.length; i++) {
       // this may already be 1 if it was a meshed virtual span that is
       // now being re-meshed to a new owning miniheap
-      _meshedBitmap.tryToSet(span.offset + i);
+      if (_meshedBitmap.tryToSet(span.offset + i)) {
+        _meshedBitmapCount++;
+      }
     }
   }
 
@@ -252,24 +687,103 @@ private:
       d_assert(_meshedBitmap.isSet(span.offset + i));
       _meshedBitmap.unset(span.offset + i);
     }
+    _meshedBitmapCount -= span.length;
   }
 
   inline void resetSpanMapping(const Span &span) {
-    auto ptr = ptrFromOffset(span.offset);
-    auto sz = span.byteLength();
-    mmap(ptr, sz, HL_MMAP_PROTECTION_MASK, kMapShared | MAP_FIXED, _fd, span.offset * kPageSize);
+    ensureForkCopied();
+    ensureForkMoved(span);
+    forEachShardPart(span, [&](const Span &part) {
+      mmap(ptrFromOffset(part.offset), part.byteLength(), HL_MMAP_PROTECTION_MASK, kMapShared | MAP_FIXED,
+           fdFor(part.offset), fileOffsetFor(part.offset));
+    });
   }
 
   void prepareForFork();
   void afterForkParent();
   void afterForkChild();
 
+  // (re)map every shard from _shardFds, along with the advice and
+  // meshes of their spans
+  void remapSegments();
+  // re-do the meshed mappings, onto the files in _shardFds
+  void remapMeshes();
+
+  // the parent's side of a fork, also published to the child: waiting
+  // to see if the child execs or exits, moving to new files, and done
+  // (or not moving at all)
+  enum ForkMoveState : uint32_t {
+    ForkMovePending,
+    ForkMoveMoving,
+    ForkMoveDone,
+  };
+
+  // chunks of the arena being moved.  Huge page regions are single
+  // chunks, which need their advice re-applied once moved.
+  enum ForkChunkState : uint32_t {
+    ForkChunkUnmoved,
+    ForkChunkUnmovedHuge,
+    ForkChunkMoving,
+    ForkChunkMoved,
+  };
+
+  static constexpr size_t kForkChunkCount = kArenaMaxSize / kPageSize / kForkMoveChunkPages;
+
+  // before a file operation on pages that may not have been moved yet
+  inline void ensureForkMoved(const Span &span) {
+    if (unlikely(_forkMoveState.load(std::memory_order_acquire) == ForkMoveMoving)) {
+      for (size_t c = span.offset / kForkMoveChunkPages; c <= (span.offset + span.length - 1) / kForkMoveChunkPages;
+           c++) {
+        moveForkChunk(c, true);
+      }
+    }
+  }
+
+  // move the chunks holding meshed pages, and the spans they are
+  // meshed with, all at once (LOCKED)
+  void moveMeshedForkChunks();
+  // move chunk c (claiming it), or with wait, wait for whichever
+  // thread claimed it
+  void moveForkChunk(size_t c, bool wait);
+  // copy the pages of chunk c that were allocated at the fork
+  void copyForkChunk(size_t c);
+  void moveAllForkChunks();
+  // claim and move chunks until there are none left
+  void moveForkChunks();
+  // close the _childFds of the shards there were at the fork
+  void closeChildFds();
+  // the extra threads moving chunks, started by setForkCopyThreads
+  // and woken by moveAllForkChunks
+  static void *forkMoveWorker(void *arg);
+
+  // each word holds the number of in-progress meshes of pages hashing
+  // to it in the low bits, a has-waiters flag, and a generation count
+  // bumped on every finalizeMesh in the high bits.
+  static constexpr uint32_t kMeshWaitCountMask = (1U << 15) - 1;
+  static constexpr uint32_t kMeshWaitWaiters = 1U << 15;
+  static constexpr uint32_t kMeshWaitGeneration = 1U << 16;
+
+  inline atomic<uint32_t> &meshWaitSlot(Offset off) {
+    return _meshWait[off % kMeshWaitSlotCount];
+  }
+
   void *_arenaBegin{nullptr};
   // indexed by page offset.
-  atomic<MiniHeapID> *_mhIndex{nullptr};
+  PageMap<atomic<MiniHeapID>> _mhIndex{};
+  // indexed by page offset: the page's position within its span.
+  // Written before the page's _mhIndex entry is published.
+  PageMap<uint16_t> _pageInSpan{};
+  // indexed by block: the miniheap of the large span covering all of
+  // the aligned block of 64^(level + 1) pages, if any
+  PageMap<atomic<MiniHeapID>> _rangeIndex[kRangeLevels]{};
+  // large spans: offset -> length, for tracking and clearing their
+  // range entries.  Only used under the heap lock; lookups go through
+  // _rangeIndex.
+  internal::map<Offset, Length> _rangeSpans{};
+  atomic<size_t> _rangeCount{0};
 
 protected:
-  CheapHeap<64, kArenaSize / kPageSize> _mhAllocator{};
+  CheapHeap<64, kArenaMaxSize / kPageSize> _mhAllocator{};
 
 private:
   Offset _end{};  // in pages
@@ -278,21 +792,87 @@ private:
   // to identity mappings in the page tables.
   internal::vector<Span> _toReset;
 
-  internal::vector<Span> _clean[kSpanClassCount];
-  internal::vector<Span> _dirty[kSpanClassCount];
+  SpanFreeList _clean{};
+  SpanFreeList _dirty{};
+  // free pages within huge page regions, and the offsets of the
+  // regions themselves
+  SpanFreeList _hugeFree{};
+  internal::vector<Offset> _hugeRegions{};
 
   size_t _dirtyPageCount{0};
-
+  // pages dirtied in each of the last kDirtyDecayEpochs epochs, as a
+  // ring with the current epoch at _decayEpoch
+  size_t _dirtyBacklog[kDirtyDecayEpochs]{};
+  size_t _decayEpoch{0};
+  time::time_point _decayEpochStart{time::now()};
+  std::chrono::milliseconds _dirtyDecay{kDefaultDirtyDecay};
+
+  // spans waiting for the purger thread, and the one it is working on
+  internal::vector<Span> _purgeQueue{};
+  Span _purging{0, 0};
+  size_t _purgeQueuePageCount{0};
+  atomic<uint32_t> _purgeSeq{0};
+  atomic<bool> _backgroundPurge{false};
+  atomic<bool> _deferredWork{false};
+
+  static __thread uint32_t _criticalDepth ATTR_INITIAL_EXEC;
+
+  atomic_size_t _forkCopyThreads{1};
+  std::chrono::milliseconds _forkChildWait{kForkChildCopyWait};
+  // started so far (LOCKED by _forkLock)
+  size_t _forkMoveWorkers{0};
+  // bumped to wake the workers for a move
+  atomic<uint32_t> _forkMoveSeq{0};
+  // workers between waking and being done with a move
+  atomic<uint32_t> _forkMoveBusy{0};
+  atomic<bool> _forkMoveActive{false};
+
+  size_t _prefaultedPageCount{0};
+  // live spans with purged pages: span offset -> mask of the pages
+  internal::map<Offset, uint32_t> _purgedPages{};
+  size_t _partialPurgedPageCount{0};
+  // set once MADV_POPULATE_WRITE fails with EINVAL
+  bool _populateUnsupported{false};
+
+  // covers the shards mapped so far; its memory is committed along
+  // with them
   internal::RelaxedBitmap _meshedBitmap{
-      kArenaSize / kPageSize,
-      reinterpret_cast<char *>(OneWayMmapHeap().malloc(bitmap::representationSize(kArenaSize / kPageSize))), false};
+      0, reinterpret_cast<char *>(OneWayMmapHeap().reserve(bitmap::representationSize(kArenaMaxSize / kPageSize))),
+      false};
+  char *_meshedBitmapCommitted{reinterpret_cast<char *>(_meshedBitmap.mut_bits())};
+  // number of bits set in _meshedBitmap, too large to count on demand
+  size_t _meshedBitmapCount{0};
   size_t _meshedPageCount{0};
   size_t _meshedPageCountHWM{0};
   size_t _rssKbAtHWM{0};
   size_t _maxMeshCount{kDefaultMaxMeshCount};
 
-  int _fd;
+  atomic<uint32_t> _meshWait[kMeshWaitSlotCount]{};
+  atomic<bool> _forkInProgress{false};
+
+  int _shardFds[kArenaMaxShards]{};
+  atomic<size_t> _shardCount{0};
   int _forkPipe[2]{-1, -1};  // used for signaling during fork
+  // the files of the heap of the child being forked, created before
+  // the fork for the parent to move to.  Once it moves, these are
+  // the original files, left to the child, which the move copies from.
+  // Only the first _forkShardCount are open: shards added while the
+  // parent moves were never shared.
+  int _childFds[kArenaMaxShards];
+  size_t _forkShardCount{0};
+  // in a page shared with the child being forked
+  atomic<uint32_t> *_forkCopyState{nullptr};
+  atomic<bool> _forkCopyPending{false};
+  mutex _forkCopyLock{};
+  // held from prepareForFork until the parent has moved
+  mutex _forkLock{};
+  atomic<uint32_t> _forkMoveState{ForkMoveDone};
+  // indexed by chunk, up to _forkChunksInUse
+  atomic<uint32_t> *_forkChunks{nullptr};
+  size_t _forkChunksInUse{0};
+  atomic_size_t _forkNextChunk{0};
+  // the pages allocated at the fork
+  const internal::RelaxedBitmap *_forkAllocated{nullptr};
   char *_spanDir{nullptr};
 };
 }  // namespace mesh
@@ -23,15 +23,37 @@ namespace mesh {
 
 using internal::Bitmap;
 
-inline bool bitmapsMeshable(const Bitmap::word_t *__restrict__ bitmap1, const Bitmap::word_t *__restrict__ bitmap2,
+// per-size-class knobs for the meshing pass.  Defaults match the
+// global constants in common.h; they can be adjusted at runtime
+// through mallctl("mesh.class.<n>.<knob>").
+struct MeshPolicy {
+  bool enabled{kMeshingEnabled};
+  double occupancyCutoff{kOccupancyCutoff};
+  size_t probeBudget{kMeshProbeBudget};
+  size_t maxMeshesPerPass{kMaxMeshesPerIteration};
+  // new spans come from huge page regions and are never meshed
+  bool hugePages{false};
+};
+
+// per-size-class meshing outcomes, exposed via
+// mallctl("stats.class.<n>.<stat>") so policies can be tuned
+struct MeshClassStats {
+  size_t passCount;       // mesh passes that scanned this class
+  size_t candidateCount;  // miniheaps considered across all passes
+  size_t foundCount;      // meshable pairs found
+  size_t meshCount;       // pairs actually meshed
+};
+
+template <typename Word>
+inline bool bitmapsMeshable(const Word *__restrict__ bitmap1, const Word *__restrict__ bitmap2,
                             size_t byteLen) noexcept {
   d_assert(reinterpret_cast<uintptr_t>(bitmap1) % 16 == 0);
   d_assert(reinterpret_cast<uintptr_t>(bitmap2) % 16 == 0);
   d_assert(byteLen >= 8);
   d_assert(byteLen % 8 == 0);
 
-  bitmap1 = (const Bitmap::word_t *)__builtin_assume_aligned(bitmap1, 16);
-  bitmap2 = (const Bitmap::word_t *)__builtin_assume_aligned(bitmap2, 16);
+  bitmap1 = (const Word *)__builtin_assume_aligned(bitmap1, 16);
+  bitmap2 = (const Word *)__builtin_assume_aligned(bitmap2, 16);
 
   for (size_t i = 0; i < byteLen / sizeof(size_t); i++) {
     if ((bitmap1[i] & bitmap2[i]) != 0) {
@@ -43,47 +65,70 @@ inline bool bitmapsMeshable(const Bitmap::word_t *__restrict__ bitmap1, const Bi
   return true;
 }
 
+// a miniheap's bitmap as of the start of a mesh pass.  The search for
+// meshable pairs runs over these copies with the heap unlocked, so
+// the pairs it finds have to be checked against the miniheaps again
+// before they are meshed.
+struct MeshCandidate {
+  static constexpr size_t kBitmapBytes = 32;
+
+  alignas(16) size_t bits[kBitmapBytes / sizeof(size_t)];
+  MiniHeap *mh;
+  size_t shard;
+};
+
 namespace method {
 
-// split miniheaps into two lists in a random order
-inline void halfSplit(MWC &prng, BinnedTracker &miniheaps, internal::vector<MiniHeap *> &left,
-                      internal::vector<MiniHeap *> &right) noexcept {
-  internal::vector<MiniHeap *> bucket = miniheaps.meshingCandidates(kOccupancyCutoff);
+// copy the miniheaps worth meshing to the end of candidates, in a
+// random order, returning how many there were -- must be called
+// LOCKED
+inline size_t snapshotCandidates(MWC &prng, BinnedTracker &miniheaps, const MeshPolicy &policy,
+                                 internal::vector<MeshCandidate> &candidates) noexcept {
+  if (miniheaps.partialSize() == 0 || policy.maxMeshesPerPass == 0)
+    return 0;
+
+  internal::vector<MiniHeap *> bucket = miniheaps.meshingCandidates(policy.occupancyCutoff);
 
   internal::mwcShuffle(bucket.begin(), bucket.end(), prng);
 
-  for (size_t i = 0; i < bucket.size(); i++) {
-    auto mh = bucket[i];
-    if (!mh->isMeshingCandidate() || mh->fullness() >= kOccupancyCutoff)
+  const size_t before = candidates.size();
+  for (auto mh : bucket) {
+    if (!mh->isMeshingCandidate() || mh->fullness() >= policy.occupancyCutoff)
       continue;
 
-    if (left.size() <= right.size())
-      left.push_back(mh);
-    else
-      right.push_back(mh);
+    d_assert(mh->bitmap().byteCount() == MeshCandidate::kBitmapBytes);
+    // allocations from attached miniheaps don't take the lock, but
+    // candidates are detached, and a bit set concurrently only makes
+    // the copy stale
+    const auto bits = mh->bitmap().bits();
+    MeshCandidate candidate;
+    for (size_t i = 0; i < MeshCandidate::kBitmapBytes / sizeof(size_t); i++) {
+      candidate.bits[i] = bits[i].load(std::memory_order_relaxed);
+    }
+    candidate.mh = mh;
+    candidate.shard = mh->arenaShard();
+    candidates.push_back(candidate);
   }
-}
-
-template <size_t t = 64>
-inline void shiftedSplitting(MWC &prng, BinnedTracker &miniheaps,
-                             const function<void(std::pair<MiniHeap *, MiniHeap *> &&)> &meshFound) noexcept {
-  if (miniheaps.partialSize() == 0)
-    return;
 
-  internal::vector<MiniHeap *> leftBucket{};   // mutable copy
-  internal::vector<MiniHeap *> rightBucket{};  // mutable copy
-
-  halfSplit(prng, miniheaps, leftBucket, rightBucket);
+  return candidates.size() - before;
+}
 
-  const auto leftSize = leftBucket.size();
-  const auto rightSize = rightBucket.size();
+// search a snapshot of one bin's candidates (left half against right
+// half), returning the number of pairs found.  Only reads the
+// snapshot, so it needs no lock.
+inline size_t shiftedSplitting(MeshCandidate *candidates, size_t count, const MeshPolicy &policy,
+                               const function<void(std::pair<MiniHeap *, MiniHeap *> &&)> &meshFound) noexcept {
+  const size_t leftSize = (count + 1) / 2;
+  const size_t rightSize = count - leftSize;
 
   if (leftSize == 0 || rightSize == 0)
-    return;
+    return 0;
+
+  MeshCandidate *leftBucket = candidates;
+  MeshCandidate *rightBucket = candidates + leftSize;
 
+  const size_t t = policy.probeBudget;
   const size_t limit = rightSize < t ? rightSize : t;
-  constexpr size_t nBytes = 32;
-  d_assert(nBytes == leftBucket[0]->bitmap().byteCount());
 
   size_t foundCount = 0;
   for (size_t j = 0; j < leftSize; j++) {
@@ -93,27 +138,26 @@ inline void shiftedSplitting(MWC &prng, BinnedTracker &miniheaps,
       if (unlikely(idxRight >= rightSize)) {
         idxRight %= rightSize;
       }
-      auto h1 = leftBucket[idxLeft];
-      auto h2 = rightBucket[idxRight];
+      auto &h1 = leftBucket[idxLeft];
+      auto &h2 = rightBucket[idxRight];
 
-      if (h1 == nullptr || h2 == nullptr)
+      if (h1.mh == nullptr || h2.mh == nullptr || h1.shard != h2.shard)
         continue;
 
-      const auto bitmap1 = h1->bitmap().bits();
-      const auto bitmap2 = h2->bitmap().bits();
-
-      if (unlikely(mesh::bitmapsMeshable(bitmap1, bitmap2, nBytes))) {
-        std::pair<MiniHeap *, MiniHeap *> heaps{h1, h2};
+      if (unlikely(mesh::bitmapsMeshable(h1.bits, h2.bits, MeshCandidate::kBitmapBytes))) {
+        std::pair<MiniHeap *, MiniHeap *> heaps{h1.mh, h2.mh};
         meshFound(std::move(heaps));
-        leftBucket[idxLeft] = nullptr;
-        rightBucket[idxRight] = nullptr;
+        h1.mh = nullptr;
+        h2.mh = nullptr;
         foundCount++;
-        if (foundCount > kMaxMeshesPerIteration) {
-          return;
+        if (foundCount >= policy.maxMeshesPerPass) {
+          return foundCount;
         }
       }
     }
   }
+
+  return foundCount;
 }
 }  // namespace method
 }  // namespace mesh
@@ -32,6 +32,8 @@ private:
     return 1UL << pos;
   }
   static constexpr uint32_t MeshedOffset = 30;
+  static constexpr uint32_t HugePageOffset = 29;
+  static constexpr uint32_t LifetimeGroupShift = 26;
   static constexpr uint32_t MaxCountShift = 16;
   static constexpr uint32_t SizeClassShift = 0;
   static constexpr uint32_t ShuffleVectorOffsetShift = 8;
@@ -71,6 +73,23 @@ public:
     }
   }
 
+  inline LifetimeGroup lifetimeGroup() const {
+    return static_cast<LifetimeGroup>((_flags.load(std::memory_order_relaxed) >> LifetimeGroupShift) & 0x3);
+  }
+
+  inline void setLifetimeGroup(LifetimeGroup group) {
+    d_assert(static_cast<size_t>(group) < kLifetimeGroupCount);
+    uint32_t mask = ~(static_cast<uint32_t>(0x3) << LifetimeGroupShift);
+    uint32_t newVal = (static_cast<uint32_t>(group) << LifetimeGroupShift);
+    uint32_t oldFlags = _flags.load(std::memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&_flags,
+                                                  &oldFlags,                   // old val
+                                                  (oldFlags & mask) | newVal,  // new val
+                                                  std::memory_order_release,   // success mem model
+                                                  std::memory_order_relaxed)) {
+    }
+  }
+
   inline void setMeshed() {
     set(MeshedOffset);
   }
@@ -83,6 +102,14 @@ public:
     return is(MeshedOffset);
   }
 
+  inline void setHugePage() {
+    set(HugePageOffset);
+  }
+
+  inline bool isHugePage() const {
+    return is(HugePageOffset);
+  }
+
 private:
   inline bool ATTRIBUTE_ALWAYS_INLINE is(size_t offset) const {
     const auto mask = getMask(offset);
@@ -222,6 +249,14 @@ public:
     return _flags.sizeClass();
   }
 
+  inline LifetimeGroup lifetimeGroup() const {
+    return _flags.lifetimeGroup();
+  }
+
+  inline void setLifetimeGroup(LifetimeGroup group) {
+    _flags.setLifetimeGroup(group);
+  }
+
   inline uintptr_t getSpanStart(const void *arenaBegin) const {
     const auto beginval = reinterpret_cast<uintptr_t>(arenaBegin);
     return beginval + _span.offset * kPageSize;
@@ -282,8 +317,26 @@ public:
     return _nextMiniHeap.hasValue();
   }
 
+  // spans in huge page regions are never meshed: remapping one of
+  // their pages would split the huge page backing it
+  inline void setHugePage() {
+    _flags.setHugePage();
+  }
+
+  inline bool isHugePage() const {
+    return _flags.isHugePage();
+  }
+
   inline bool isMeshingCandidate() const {
-    return !isAttached() && objectSize() < kPageSize;
+    return !isAttached() && objectSize() < kPageSize && !isHugePage() && arenaShard() != kArenaMaxShards;
+  }
+
+  // the arena shard (file) holding our span, or kArenaMaxShards if it
+  // straddles two.  Meshing maps one span onto the other's file, and
+  // is kept within a shard.
+  inline size_t arenaShard() const {
+    const size_t shard = _span.offset / kArenaShardPages;
+    return (_span.offset + _span.length - 1) / kArenaShardPages == shard ? shard : kArenaMaxShards;
   }
 
   /// Returns the fraction full (in the range [0, 1]) that this miniheap is.
@@ -302,33 +355,27 @@ public:
   void trackMeshedSpan(MiniHeapID id) {
     hard_assert(id.hasValue());
 
-    if (!_nextMiniHeap.hasValue()) {
-      _nextMiniHeap = id;
-    } else {
-      GetMiniHeap(_nextMiniHeap)->trackMeshedSpan(id);
+    MiniHeap *mh = this;
+    while (mh->_nextMiniHeap.hasValue()) {
+      mh = GetMiniHeap(mh->_nextMiniHeap);
     }
+    mh->_nextMiniHeap = id;
   }
 
 public:
   template <class Callback>
   inline void forEachMeshed(Callback cb) const {
-    if (cb(this))
-      return;
-
-    if (_nextMiniHeap.hasValue()) {
-      const auto mh = GetMiniHeap(_nextMiniHeap);
-      mh->forEachMeshed(cb);
+    const MiniHeap *mh = this;
+    while (!cb(mh) && mh->_nextMiniHeap.hasValue()) {
+      mh = GetMiniHeap(mh->_nextMiniHeap);
     }
   }
 
   template <class Callback>
   inline void forEachMeshed(Callback cb) {
-    if (cb(this))
-      return;
-
-    if (_nextMiniHeap.hasValue()) {
-      auto mh = GetMiniHeap(_nextMiniHeap);
-      mh->forEachMeshed(cb);
+    MiniHeap *mh = this;
+    while (!cb(mh) && mh->_nextMiniHeap.hasValue()) {
+      mh = GetMiniHeap(mh->_nextMiniHeap);
     }
   }
 
@@ -432,26 +479,15 @@ protected:
     return spanStartSlowpath(arenaBegin, ptrval);
   }
 
+  // ptrval is in one of the spans meshed with ours: the arena knows
+  // each page's position within its span, so there is no need to walk
+  // the (up to kMaxMeshes long) chain
   uintptr_t ATTRIBUTE_NEVER_INLINE spanStartSlowpath(uintptr_t arenaBegin, uintptr_t ptrval) const {
-    const auto len = _span.byteLength();
-    uintptr_t spanptr = 0;
-
-    const MiniHeap *mh = this;
-    while (true) {
-      if (unlikely(!mh->_nextMiniHeap.hasValue())) {
-        abort();
-      }
-
-      mh = GetMiniHeap(mh->_nextMiniHeap);
-
-      const uintptr_t meshedSpanptr = arenaBegin + mh->span().offset * kPageSize;
-      if (meshedSpanptr <= ptrval && ptrval < meshedSpanptr + len) {
-        spanptr = meshedSpanptr;
-        break;
-      }
-    };
+    if (unlikely(!_nextMiniHeap.hasValue())) {
+      abort();
+    }
 
-    return spanptr;
+    return GetSpanStart(ptrval);
   }
 
   internal::Bitmap _bitmap;  // 32 bytes 32
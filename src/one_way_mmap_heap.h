@@ -65,6 +65,32 @@ public:
     return map(sz, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1);
   }
 
+  // address space only: the pages can't be used until commit()ed.
+  // Unlike malloc, this isn't charged against the commit limit when
+  // overcommit is disabled.
+  inline void *reserve(size_t sz) {
+    sz = (sz + kPageSize - 1) & (size_t) ~(kPageSize - 1);
+
+    void *ptr = mmap(nullptr, sz, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (ptr == MAP_FAILED)
+      abort();
+
+    return ptr;
+  }
+
+  // extends the usable prefix of a reserve()d region, which ends at
+  // committedEnd, to cover everything before end
+  inline void commitTo(char *&committedEnd, const char *end) {
+    d_assert(reinterpret_cast<uintptr_t>(committedEnd) % kPageSize == 0);
+    auto pageEnd = reinterpret_cast<char *>((reinterpret_cast<uintptr_t>(end) + kPageSize - 1) & ~(kPageSize - 1));
+    if (pageEnd <= committedEnd)
+      return;
+
+    if (mprotect(committedEnd, pageEnd - committedEnd, HL_MMAP_PROTECTION_MASK) != 0)
+      abort();
+    committedEnd = pageEnd;
+  }
+
   inline size_t getSize(void *ptr) const {
     return 0;
   }
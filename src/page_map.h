@@ -0,0 +1,103 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2019 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+#pragma once
+#ifndef MESH__PAGE_MAP_H
+#define MESH__PAGE_MAP_H
+
+#include <sys/mman.h>
+
+#include <atomic>
+
+#include "internal.h"
+
+#ifndef MADV_HUGEPAGE
+#define MADV_HUGEPAGE 0
+#endif
+
+namespace mesh {
+
+// per-page metadata for the arena, as a two-level radix tree.  Each
+// leaf is one kHugePageSize-aligned block of entries for a contiguous
+// run of pages, allocated the first time an entry in it is written, so
+// lookups for neighbouring pages stay within a leaf and memory is only
+// used for the parts of the arena that have held spans.
+//
+// Leaves are never freed, and readers only need an acquire load of
+// the root slot: lookups are lock-free, while writers are serialized
+// externally (by the global heap lock).  Entries in leaves that
+// haven't been allocated read as zero.
+template <typename T>
+class PageMap {
+private:
+  DISALLOW_COPY_AND_ASSIGN(PageMap);
+
+public:
+  static constexpr size_t kLeafLength = kHugePageSize / sizeof(T);
+  static constexpr size_t kRootLength = (kArenaMaxSize / kPageSize + kLeafLength - 1) / kLeafLength;
+  static_assert((kLeafLength & (kLeafLength - 1)) == 0, "leaf length must be a power of two");
+
+  PageMap() {
+  }
+
+  // the entry for page off, or nullptr if its leaf doesn't exist yet
+  inline T *find(size_t off) const {
+    d_assert(off / kLeafLength < kRootLength);
+    T *leaf = _root[off / kLeafLength].load(std::memory_order_acquire);
+    if (unlikely(leaf == nullptr)) {
+      return nullptr;
+    }
+    return &leaf[off % kLeafLength];
+  }
+
+  // the entry for page off, allocating its leaf if necessary.  Must
+  // be called with the writers' lock held.
+  inline T &at(size_t off) {
+    d_assert(off / kLeafLength < kRootLength);
+    auto &slot = _root[off / kLeafLength];
+    T *leaf = slot.load(std::memory_order_relaxed);
+    if (unlikely(leaf == nullptr)) {
+      leaf = allocLeaf();
+      slot.store(leaf, std::memory_order_release);
+      _leafCount++;
+    }
+    return leaf[off % kLeafLength];
+  }
+
+  inline size_t leafCount() const {
+    return _leafCount;
+  }
+
+  inline size_t bytes() const {
+    return _leafCount * kHugePageSize;
+  }
+
+private:
+  static T *allocLeaf() {
+    // over-allocate so the leaf can be huge page aligned, and give
+    // back the slop
+    auto ptr = reinterpret_cast<char *>(
+        mmap(nullptr, 2 * kHugePageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0));
+    hard_assert_msg(ptr != MAP_FAILED, "mesh: page map leaf allocation failed: %d", errno);
+
+    const auto head = (kHugePageSize - reinterpret_cast<uintptr_t>(ptr) % kHugePageSize) % kHugePageSize;
+    if (head > 0)
+      munmap(ptr, head);
+    munmap(ptr + head + kHugePageSize, kHugePageSize - head);
+
+    auto leaf = ptr + head;
+    if (kPageMapHugePages) {
+      madvise(leaf, kHugePageSize, MADV_HUGEPAGE);
+    }
+
+    return reinterpret_cast<T *>(leaf);
+  }
+
+  atomic<T *> _root[kRootLength]{};
+  size_t _leafCount{0};
+};
+}  // namespace mesh
+
+#endif  // MESH__PAGE_MAP_H
@@ -0,0 +1,89 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2019 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+// compares the radix tree page map against a flat, one entry per
+// page index of the whole arena on the lookup every free() does:
+// page offset -> miniheap ID.  Lookups are for random pages of spans
+// scattered over an increasingly large part of the arena, from a
+// dense heap to a very sparse one.
+
+#include <sys/mman.h>
+
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+#include "internal.h"
+
+#include "page_map.h"
+
+using mesh::PageMap;
+
+static constexpr size_t kPageCount = mesh::kArenaMaxSize / mesh::kPageSize;
+static constexpr size_t kSpanPages = 4;
+static constexpr size_t kSpanCount = 64 * 1024;
+static constexpr size_t kLookups = 32 * 1024 * 1024;
+
+typedef std::atomic<uint32_t> Entry;
+
+template <typename Lookup>
+static double timeLookups(const std::vector<uint32_t> &offsets, Lookup lookup) {
+  uint64_t sum = 0;
+  const auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < kLookups; i++) {
+    sum += lookup(offsets[i % offsets.size()]);
+  }
+  const auto elapsed = std::chrono::steady_clock::now() - start;
+
+  // keep the loads from being optimized away
+  if (sum == 0)
+    printf("(no entries found)\n");
+
+  return static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()) / kLookups;
+}
+
+int main() {
+  auto flat = reinterpret_cast<Entry *>(mmap(nullptr, kPageCount * sizeof(Entry), PROT_READ | PROT_WRITE,
+                                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0));
+  hard_assert(flat != MAP_FAILED);
+  static PageMap<Entry> radix{};
+
+  MWC prng{mesh::internal::seed(), mesh::internal::seed()};
+
+  printf("%-14s %12s %12s %14s\n", "heap spread", "flat ns/op", "radix ns/op", "radix leaves");
+
+  // spans of the same heap spread over 256 MB up to 256 GB of arena
+  for (size_t spreadPages = 1 << 16; spreadPages <= kPageCount / 4; spreadPages <<= 2) {
+    const size_t stride = spreadPages / kSpanCount;
+
+    std::vector<uint32_t> offsets{};
+    offsets.reserve(kSpanCount * kSpanPages);
+    for (size_t s = 0; s < kSpanCount; s++) {
+      const size_t spanOff = s * stride;
+      for (size_t i = 0; i < kSpanPages; i++) {
+        flat[spanOff + i].store(s + 1, std::memory_order_release);
+        radix.at(spanOff + i).store(s + 1, std::memory_order_release);
+        offsets.push_back(spanOff + i);
+      }
+    }
+
+    // frees come in no particular order
+    for (size_t i = offsets.size() - 1; i > 0; i--) {
+      std::swap(offsets[i], offsets[prng.inRange(0, i)]);
+    }
+
+    const double flatNs =
+        timeLookups(offsets, [&](uint32_t off) { return flat[off].load(std::memory_order_acquire); });
+    const double radixNs = timeLookups(offsets, [&](uint32_t off) {
+      const auto entry = radix.find(off);
+      return entry != nullptr ? entry->load(std::memory_order_acquire) : 0;
+    });
+
+    printf("%10zu MB %12.2f %12.2f %14zu\n", spreadPages * mesh::kPageSize / 1024 / 1024, flatNs, radixNs,
+           radix.leafCount());
+  }
+
+  return 0;
+}
@@ -28,11 +28,11 @@ private:
 
 public:
   PartitionedHeap() : SuperHeap() {
-    _smallArena = reinterpret_cast<char *>(SuperHeap::malloc(kPartitionedHeapArenaSize));
+    _smallArena = reinterpret_cast<char *>(SuperHeap::reserve(kPartitionedHeapArenaSize));
     hard_assert(_smallArena != nullptr);
     _smallArenaEnd = _smallArena + kPartitionedHeapArenaSize;
 
-    auto freelist = reinterpret_cast<char *>(SuperHeap::malloc(kPartitionedHeapArenaSize));
+    auto freelist = reinterpret_cast<char *>(SuperHeap::reserve(kPartitionedHeapArenaSize));
     hard_assert(freelist != nullptr);
 
     for (size_t i = 0; i < kPartitionedHeapNBins; ++i) {
@@ -8,6 +8,7 @@
 #define PLASMA__MESH_H
 
 #include <stddef.h>
+#include <stdint.h>
 
 #define MESH_VERSION_MAJOR 1
 #define MESH_VERSION_MINOR 0
@@ -16,8 +17,80 @@
 extern "C" {
 #endif
 
+// hints describing how long an allocation is expected to live.
+// Allocations with different hints are served from different sets of
+// spans, so that short-lived temporaries don't fragment the spans
+// holding long-lived objects (and vice versa).
+typedef enum mesh_hint {
+  MESH_HINT_DEFAULT = 0,
+  MESH_HINT_SHORT_LIVED = 1,
+  MESH_HINT_LONG_LIVED = 2,
+} mesh_hint_t;
+
 // Same API as je_mallctl, allows a program to query stats and set
 // allocator-related options.
+//
+// Meshing can be tuned per size class <n> (0 <= n < 25):
+//   mesh.class.<n>.size              object size of the class (read-only)
+//   mesh.class.<n>.enabled           size_t, 0 disables meshing the class
+//   mesh.class.<n>.occupancy_cutoff  double, only spans less full are meshed
+//   mesh.class.<n>.probe_budget      size_t, spans probed per candidate
+//   mesh.class.<n>.max_meshes        size_t, meshes per pass
+//   mesh.class.<n>.huge_pages        size_t, 1 places new spans in 2 MB
+//                                    regions advised for transparent huge
+//                                    pages (shmem_enabled=advise); such
+//                                    spans are never meshed
+// and the outcome observed through the (read-only) size_t stats
+//   stats.class.<n>.passes, .candidates, .meshes_found, .meshes
+//
+// mesh.dirty_decay_ms (size_t, also MESH_DIRTY_DECAY_MS in the
+// environment, default 10000) is how long freed pages may stay
+// resident for reuse before being returned to the OS.  They are
+// purged gradually, along a smoothstep curve over that period; 0
+// purges them as soon as possible.  With MESH_BACKGROUND_PURGE=1 in
+// the environment, pages are purged by a background thread rather
+// than inside malloc and free.  Spans for objects over 512 bytes
+// take several pages; once all of the objects on one of their pages
+// are free, the page is purged even though the span is still in use:
+// by mesh.scavenge, and otherwise at most once per decay period (and
+// no more often than every 100 ms).
+// stats.partial_purged is the number of bytes purged that way so far.
+//
+// mesh.prefault (size_t, also MESH_PREFAULT) faults in the fresh pages
+// of new spans for small objects with one madvise(MADV_POPULATE_WRITE)
+// call, rather than a page at a time as objects are first touched.
+// mesh.prefault_threshold (size_t bytes, also MESH_PREFAULT_THRESHOLD,
+// default 0 = off) does the same for large allocations at least that
+// big.  On kernels without MADV_POPULATE_WRITE the pages are only
+// allocated (fallocate).  stats.prefaulted is the number of bytes
+// prefaulted so far.
+//
+// After a fork, the parent waits briefly for the child to exec or
+// exit, and otherwise moves to a copy of the heap in memory of its
+// own, leaving the child the original.  The child can't write to the
+// heap (or call into mesh) until then.  mesh.fork_child_wait_ms
+// (size_t, also MESH_FORK_CHILD_WAIT_MS in the environment, default
+// 20) is how long the parent waits.  That wait is paid by every fork
+// whose child neither execs nor exits (nor uses the heap) in time:
+// fork() doesn't return until then, and the parent's other threads
+// block on any malloc, free or heap write meanwhile.  0 starts the
+// move right away, at the cost of copying the heap even for children
+// that were about to exec.  The move happens 2 MB at a
+// time with the heap unlocked, so the parent's other threads only
+// wait for the parts of the heap they touch.  mesh.fork_copy_threads
+// (size_t, also MESH_FORK_COPY_THREADS in the environment, default 1,
+// at most 16) is the number of threads doing the move.  The extra
+// threads are started when it is set, and sleep between forks; a
+// forked child starts out with none, until it sets it again.  Until
+// its part of the heap has moved (in the parent) or the child first
+// uses the heap, the heap is read-only.  A system call that writes to
+// it in the meantime (read, recv, pread, ... into a malloc'd buffer)
+// fails with EFAULT rather than waiting.
+//
+// mesh.lifetime_segregation (size_t, also MESH_LIFETIME_SEGREGATION in
+// the environment) groups small objects by how long objects from the
+// same malloc/new call site have been observed to live, and only
+// meshes spans within a group.
 int mesh_mallctl(const char *name, void *oldp, size_t *oldlenp, void *newp, size_t newlen);
 
 // 0 if not in bounds, 1 if is.
@@ -26,8 +99,79 @@ int mesh_in_bounds(void *ptr);
 // returns the usable size of an allocation
 size_t mesh_usable_size(void *ptr);
 
+// mesh_critical_enter() and mesh_critical_exit() bracket latency
+// critical code on the calling thread, and nest.  Inside, frees don't
+// mesh, or return memory to the OS: that waits for the next free
+// outside of a critical section, or with MESH_BACKGROUND_PURGE=1 is
+// handed to the background thread.  Allocator calls can still wait
+// briefly on the heap lock while another thread holds it.
+void mesh_critical_enter(void);
+void mesh_critical_exit(void);
+
+// malloc with a lifetime hint.  The result is freed with free() as
+// usual; unknown hints are treated as MESH_HINT_DEFAULT.
+void *mesh_malloc_hint(size_t sz, mesh_hint_t hint);
+
+// Compact pointers: objects from mesh_malloc_compact all lie within
+// 32 GB of mesh_compact_base(), so they can be stored as 32-bit
+// offsets from it (in units of 8 bytes), decoded inline with the
+// helpers below.  The base doesn't change for the life of the
+// process.  No object has offset 0, so it is free to stand for NULL.
+// The window is shared with the rest of the heap until the heap
+// outgrows it; from then on other allocations are placed above it,
+// and only fall back to it once the whole heap is full.  Once no free
+// span in the window is large enough, mesh_malloc_compact returns
+// NULL (ENOMEM).  Compact objects are freed with free(); realloc() doesn't
+// keep them compact.
+#define MESH_COMPACT_SHIFT 3
+
+void *mesh_malloc_compact(size_t sz);
+void *mesh_compact_base(void);
+
+static inline uint32_t mesh_compact_encode(const void *base, const void *ptr) {
+  return (uint32_t)(((uintptr_t)ptr - (uintptr_t)base) >> MESH_COMPACT_SHIFT);
+}
+
+static inline void *mesh_compact_decode(const void *base, uint32_t off) {
+  return (void *)((uintptr_t)base + ((uintptr_t)off << MESH_COMPACT_SHIFT));
+}
+
+// Shared heaps hand large objects to another process without copying
+// them.  Each is a memfd of its own (of at most 16 GB), outside of the
+// main heap: it is never meshed or purged, and isn't copied after a
+// fork.  Only the process that created it allocates from it, a page
+// at a time, with mesh_shared_malloc (NULL with ENOMEM once it is
+// full), and frees its objects with free().  mesh_shared_heap_send
+// passes the heap over a Unix socket; the process that gets it from
+// mesh_shared_heap_recv reads and writes the objects in place, mapped
+// at the same address when that is free there (compare
+// mesh_shared_heap_base on both sides), but can't allocate from or
+// free into it.  mesh_shared_heap_close unmaps the heap in the calling
+// process; the memory is released once every process has closed it.
+// realloc() moves a shared object into the main heap.
+// A process can create up to 16 shared heaps.  Linux only: elsewhere
+// create returns NULL (ENOSYS).
+typedef struct mesh_shared_heap mesh_shared_heap_t;
+
+mesh_shared_heap_t *mesh_shared_heap_create(const char *name, size_t capacity);
+mesh_shared_heap_t *mesh_shared_heap_recv(int sock);
+// 0 on success, -1 (with errno set) on failure
+int mesh_shared_heap_send(mesh_shared_heap_t *heap, int sock);
+void *mesh_shared_malloc(mesh_shared_heap_t *heap, size_t sz);
+void *mesh_shared_heap_base(mesh_shared_heap_t *heap);
+int mesh_shared_heap_fd(mesh_shared_heap_t *heap);
+void mesh_shared_heap_close(mesh_shared_heap_t *heap);
+
 #ifdef __cplusplus
 }
+
+#include <new>
+
+// new (MESH_HINT_LONG_LIVED) T(...); deleted with a plain delete.
+void *operator new(size_t sz, mesh_hint_t hint);
+void *operator new[](size_t sz, mesh_hint_t hint);
+void operator delete(void *ptr, mesh_hint_t hint) noexcept;
+void operator delete[](void *ptr, mesh_hint_t hint) noexcept;
 #endif
 
 #endif /* PLASMA__MESH_H */
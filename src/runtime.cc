@@ -9,6 +9,9 @@
 #include <sched.h>
 #include <stdlib.h>
 #include <sys/syscall.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#endif
 #include <sys/types.h>
 
 #ifdef __linux__
@@ -83,6 +86,58 @@ int internal::copyFile(int dstFd, int srcFd, off_t off, size_t sz) {
   return result;
 }
 
+int internal::copyFileRange(int dstFd, int srcFd, off_t off, size_t sz) {
+  d_assert(off >= 0);
+
+#ifdef __NR_copy_file_range
+  loff_t inOff = off;
+  loff_t outOff = off;
+  while (sz > 0) {
+    const auto copied = syscall(__NR_copy_file_range, srcFd, &inOff, dstFd, &outOff, sz, 0);
+    if (copied <= 0) {
+      if (copied == 0)
+        errno = EIO;
+      return -1;
+    }
+    sz -= copied;
+  }
+  return 0;
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+void internal::futexWait(std::atomic<uint32_t> *word, uint32_t val, bool shared) {
+#ifdef __linux__
+  syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), shared ? FUTEX_WAIT : FUTEX_WAIT_PRIVATE, val, nullptr,
+          nullptr, 0);
+#else
+  if (word->load(std::memory_order_acquire) == val)
+    sched_yield();
+#endif
+}
+
+void internal::futexWaitFor(std::atomic<uint32_t> *word, uint32_t val, std::chrono::milliseconds timeout, bool shared) {
+#ifdef __linux__
+  struct timespec ts {};
+  ts.tv_sec = timeout.count() / 1000;
+  ts.tv_nsec = (timeout.count() % 1000) * 1000 * 1000;
+  syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), shared ? FUTEX_WAIT : FUTEX_WAIT_PRIVATE, val, &ts, nullptr,
+          0);
+#else
+  if (word->load(std::memory_order_acquire) == val)
+    sched_yield();
+#endif
+}
+
+void internal::futexWake(std::atomic<uint32_t> *word, bool shared) {
+#ifdef __linux__
+  syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), shared ? FUTEX_WAKE : FUTEX_WAKE_PRIVATE, INT_MAX, nullptr,
+          nullptr, 0);
+#endif
+}
+
 Runtime::Runtime() {
   updatePid();
 }
@@ -193,6 +248,25 @@ void Runtime::startBgThread() {
   }
 }
 
+void Runtime::startPurgeThread() {
+  pthread_t purgePthread;
+
+  int ret = pthread_create(&purgePthread, nullptr, Runtime::purgeThread, nullptr);
+  if (ret != 0) {
+    // dirty pages are purged synchronously, as before
+    debug("purge thread creation failed (%d), purging in the foreground.\n", ret);
+    return;
+  }
+
+  lock_guard<GlobalHeap> lock(_heap);
+  _heap.setBackgroundPurge(true);
+}
+
+void *Runtime::purgeThread(void *arg) {
+  mesh::runtime().heap().purgeLoop();
+  return nullptr;
+}
+
 void *Runtime::bgThread(void *arg) {
   auto &rt = mesh::runtime();
 
@@ -309,8 +383,17 @@ void Runtime::segfaultHandler(int sig, siginfo_t *siginfo, void *context) {
     runtime().heap().doAfterForkChild();
   }
 
-  // okToProceed is a barrier that ensures any in-progress meshing has
-  // completed, and the reason for the fault was 'just' a meshing
+  // a forked child's first write to its heap, which it hasn't copied
+  // from its parent yet
+  if (siginfo->si_code == SEGV_ACCERR && runtime().heap().forkCopyPending() &&
+      runtime().heap().contains(siginfo->si_addr)) {
+    runtime().heap().finishForkCopy();
+    return;
+  }
+
+  // okToProceed is a barrier that ensures any in-progress meshing of
+  // the faulting span has completed, and the reason for the fault was
+  // 'just' a meshing
   if (siginfo->si_code == SEGV_ACCERR && runtime().heap().okToProceed(siginfo->si_addr)) {
     // debug("TODO: trapped access violation from meshing, log stat\n");
     return;
@@ -40,6 +40,8 @@ public:
   }
 
   void startBgThread();
+  // move page purging off the allocation path, onto its own thread
+  void startPurgeThread();
   void initMaxMapCount();
 
   // we need to wrap pthread_create so that we can safely implement a
@@ -51,6 +53,22 @@ public:
     _heap.setMeshPeriodMs(period);
   }
 
+  void setDirtyDecay(std::chrono::milliseconds decay) {
+    _heap.setDirtyDecay(decay);
+  }
+
+  void setForkCopyThreads(size_t threads) {
+    _heap.setForkCopyThreads(threads);
+  }
+
+  void setForkChildWait(std::chrono::milliseconds wait) {
+    _heap.setForkChildWait(wait);
+  }
+
+  void setPrefault(bool refills, size_t largeThreshold) {
+    _heap.setPrefault(refills, largeThreshold);
+  }
+
 #ifdef __linux__
   int epollWait(int __epfd, struct epoll_event *__events, int __maxevents, int __timeout);
   int epollPwait(int __epfd, struct epoll_event *__events, int __maxevents, int __timeout, const __sigset_t *__ss);
@@ -93,6 +111,7 @@ private:
   static void segfaultHandler(int sig, siginfo_t *siginfo, void *context);
 
   static void *bgThread(void *arg);
+  static void *purgeThread(void *arg);
 
   friend Runtime &runtime();
 
@@ -0,0 +1,288 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2019 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/memfd.h>
+#endif
+
+#include "shared_heap.h"
+
+// older headers predate it; older kernels treat it as a plain hint
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+namespace mesh {
+
+// the heaps created by this process, looked up lock-free when a
+// pointer outside of the arena is freed
+static atomic<SharedHeap *> sharedHeaps[kMaxSharedHeaps];
+static atomic_size_t sharedHeapCount{0};
+
+static bool registerHeap(SharedHeap *heap) {
+  for (auto &slot : sharedHeaps) {
+    SharedHeap *expected = nullptr;
+    if (slot.compare_exchange_strong(expected, heap, std::memory_order_acq_rel)) {
+      sharedHeapCount.fetch_add(1, std::memory_order_release);
+      return true;
+    }
+  }
+  return false;
+}
+
+static void unregisterHeap(SharedHeap *heap) {
+  for (auto &slot : sharedHeaps) {
+    SharedHeap *expected = heap;
+    if (slot.compare_exchange_strong(expected, nullptr, std::memory_order_acq_rel)) {
+      sharedHeapCount.fetch_sub(1, std::memory_order_release);
+      return;
+    }
+  }
+}
+
+SharedHeap::SharedHeap(int fd, char *base, size_t capacity, pid_t owner)
+    : _fd(fd), _base(base), _capacity(capacity), _owner(owner) {
+  d_assert(capacity % kPageSize == 0);
+  if (owner != 0) {
+    _free.add(Span(0, capacity / kPageSize));
+  }
+}
+
+SharedHeap *SharedHeap::create(const char *name, size_t capacity) {
+#ifdef __linux__
+  if (capacity == 0 || capacity > kArenaSegmentSize) {
+    errno = EINVAL;
+    return nullptr;
+  }
+  capacity = RoundUpToPage(capacity);
+
+  const int fd = syscall(__NR_memfd_create, name != nullptr ? name : "mesh_shared", MFD_CLOEXEC);
+  if (fd < 0) {
+    return nullptr;
+  }
+
+  if (ftruncate(fd, capacity) != 0) {
+    const int err = errno;
+    ::close(fd);
+    errno = err;
+    return nullptr;
+  }
+
+  void *base = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED) {
+    const int err = errno;
+    ::close(fd);
+    errno = err;
+    return nullptr;
+  }
+
+  void *buf = internal::Heap().malloc(sizeof(SharedHeap));
+  auto heap = new (buf) SharedHeap(fd, reinterpret_cast<char *>(base), capacity, getpid());
+  if (!registerHeap(heap)) {
+    destroy(heap);
+    errno = EMFILE;
+    return nullptr;
+  }
+
+  return heap;
+#else
+  errno = ENOSYS;
+  return nullptr;
+#endif
+}
+
+void SharedHeap::destroy(SharedHeap *heap) {
+  if (heap == nullptr) {
+    return;
+  }
+
+  unregisterHeap(heap);
+  munmap(heap->_base, heap->_capacity);
+  ::close(heap->_fd);
+
+  heap->~SharedHeap();
+  internal::Heap().free(heap);
+}
+
+int SharedHeap::send(int sock) const {
+  uint64_t base = reinterpret_cast<uintptr_t>(_base);
+  struct iovec iov;
+  iov.iov_base = &base;
+  iov.iov_len = sizeof(base);
+
+  char control[CMSG_SPACE(sizeof(int))];
+  memset(control, 0, sizeof(control));
+
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &_fd, sizeof(int));
+
+  const auto sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+  if (sent != static_cast<ssize_t>(sizeof(base))) {
+    if (sent >= 0) {
+      errno = EIO;
+    }
+    return -1;
+  }
+
+  return 0;
+}
+
+SharedHeap *SharedHeap::recv(int sock) {
+  uint64_t base = 0;
+  struct iovec iov;
+  iov.iov_base = &base;
+  iov.iov_len = sizeof(base);
+
+  char control[CMSG_SPACE(sizeof(int))];
+  memset(control, 0, sizeof(control));
+
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  const auto received = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+  if (received < 0) {
+    return nullptr;
+  }
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (received != static_cast<ssize_t>(sizeof(base)) || cmsg == nullptr || cmsg->cmsg_level != SOL_SOCKET ||
+      cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(int))) {
+    errno = EPROTO;
+    return nullptr;
+  }
+
+  int fd = -1;
+  memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size <= 0 || st.st_size % kPageSize != 0) {
+    ::close(fd);
+    errno = EPROTO;
+    return nullptr;
+  }
+  const size_t capacity = st.st_size;
+
+  // the sender's address if it is free here, so pointers can be
+  // passed as they are, and otherwise anywhere
+  void *ptr = mmap(reinterpret_cast<void *>(base), capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED_NOREPLACE,
+                   fd, 0);
+  if (ptr == MAP_FAILED) {
+    ptr = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  if (ptr == MAP_FAILED) {
+    const int err = errno;
+    ::close(fd);
+    errno = err;
+    return nullptr;
+  }
+
+  void *buf = internal::Heap().malloc(sizeof(SharedHeap));
+  return new (buf) SharedHeap(fd, reinterpret_cast<char *>(ptr), capacity, 0);
+}
+
+void *SharedHeap::malloc(size_t sz) {
+  if (unlikely(!isOwner())) {
+    errno = EPERM;
+    return nullptr;
+  }
+
+  const Length pageCount = PageCount(sz > 0 ? sz : 1);
+  if (unlikely(pageCount > _capacity / kPageSize)) {
+    errno = ENOMEM;
+    return nullptr;
+  }
+
+  lock_guard<mutex> lock(_mutex);
+
+  Span span(0, 0);
+  if (!_free.findBestFit(pageCount, span)) {
+    errno = ENOMEM;
+    return nullptr;
+  }
+  Span rest = span.splitAfter(pageCount);
+  if (!rest.empty()) {
+    _free.add(rest);
+  }
+
+  _allocated[span.offset] = span.length;
+  return _base + span.offset * kPageSize;
+}
+
+void SharedHeap::free(void *ptr) {
+  // a forked child's copy of our bookkeeping isn't the parent's
+  if (unlikely(!isOwner())) {
+    return;
+  }
+
+  d_assert(contains(ptr));
+  const size_t off = reinterpret_cast<char *>(ptr) - _base;
+  if (unlikely(off % kPageSize != 0)) {
+    debug("mesh: invalid free of %p in shared heap", ptr);
+    return;
+  }
+
+  lock_guard<mutex> lock(_mutex);
+
+  auto it = _allocated.find(off / kPageSize);
+  if (unlikely(it == _allocated.end())) {
+    debug("mesh: invalid free of %p in shared heap", ptr);
+    return;
+  }
+
+  // the pages stay resident for reuse, like the arena's dirty pages
+  _free.add(Span(it->first, it->second));
+  _allocated.erase(it);
+}
+
+size_t SharedHeap::getSize(const void *ptr) const {
+  d_assert(contains(ptr));
+  const size_t off = reinterpret_cast<const char *>(ptr) - _base;
+
+  lock_guard<mutex> lock(_mutex);
+
+  auto it = _allocated.find(off / kPageSize);
+  if (it == _allocated.end() || off % kPageSize != 0) {
+    return 0;
+  }
+  return it->second * kPageSize;
+}
+
+SharedHeap *SharedHeap::heapFor(const void *ptr) {
+  if (likely(sharedHeapCount.load(std::memory_order_acquire) == 0)) {
+    return nullptr;
+  }
+
+  for (auto &slot : sharedHeaps) {
+    auto heap = slot.load(std::memory_order_acquire);
+    if (heap != nullptr && heap->contains(ptr)) {
+      return heap;
+    }
+  }
+  return nullptr;
+}
+}  // namespace mesh
@@ -0,0 +1,91 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2019 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+#pragma once
+#ifndef MESH__SHARED_HEAP_H
+#define MESH__SHARED_HEAP_H
+
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "internal.h"
+#include "span_free_list.h"
+
+namespace mesh {
+
+// a heap in a memfd of its own, for handing objects to another
+// process without copying them.  The process that creates it
+// allocates from it, a page at a time, and frees its objects with
+// plain free().  Its fd can be sent over a Unix socket to a process
+// that maps it and reads the objects in place -- at the same address
+// when that is free there, so pointers into it stay valid.
+//
+// It isn't part of the arena, so meshing, purging and the fork-copy
+// logic never touch it: a forked child shares its pages with the
+// parent, but only the creating process allocates or frees.
+class SharedHeap {
+private:
+  DISALLOW_COPY_AND_ASSIGN(SharedHeap);
+
+public:
+  // nullptr (with errno set) if the memfd couldn't be created
+  static SharedHeap *create(const char *name, size_t capacity);
+  // maps a heap sent with send(); nullptr (with errno set) on failure
+  static SharedHeap *recv(int sock);
+  // unmaps the heap and closes its fd.  Objects still allocated from
+  // it are gone, here -- another process's mapping is unaffected.
+  static void destroy(SharedHeap *heap);
+
+  // sends our fd and base address; 0 on success, -1 (with errno set)
+  // on failure
+  int send(int sock) const;
+
+  // nullptr (with errno set) if we don't own the heap or it is full
+  void *malloc(size_t sz);
+  void free(void *ptr);
+  size_t getSize(const void *ptr) const;
+
+  // the heap created by this process that holds ptr, if any
+  static SharedHeap *heapFor(const void *ptr);
+
+  inline bool contains(const void *ptr) const {
+    const auto ptrval = reinterpret_cast<uintptr_t>(ptr);
+    const auto base = reinterpret_cast<uintptr_t>(_base);
+    return base <= ptrval && ptrval < base + _capacity;
+  }
+
+  inline char *base() const {
+    return _base;
+  }
+
+  inline size_t capacity() const {
+    return _capacity;
+  }
+
+  inline int fd() const {
+    return _fd;
+  }
+
+  inline bool isOwner() const {
+    return _owner == getpid();
+  }
+
+private:
+  SharedHeap(int fd, char *base, size_t capacity, pid_t owner);
+
+  const int _fd;
+  char *const _base;
+  const size_t _capacity;
+  // 0 for heaps received from another process
+  const pid_t _owner;
+
+  mutable mutex _mutex{};
+  SpanFreeList _free{};
+  // the length of each allocated span, by offset
+  internal::map<Offset, Length> _allocated{};
+};
+}  // namespace mesh
+
+#endif  // MESH__SHARED_HEAP_H
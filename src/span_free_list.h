@@ -0,0 +1,315 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2019 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+#pragma once
+#ifndef MESH__SPAN_FREE_LIST_H
+#define MESH__SPAN_FREE_LIST_H
+
+#include "internal.h"
+
+namespace mesh {
+
+// free spans of the arena, indexed by span class.  Spans shorter than
+// kSpanClassCount pages are kept per (exact) length, ordered by
+// address; longer spans share the last class, ordered by length and
+// then address.  A bitmap of non-empty classes lets findBestFit jump
+// straight to the smallest class that can satisfy a request, so
+// placement is best-fit, lowest-address-first, and deterministic.
+// findAlignedFit does the same for aligned requests, carving the
+// aligned range out of a free span in place.
+//
+// All spans are also indexed by address, and add() merges a span with
+// any free neighbours in the same list, so spans stay coalesced as
+// they are freed rather than needing a periodic rebuild.  Spans are
+// never merged across an arena segment boundary.
+class SpanFreeList {
+private:
+  DISALLOW_COPY_AND_ASSIGN(SpanFreeList);
+
+  struct ByOffset {
+    inline bool operator()(const Span &a, const Span &b) const {
+      return a.offset < b.offset;
+    }
+  };
+
+  struct ByLength {
+    inline bool operator()(const Span &a, const Span &b) const {
+      return a.length < b.length || (a.length == b.length && a.offset < b.offset);
+    }
+  };
+
+  static constexpr size_t kLargeClass = kSpanClassCount - 1;
+  // spans findAlignedFit checks for an aligned range before settling
+  // for one long enough to be sure of containing it
+  static constexpr size_t kMaxAlignedProbes = 32;
+  static constexpr size_t kBitmapWords = kSpanClassCount / 64;
+  static_assert(kSpanClassCount % 64 == 0, "bitmap assumes a multiple of 64 span classes");
+
+public:
+  SpanFreeList() {
+  }
+
+  // add span, coalescing it with adjacent free spans.  Returns the
+  // (possibly larger) span that was inserted.
+  Span add(const Span &span) {
+    d_assert(!span.empty());
+    Span merged = span;
+
+    auto next = _byOffset.lower_bound(span);
+    d_assert(next == _byOffset.end() || next->offset >= span.offset + span.length);
+    if (next != _byOffset.begin() && span.offset % kArenaSegmentPages != 0) {
+      auto prev = std::prev(next);
+      d_assert(prev->offset + prev->length <= span.offset);
+      if (prev->offset + prev->length == span.offset) {
+        merged = Span(prev->offset, prev->length + merged.length);
+        remove(*prev);
+      }
+    }
+    if (next != _byOffset.end() && next->offset == span.offset + span.length &&
+        next->offset % kArenaSegmentPages != 0) {
+      merged.length += next->length;
+      remove(*next);
+    }
+
+    insert(merged);
+    return merged;
+  }
+
+  // remove and return the smallest (and then lowest-addressed) span
+  // at least pageCount pages long, starting at or above minOffset.
+  bool findBestFit(Length pageCount, Span &result, Length minOffset = 0) {
+    if (!bestFit(pageCount, minOffset, result)) {
+      return false;
+    }
+
+    d_assert(result.length >= pageCount);
+    remove(result);
+    return true;
+  }
+
+  // remove and return exactly pageCount pages starting at an offset o
+  // with (o + alignPhase) % pageAlignment == 0, carved out of a small
+  // span containing such a range.  Spans too short to always contain
+  // one are probed best-fit first, but only kMaxAlignedProbes of them;
+  // after that, the smallest span long enough to contain one whatever
+  // its offset is found directly.  The unaligned head and the tail of
+  // the span stay in the list.
+  bool findAlignedFit(Length pageCount, Length pageAlignment, Length alignPhase, Span &result, Length minOffset = 0) {
+    d_assert(pageAlignment > 0);
+    // any span this long contains an aligned range, whatever its offset
+    const Length alwaysFits = pageCount + pageAlignment - 1;
+    const auto fits = [&](const Span &span) {
+      return alignedOffset(span, pageAlignment, alignPhase) + pageCount <= span.offset + span.length;
+    };
+
+    Span found(0, 0);
+    size_t probes = 0;
+    for (auto spanClass = findNonEmptyClass(Span(0, pageCount).spanClass());
+         spanClass < kLargeClass && spanClass + 1 < alwaysFits && probes < kMaxAlignedProbes && found.empty();
+         spanClass = findNonEmptyClass(spanClass + 1)) {
+      const auto &spans = _exact[spanClass];
+      for (auto it = spans.lower_bound(Span(minOffset, 0)); it != spans.end(); ++it) {
+        if (fits(*it)) {
+          found = *it;
+          break;
+        }
+        if (++probes == kMaxAlignedProbes) {
+          break;
+        }
+      }
+    }
+    for (auto it = _large.lower_bound(Span(minOffset, pageCount));
+         found.empty() && it != _large.end() && it->length < alwaysFits && probes < kMaxAlignedProbes; ++it, ++probes) {
+      if (it->offset >= minOffset && fits(*it)) {
+        found = *it;
+      }
+    }
+
+    if (found.empty() && !bestFit(alwaysFits, minOffset, found)) {
+      return false;
+    }
+
+    remove(found);
+
+    const Length headLength = alignedOffset(found, pageAlignment, alignPhase) - found.offset;
+    result = found.splitAfter(headLength);
+    Span tail = result.splitAfter(pageCount);
+    d_assert(result.length == pageCount);
+    d_assert((result.offset + alignPhase) % pageAlignment == 0);
+
+    // neither piece can be adjacent to another free span, so these
+    // are plain inserts
+    if (!found.empty()) {
+      insert(found);
+    }
+    if (!tail.empty()) {
+      insert(tail);
+    }
+
+    return true;
+  }
+
+  // remove and return the lowest-addressed pageCount pages within
+  // [begin, end), carved out of whichever span holds them.  Scans the
+  // spans below end in address order.
+  bool findLowestFit(Length pageCount, Length begin, Length end, Span &result) {
+    d_assert(pageCount > 0);
+
+    // the span holding begin (if any) starts before it
+    auto it = _byOffset.upper_bound(Span(begin, 0));
+    if (it != _byOffset.begin()) {
+      --it;
+    }
+
+    Span found(0, 0);
+    Length start = 0;
+    for (; it != _byOffset.end() && it->offset < end; ++it) {
+      start = std::max(it->offset, begin);
+      if (start + pageCount <= std::min(it->offset + it->length, end)) {
+        found = *it;
+        break;
+      }
+    }
+
+    if (found.empty()) {
+      return false;
+    }
+
+    remove(found);
+
+    result = found.splitAfter(start - found.offset);
+    Span tail = result.splitAfter(pageCount);
+    d_assert(result.length == pageCount);
+
+    if (!found.empty()) {
+      insert(found);
+    }
+    if (!tail.empty()) {
+      insert(tail);
+    }
+
+    return true;
+  }
+
+  // in address order
+  template <typename Func>
+  inline void forEach(const Func func) const {
+    for (const auto &span : _byOffset) {
+      func(span);
+    }
+  }
+
+  void clear() {
+    for (size_t i = 0; i < kLargeClass; i++) {
+      _exact[i].clear();
+    }
+    _large.clear();
+    _byOffset.clear();
+    for (size_t i = 0; i < kBitmapWords; i++) {
+      _nonEmpty[i] = 0;
+    }
+    _pageCount = 0;
+  }
+
+  inline size_t pageCount() const {
+    return _pageCount;
+  }
+
+  inline bool empty() const {
+    return _pageCount == 0;
+  }
+
+private:
+  void insert(const Span &span) {
+    const auto spanClass = span.spanClass();
+    if (spanClass == kLargeClass) {
+      _large.insert(span);
+    } else {
+      _exact[spanClass].insert(span);
+    }
+    _byOffset.insert(span);
+    _nonEmpty[spanClass / 64] |= 1ULL << (spanClass % 64);
+    _pageCount += span.length;
+  }
+
+  // span must be in the list.  Taken by value, as callers pass
+  // references to the elements being erased.
+  void remove(const Span span) {
+    const auto spanClass = span.spanClass();
+    bool classEmpty = false;
+    if (spanClass == kLargeClass) {
+      const auto erased = _large.erase(span);
+      d_assert(erased == 1);
+      classEmpty = _large.empty();
+    } else {
+      const auto erased = _exact[spanClass].erase(span);
+      d_assert(erased == 1);
+      classEmpty = _exact[spanClass].empty();
+    }
+    const auto erased = _byOffset.erase(span);
+    d_assert(erased == 1);
+    if (classEmpty) {
+      _nonEmpty[spanClass / 64] &= ~(1ULL << (spanClass % 64));
+    }
+    _pageCount -= span.length;
+  }
+
+  // the smallest (and then lowest-addressed) span at least pageCount
+  // pages long, starting at or above minOffset
+  bool bestFit(Length pageCount, Length minOffset, Span &result) const {
+    for (auto spanClass = findNonEmptyClass(Span(0, pageCount).spanClass()); spanClass < kLargeClass;
+         spanClass = findNonEmptyClass(spanClass + 1)) {
+      auto it = _exact[spanClass].lower_bound(Span(minOffset, 0));
+      if (it != _exact[spanClass].end()) {
+        result = *it;
+        return true;
+      }
+    }
+
+    // longer spans are ordered by length and then offset: skip from
+    // one length to the next rather than a span at a time
+    auto it = _large.lower_bound(Span(minOffset, pageCount));
+    while (it != _large.end() && it->offset < minOffset) {
+      it = _large.lower_bound(Span(minOffset, it->length));
+    }
+    if (it == _large.end()) {
+      return false;
+    }
+    result = *it;
+    return true;
+  }
+
+  // first offset within or after span that is aligned
+  static inline Length alignedOffset(const Span &span, Length pageAlignment, Length alignPhase) {
+    const Length misalignment = (span.offset + alignPhase) % pageAlignment;
+    return misalignment == 0 ? span.offset : span.offset + pageAlignment - misalignment;
+  }
+
+  // first non-empty span class >= spanClass, or kSpanClassCount
+  inline size_t findNonEmptyClass(size_t spanClass) const {
+    if (spanClass >= kSpanClassCount) {
+      return kSpanClassCount;
+    }
+    size_t word = spanClass / 64;
+    uint64_t bits = _nonEmpty[word] & (~0ULL << (spanClass % 64));
+    while (bits == 0) {
+      if (++word == kBitmapWords) {
+        return kSpanClassCount;
+      }
+      bits = _nonEmpty[word];
+    }
+
+    return word * 64 + __builtin_ctzll(bits);
+  }
+
+  internal::set<Span, ByOffset> _exact[kLargeClass]{};
+  internal::set<Span, ByLength> _large{};
+  internal::set<Span, ByOffset> _byOffset{};
+  uint64_t _nonEmpty[kBitmapWords]{};
+  size_t _pageCount{0};
+};
+}  // namespace mesh
+
+#endif  // MESH__SPAN_FREE_LIST_H
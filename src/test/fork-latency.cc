@@ -0,0 +1,97 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2019 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+// times fork() for increasingly large heaps.  Under mesh, fork()
+// only returns in the parent once the child has exec'd or exited, or
+// the parent has moved to a copy of the heap in new files, so this is
+// mostly the cost of that copy, if any.
+//
+//   src/test/fork-latency [max heap MB] [copy threads] [exec]
+//
+// the child checks a sample of the heap it was given before exiting,
+// or with exec set, execs /bin/true straight away, which shouldn't
+// need a copy of the heap at all.
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "plasma/mesh.h"
+
+static constexpr size_t kObjectSize = 1024;
+static constexpr size_t kCheckStride = 997;
+
+static bool childSeesHeap(const std::vector<char *> &objects) {
+  for (size_t i = 0; i < objects.size(); i += kCheckStride) {
+    if (objects[i][0] != static_cast<char>(i) || objects[i][kObjectSize - 1] != static_cast<char>(i >> 8))
+      return false;
+  }
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+  const size_t maxMB = argc > 1 ? strtoul(argv[1], nullptr, 10) : 4096;
+  size_t threads = argc > 2 ? strtoul(argv[2], nullptr, 10) : 1;
+  const bool exec = argc > 3 && atoi(argv[3]) != 0;
+
+  size_t old = 0;
+  size_t oldLen = sizeof(old);
+  if (mesh_mallctl("mesh.fork_copy_threads", &old, &oldLen, &threads, sizeof(threads)) != 0) {
+    fprintf(stderr, "not running under mesh\n");
+    return 1;
+  }
+
+  printf("copy threads: %zu%s\n", threads, exec ? ", child execs" : "");
+  printf("%10s %12s %12s\n", "heap MB", "fork ms", "child ms");
+
+  std::vector<char *> objects{};
+  for (size_t heapMB = 64; heapMB <= maxMB; heapMB *= 2) {
+    const size_t objectCount = heapMB * 1024 * 1024 / kObjectSize;
+    while (objects.size() < objectCount) {
+      const size_t i = objects.size();
+      char *object = reinterpret_cast<char *>(malloc(kObjectSize));
+      memset(object, 0, kObjectSize);
+      object[0] = static_cast<char>(i);
+      object[kObjectSize - 1] = static_cast<char>(i >> 8);
+      objects.push_back(object);
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    const pid_t pid = fork();
+    if (pid == 0) {
+      if (exec)
+        execl("/bin/true", "true", nullptr);
+      _exit(childSeesHeap(objects) ? 0 : 1);
+    } else if (pid < 0) {
+      perror("fork");
+      return 1;
+    }
+    const auto forked = std::chrono::steady_clock::now();
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+    const auto exited = std::chrono::steady_clock::now();
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      fprintf(stderr, "child saw a corrupt heap\n");
+      return 1;
+    }
+
+    using ms = std::chrono::duration<double, std::milli>;
+    printf("%10zu %12.1f %12.1f\n", heapMB, std::chrono::duration_cast<ms>(forked - start).count(),
+           std::chrono::duration_cast<ms>(exited - start).count());
+  }
+
+  for (auto object : objects)
+    free(object);
+
+  return 0;
+}
@@ -0,0 +1,145 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2019 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+// measures how long the other threads of a forking process stall.
+// Worker threads write to random objects of a large heap (and malloc
+// and free small ones) while the main thread forks children that
+// outlive the wait for an exec, so the parent has to move to a copy of
+// the heap each time.  Reports the latency of the workers' operations
+// while forks are going on.
+//
+//   src/test/fork-stall [heap MB] [worker threads] [forks]
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <thread>
+#include <vector>
+
+static constexpr size_t kObjectSize = 1024;
+static constexpr size_t kBuckets = 40;
+
+using std::chrono::steady_clock;
+
+// log2 buckets of nanoseconds
+struct Histogram {
+  size_t counts[kBuckets]{};
+  uint64_t maxNs{0};
+  size_t total{0};
+
+  void add(uint64_t ns) {
+    counts[std::min<size_t>(64 - __builtin_clzll(ns | 1), kBuckets - 1)]++;
+    maxNs = std::max(maxNs, ns);
+    total++;
+  }
+
+  void merge(const Histogram &other) {
+    for (size_t i = 0; i < kBuckets; i++)
+      counts[i] += other.counts[i];
+    maxNs = std::max(maxNs, other.maxNs);
+    total += other.total;
+  }
+
+  // upper bound of the bucket holding the given quantile
+  double percentileUs(double quantile) const {
+    const size_t rank = static_cast<size_t>(quantile * total);
+    size_t seen = 0;
+    for (size_t i = 0; i < kBuckets; i++) {
+      seen += counts[i];
+      if (seen > rank)
+        return static_cast<double>(1ULL << i) / 1000;
+    }
+    return static_cast<double>(maxNs) / 1000;
+  }
+};
+
+int main(int argc, char *argv[]) {
+  const size_t heapMB = argc > 1 ? strtoul(argv[1], nullptr, 10) : 512;
+  const size_t threadCount = argc > 2 ? strtoul(argv[2], nullptr, 10) : 2;
+  const size_t forkCount = argc > 3 ? strtoul(argv[3], nullptr, 10) : 10;
+
+  const size_t objectCount = heapMB * 1024 * 1024 / kObjectSize;
+  std::vector<char *> objects(objectCount);
+  for (size_t i = 0; i < objectCount; i++) {
+    objects[i] = reinterpret_cast<char *>(malloc(kObjectSize));
+    memset(objects[i], static_cast<int>(i), kObjectSize);
+  }
+
+  std::atomic<bool> done{false};
+  std::atomic<bool> forking{false};
+  std::vector<Histogram> histograms(threadCount);
+  std::vector<std::thread> workers{};
+  for (size_t t = 0; t < threadCount; t++) {
+    workers.emplace_back([&, t]() {
+      std::mt19937_64 rng(t);
+      Histogram &histogram = histograms[t];
+      while (!done) {
+        const auto start = steady_clock::now();
+        memset(objects[rng() % objectCount], static_cast<int>(t), 64);
+        free(malloc(64));
+        const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(steady_clock::now() - start).count();
+        if (forking)
+          histogram.add(ns);
+      }
+    });
+  }
+
+  printf("heap: %zu MB, %zu workers, %zu forks\n", heapMB, threadCount, forkCount);
+
+  double forkMsTotal = 0;
+  double forkMsMax = 0;
+  for (size_t f = 0; f < forkCount; f++) {
+    usleep(50 * 1000);
+    forking = true;
+
+    const auto start = steady_clock::now();
+    const pid_t pid = fork();
+    if (pid == 0) {
+      // longer than the parent waits to see if we exec
+      usleep(100 * 1000);
+      _exit(objects[0][kObjectSize - 1] == 0 ? 0 : 1);
+    } else if (pid < 0) {
+      perror("fork");
+      return 1;
+    }
+    const double forkMs = std::chrono::duration<double, std::milli>(steady_clock::now() - start).count();
+    forkMsTotal += forkMs;
+    forkMsMax = std::max(forkMsMax, forkMs);
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+    forking = false;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      fprintf(stderr, "child saw a corrupt heap\n");
+      return 1;
+    }
+  }
+
+  done = true;
+  for (auto &worker : workers)
+    worker.join();
+
+  Histogram all{};
+  for (const auto &histogram : histograms)
+    all.merge(histogram);
+
+  printf("fork() ms:   mean %.1f  max %.1f\n", forkMsTotal / forkCount, forkMsMax);
+  printf("worker ops while forking: %zu\n", all.total);
+  printf("latency us:  p50 <%.1f  p99 <%.1f  p99.9 <%.1f  max %.1f\n", all.percentileUs(0.5),
+         all.percentileUs(0.99), all.percentileUs(0.999), static_cast<double>(all.maxNs) / 1000);
+
+  for (auto object : objects)
+    free(object);
+
+  return 0;
+}
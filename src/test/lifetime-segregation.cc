@@ -0,0 +1,102 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2019 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+// interleaves long-lived and short-lived allocations of the same size
+// from two different call sites.  Compare the output of
+//
+//   MESH_LIFETIME_SEGREGATION=0 src/test/lifetime-segregation
+//   MESH_LIFETIME_SEGREGATION=1 src/test/lifetime-segregation
+//
+// with segregation enabled the long-lived objects end up densely
+// packed in their own spans, so fewer spans are left sparsely
+// occupied (and fewer meshes are needed) once the short-lived objects
+// are freed.  A site is only classified once a sample of it has lived
+// twice the long-lived threshold (2 s), so the run is long enough for
+// most of it to happen after that.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include "plasma/mesh.h"
+
+static constexpr size_t kObjectSize = 64;
+static constexpr size_t kRounds = 80;
+static constexpr size_t kPerRound = 100000;
+static constexpr size_t kShortPerLong = 15;
+
+static size_t mallctlSize(const char *name) {
+  size_t value = 0;
+  size_t len = sizeof(value);
+  mesh_mallctl(name, &value, &len, nullptr, 0);
+  return value;
+}
+
+__attribute__((noinline)) static void *allocLongLived() {
+  return malloc(kObjectSize);
+}
+
+__attribute__((noinline)) static void *allocShortLived() {
+  return malloc(kObjectSize);
+}
+
+int main(void) {
+  std::vector<void *> longLived;
+  std::vector<void *> shortLived;
+  longLived.reserve(kRounds * kPerRound / (kShortPerLong + 1));
+  shortLived.reserve(kPerRound);
+
+  const auto start = std::chrono::steady_clock::now();
+  for (size_t round = 0; round < kRounds; round++) {
+    for (size_t i = 0; i < kPerRound; i++) {
+      void *ptr = nullptr;
+      if (i % (kShortPerLong + 1) == 0) {
+        ptr = allocLongLived();
+        longLived.push_back(ptr);
+      } else {
+        ptr = allocShortLived();
+        shortLived.push_back(ptr);
+      }
+      memset(ptr, 0xab, kObjectSize);
+    }
+
+    // give the sampled long-lived objects time to age past the
+    // classification threshold
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+    for (auto ptr : shortLived)
+      free(ptr);
+    shortLived.clear();
+  }
+  const auto elapsed = std::chrono::steady_clock::now() - start;
+
+  mallctlSize("mesh.compact");
+
+  size_t meshes = 0;
+  char name[64];
+  for (size_t i = 0;; i++) {
+    size_t value = 0;
+    size_t len = sizeof(value);
+    snprintf(name, sizeof(name), "stats.class.%zu.meshes", i);
+    if (mesh_mallctl(name, &value, &len, nullptr, 0) != 0)
+      break;
+    meshes += value;
+  }
+
+  printf("segregation:  %zu\n", mallctlSize("mesh.lifetime_segregation"));
+  printf("elapsed ms:   %lld\n",
+         static_cast<long long>(std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count()));
+  printf("live objects: %zu\n", longLived.size());
+  printf("resident:     %zu KiB\n", mallctlSize("stats.resident") / 1024);
+  printf("meshes:       %zu\n", meshes);
+
+  for (auto ptr : longLived)
+    free(ptr);
+
+  return 0;
+}
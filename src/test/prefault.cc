@@ -0,0 +1,114 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2019 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+// measures the page faults taken and the time spent allocating and
+// then first touching small objects and large buffers.  Compare
+//
+//   src/test/prefault 0
+//   src/test/prefault 1
+//
+// the second run sets mesh.prefault and mesh.prefault_threshold, so
+// fresh spans are faulted in when they are allocated.  The total
+// (alloc + touch) is what matters: prefaulting moves the cost into
+// malloc, and should make it smaller by batching the faults.  Faults
+// taken by MADV_POPULATE_WRITE itself still show up in the counts, as
+// part of alloc rather than touch.
+
+#include <sys/resource.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "plasma/mesh.h"
+
+static constexpr size_t kPageSize = 4096;
+static constexpr size_t kObjectSize = 256;
+static constexpr size_t kObjectCount = 1024 * 1024;  // 256 MB
+static constexpr size_t kBufferSize = 4 * 1024 * 1024;
+static constexpr size_t kBufferCount = 64;  // 256 MB
+
+struct Sample {
+  std::chrono::steady_clock::time_point time;
+  long minflt;
+};
+
+static Sample sample() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return Sample{std::chrono::steady_clock::now(), usage.ru_minflt};
+}
+
+static void report(const char *phase, const Sample &start, const Sample &end, size_t pages) {
+  const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end.time - start.time).count();
+  printf("%-14s %10ld faults %10.1f ns/page\n", phase, end.minflt - start.minflt, static_cast<double>(ns) / pages);
+}
+
+static bool setKnob(const char *name, size_t value) {
+  size_t old = 0;
+  size_t oldLen = sizeof(old);
+  if (mesh_mallctl(name, &old, &oldLen, &value, sizeof(value)) != 0) {
+    fprintf(stderr, "setting %s failed (not running under mesh?)\n", name);
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+  const size_t prefault = argc > 1 ? strtoul(argv[1], nullptr, 10) : 0;
+
+  if (!setKnob("mesh.prefault", prefault) || !setKnob("mesh.prefault_threshold", prefault ? kBufferSize : 0))
+    return 1;
+
+  printf("prefault: %zu\n", prefault);
+
+  // small objects, refilling from fresh spans as we go
+  std::vector<char *> objects(kObjectCount);
+  const size_t objectPages = kObjectCount * kObjectSize / kPageSize;
+
+  auto start = sample();
+  for (size_t i = 0; i < kObjectCount; i++)
+    objects[i] = reinterpret_cast<char *>(malloc(kObjectSize));
+  auto allocated = sample();
+  for (size_t i = 0; i < kObjectCount; i++)
+    memset(objects[i], 1, kObjectSize);
+  auto touched = sample();
+
+  report("small alloc", start, allocated, objectPages);
+  report("small touch", allocated, touched, objectPages);
+  report("small total", start, touched, objectPages);
+
+  // large buffers, each its own span
+  std::vector<char *> buffers(kBufferCount);
+  const size_t bufferPages = kBufferCount * kBufferSize / kPageSize;
+
+  start = sample();
+  for (size_t i = 0; i < kBufferCount; i++)
+    buffers[i] = reinterpret_cast<char *>(malloc(kBufferSize));
+  allocated = sample();
+  for (size_t i = 0; i < kBufferCount; i++)
+    for (size_t off = 0; off < kBufferSize; off += kPageSize)
+      buffers[i][off] = 1;
+  touched = sample();
+
+  report("large alloc", start, allocated, bufferPages);
+  report("large touch", allocated, touched, bufferPages);
+  report("large total", start, touched, bufferPages);
+
+  size_t prefaulted = 0;
+  size_t len = sizeof(prefaulted);
+  if (mesh_mallctl("stats.prefaulted", &prefaulted, &len, nullptr, 0) == 0)
+    printf("prefaulted:    %zu MB\n", prefaulted / 1024 / 1024);
+
+  for (size_t i = 0; i < kObjectCount; i++)
+    free(objects[i]);
+  for (size_t i = 0; i < kBufferCount; i++)
+    free(buffers[i]);
+
+  return 0;
+}
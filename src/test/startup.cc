@@ -0,0 +1,132 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2019 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+// measures what an allocator costs a short-lived program: the time
+// from exec to the first malloc in main returning, and the process's
+// page tables, private writable memory (VmData, which doesn't count
+// address space that is only reserved), resident memory and open
+// files at that point.  Compare allocators, or builds of mesh, with
+//
+//   src/test/startup [runs]
+//   LD_PRELOAD=./libmesh.so src/test/startup [runs]
+
+#include <dirent.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <vector>
+
+struct Result {
+  uint64_t ns;
+  long pteKb;
+  long dataKb;
+  long rssKb;
+  long fds;
+};
+
+static uint64_t nowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+static long statusKb(const char *status, const char *field) {
+  const char *line = strstr(status, field);
+  return line != nullptr ? strtol(line + strlen(field), nullptr, 10) : -1;
+}
+
+static long openFds() {
+  DIR *dir = opendir("/proc/self/fd");
+  if (dir == nullptr)
+    return -1;
+  long count = 0;
+  while (readdir(dir) != nullptr)
+    count++;
+  closedir(dir);
+  // ., .. and the directory itself
+  return count - 3;
+}
+
+static int child(int fd, uint64_t execNs) {
+  void *volatile ptr = malloc(16);
+  const uint64_t ns = nowNs() - execNs;
+  free(ptr);
+
+  char status[4096] = {};
+  FILE *file = fopen("/proc/self/status", "r");
+  if (file != nullptr) {
+    const auto _ __attribute__((unused)) = fread(status, 1, sizeof(status) - 1, file);
+    fclose(file);
+  }
+
+  const Result result{ns, statusKb(status, "VmPTE:"), statusKb(status, "VmData:"), statusKb(status, "VmRSS:"),
+                      openFds()};
+  return write(fd, &result, sizeof(result)) == sizeof(result) ? 0 : 1;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc == 4 && strcmp(argv[1], "--child") == 0)
+    return child(atoi(argv[2]), strtoull(argv[3], nullptr, 10));
+
+  const size_t runs = argc > 1 ? strtoul(argv[1], nullptr, 10) : 200;
+  const char *preload = getenv("LD_PRELOAD");
+  printf("allocator: %s, %zu runs\n", preload != nullptr && *preload ? preload : "default", runs);
+
+  std::vector<uint64_t> times{};
+  Result last{};
+  for (size_t i = 0; i < runs; i++) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+      perror("pipe");
+      return 1;
+    }
+
+    const pid_t pid = fork();
+    if (pid == 0) {
+      close(fds[0]);
+      char fdStr[16];
+      char nsStr[32];
+      snprintf(fdStr, sizeof(fdStr), "%d", fds[1]);
+      snprintf(nsStr, sizeof(nsStr), "%llu", static_cast<unsigned long long>(nowNs()));
+      execl("/proc/self/exe", argv[0], "--child", fdStr, nsStr, nullptr);
+      _exit(1);
+    } else if (pid < 0) {
+      perror("fork");
+      return 1;
+    }
+    close(fds[1]);
+
+    Result result{};
+    const bool ok = read(fds[0], &result, sizeof(result)) == sizeof(result);
+    close(fds[0]);
+    int status = 0;
+    waitpid(pid, &status, 0);
+    if (!ok || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      fprintf(stderr, "child failed\n");
+      return 1;
+    }
+
+    times.push_back(result.ns);
+    last = result;
+  }
+
+  std::sort(times.begin(), times.end());
+  uint64_t total = 0;
+  for (const auto ns : times)
+    total += ns;
+
+  printf("exec to first malloc us:  mean %.1f  p50 %.1f  p90 %.1f\n", total / 1000.0 / runs,
+         times[runs / 2] / 1000.0, times[runs * 9 / 10] / 1000.0);
+  printf("at first malloc:  VmPTE %ld kB  VmData %ld kB  VmRSS %ld kB  open files %ld\n", last.pteKb, last.dataKb,
+         last.rssKb, last.fds);
+
+  return 0;
+}
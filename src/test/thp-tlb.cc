@@ -0,0 +1,159 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2019 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+// allocates a large number of small objects, links them into a
+// random cycle and chases pointers through it, reporting time per
+// access and dTLB load misses.  Compare
+//
+//   src/test/thp-tlb 0
+//   src/test/thp-tlb 1
+//
+// the second run places the size class in transparent huge page
+// regions (mesh.class.<n>.huge_pages).  Huge pages for the heap
+// require /sys/kernel/mm/transparent_hugepage/shmem_enabled to be
+// "advise" (or "always"); ShmemPmdMapped below shows whether any were
+// actually used.
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "plasma/mesh.h"
+
+static constexpr size_t kObjectSize = 64;
+static constexpr size_t kObjectCount = 4 * 1024 * 1024;  // 256 MB
+static constexpr size_t kSteps = 32 * 1024 * 1024;
+
+struct Node {
+  Node *next;
+  char pad[kObjectSize - sizeof(Node *)];
+};
+
+static int sizeClassFor(size_t sz) {
+  for (int n = 0;; n++) {
+    char name[64];
+    snprintf(name, sizeof(name), "mesh.class.%d.size", n);
+    size_t classSize = 0;
+    size_t len = sizeof(classSize);
+    if (mesh_mallctl(name, &classSize, &len, nullptr, 0) != 0)
+      return -1;
+    if (classSize >= sz)
+      return n;
+  }
+}
+
+static int openDtlbCounter() {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HW_CACHE;
+  attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+
+  return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void printShmemPmdMapped() {
+  FILE *f = fopen("/proc/self/smaps_rollup", "r");
+  if (f == nullptr)
+    return;
+
+  char line[256];
+  while (fgets(line, sizeof(line), f) != nullptr) {
+    if (strncmp(line, "ShmemPmdMapped:", strlen("ShmemPmdMapped:")) == 0)
+      printf("%s", line);
+  }
+  fclose(f);
+}
+
+int main(int argc, char *argv[]) {
+  const size_t hugePages = argc > 1 ? strtoul(argv[1], nullptr, 10) : 0;
+
+  const int sizeClass = sizeClassFor(kObjectSize);
+  if (sizeClass < 0) {
+    fprintf(stderr, "not running under mesh\n");
+    return 1;
+  }
+
+  char name[64];
+  snprintf(name, sizeof(name), "mesh.class.%d.huge_pages", sizeClass);
+  size_t old = 0;
+  size_t oldLen = sizeof(old);
+  if (mesh_mallctl(name, &old, &oldLen, const_cast<size_t *>(&hugePages), sizeof(hugePages)) != 0) {
+    fprintf(stderr, "setting %s failed\n", name);
+    return 1;
+  }
+
+  std::vector<Node *> nodes(kObjectCount);
+
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < kObjectCount; i++) {
+    nodes[i] = reinterpret_cast<Node *>(malloc(sizeof(Node)));
+  }
+  const auto allocElapsed = std::chrono::steady_clock::now() - start;
+
+  // a random cycle through every object defeats the prefetchers, so
+  // nearly every step touches a different page
+  std::vector<size_t> order(kObjectCount);
+  for (size_t i = 0; i < kObjectCount; i++)
+    order[i] = i;
+  std::shuffle(order.begin(), order.end(), std::mt19937_64{42});
+  for (size_t i = 0; i < kObjectCount; i++)
+    nodes[order[i]]->next = nodes[order[(i + 1) % kObjectCount]];
+
+  const int fd = openDtlbCounter();
+  if (fd >= 0) {
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+  }
+
+  start = std::chrono::steady_clock::now();
+  Node *node = nodes[order[0]];
+  for (size_t i = 0; i < kSteps; i++)
+    node = node->next;
+  const auto chaseElapsed = std::chrono::steady_clock::now() - start;
+
+  uint64_t misses = 0;
+  if (fd >= 0) {
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(fd, &misses, sizeof(misses)) != sizeof(misses))
+      misses = 0;
+    close(fd);
+  }
+
+  using ns = std::chrono::nanoseconds;
+  printf("huge_pages:   %zu (class %d)\n", hugePages, sizeClass);
+  printf("alloc:        %.2f ns/object\n",
+         static_cast<double>(std::chrono::duration_cast<ns>(allocElapsed).count()) / kObjectCount);
+  printf("chase:        %.2f ns/step\n",
+         static_cast<double>(std::chrono::duration_cast<ns>(chaseElapsed).count()) / kSteps);
+  if (fd >= 0)
+    printf("dTLB misses:  %.3f /step\n", static_cast<double>(misses) / kSteps);
+  else
+    printf("dTLB misses:  n/a (perf_event_open failed)\n");
+  printShmemPmdMapped();
+
+  // keep the chase from being optimized away
+  if (node == nullptr)
+    return 1;
+
+  for (size_t i = 0; i < kObjectCount; i++)
+    free(nodes[i]);
+
+  return 0;
+}
@@ -3,6 +3,8 @@
 // Use of this source code is governed by the Apache License,
 // Version 2.0, that can be found in the LICENSE file.
 
+#include <sys/mman.h>
+
 #include "thread_local_heap.h"
 
 namespace mesh {
@@ -23,10 +25,97 @@ void ThreadLocalHeap::releaseAll() {
     _shuffleVector[i].refillMiniheaps();
     _global->releaseMiniheaps(_shuffleVector[i].miniheaps());
   }
+
+  for (size_t g = 0; g < kLifetimeGroupCount; g++) {
+    ShuffleVector *vectors = _groupShuffleVectors[g];
+    if (vectors == nullptr)
+      continue;
+    for (size_t i = 1; i < kNumBins; i++) {
+      vectors[i].refillMiniheaps();
+      _global->releaseMiniheaps(vectors[i].miniheaps());
+    }
+  }
+}
+
+ShuffleVector &ThreadLocalHeap::shuffleVectorFor(LifetimeGroup group, size_t sizeClass) {
+  if (group == LifetimeGroup::Default) {
+    return _shuffleVector[sizeClass];
+  }
+
+  ShuffleVector *&vectors = _groupShuffleVectors[static_cast<size_t>(group)];
+  if (unlikely(vectors == nullptr)) {
+    // mmap rather than the internal heap: ShuffleVectors must be
+    // cacheline aligned
+    void *buf = mmap(nullptr, RoundUpToPage(sizeof(ShuffleVector) * kNumBins), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    hard_assert(buf != MAP_FAILED);
+    vectors = new (buf) ShuffleVector[kNumBins];
+
+    const auto arenaBegin = _global->arenaBegin();
+    vectors[0].initialInit(arenaBegin, SizeMap::ByteSizeForClass(1));
+    for (size_t i = 1; i < kNumBins; i++) {
+      vectors[i].initialInit(arenaBegin, SizeMap::ByteSizeForClass(i));
+    }
+  }
+
+  return vectors[sizeClass];
+}
+
+void ThreadLocalHeap::freeGroupShuffleVectors() {
+  for (size_t g = 0; g < kLifetimeGroupCount; g++) {
+    ShuffleVector *vectors = _groupShuffleVectors[g];
+    if (vectors == nullptr)
+      continue;
+    for (size_t i = 0; i < kNumBins; i++) {
+      vectors[i].~ShuffleVector();
+    }
+    munmap(vectors, RoundUpToPage(sizeof(ShuffleVector) * kNumBins));
+    _groupShuffleVectors[g] = nullptr;
+  }
+}
+
+void *ThreadLocalHeap::segregatedMalloc(size_t sz, const void *returnAddress) {
+  uint32_t sizeClass = 0;
+  if (unlikely(!SizeMap::GetSizeClass(sz, &sizeClass))) {
+    return _global->malloc(sz);
+  }
+
+  auto &classifier = _global->lifetimeClassifier();
+  const auto site = LifetimeClassifier::siteFor(returnAddress);
+  const auto group = classifier.groupFor(site);
+
+  void *ptr = smallGroupMalloc(sizeClass, group);
+
+  if (unlikely(_sampler.shouldSample())) {
+    _sampler.sample(classifier, _prng, ptr, site);
+  }
+
+  return ptr;
+}
+
+void *ThreadLocalHeap::groupMalloc(size_t sz, LifetimeGroup group) {
+  uint32_t sizeClass = 0;
+  if (unlikely(!SizeMap::GetSizeClass(sz, &sizeClass))) {
+    return _global->malloc(sz, group);
+  }
+
+  return smallGroupMalloc(sizeClass, group);
+}
+
+void *ThreadLocalHeap::smallGroupMalloc(size_t sizeClass, LifetimeGroup group) {
+  ShuffleVector &shuffleVector = shuffleVectorFor(group, sizeClass);
+  if (unlikely(shuffleVector.isExhausted())) {
+    return smallAllocSlowpath(sizeClass, group);
+  }
+
+  return shuffleVector.malloc();
 }
 
 ThreadLocalHeap *ThreadLocalHeap::GetHeap() {
   auto heap = GetFastPathHeap();
+  if (heap == nullptr) {
+    heap = UnparkHeap();
+  }
   if (heap == nullptr) {
     heap = CreateThreadLocalHeap();
     _threadLocalData.fastpathHeap = heap;
@@ -34,9 +123,21 @@ ThreadLocalHeap *ThreadLocalHeap::GetHeap() {
   return heap;
 }
 
+ThreadLocalHeap *ThreadLocalHeap::UnparkHeap() {
+  auto heap = _threadLocalData.parkedHeap;
+  if (likely(heap == nullptr)) {
+    return nullptr;
+  }
+
+  heap->_global->ensureForkCopied();
+  _threadLocalData.parkedHeap = nullptr;
+  _threadLocalData.fastpathHeap = heap;
+  return heap;
+}
+
 // we get here if the shuffleVector is exhausted
-void *CACHELINE_ALIGNED_FN ThreadLocalHeap::smallAllocSlowpath(size_t sizeClass) {
-  ShuffleVector &shuffleVector = _shuffleVector[sizeClass];
+void *CACHELINE_ALIGNED_FN ThreadLocalHeap::smallAllocSlowpath(size_t sizeClass, LifetimeGroup group) {
+  ShuffleVector &shuffleVector = shuffleVectorFor(group, sizeClass);
 
   // we grab multiple MiniHeaps at a time from the global heap.  often
   // it is possible to refill the freelist from a not-yet-used
@@ -46,13 +147,18 @@ void *CACHELINE_ALIGNED_FN ThreadLocalHeap::smallAllocSlowpath(size_t sizeClass)
     return shuffleVector.malloc();
   }
 
-  return smallAllocGlobalRefill(shuffleVector, sizeClass);
+  return smallAllocGlobalRefill(shuffleVector, sizeClass, group);
 }
 
-void *CACHELINE_ALIGNED_FN ThreadLocalHeap::smallAllocGlobalRefill(ShuffleVector &shuffleVector, size_t sizeClass) {
+void *CACHELINE_ALIGNED_FN ThreadLocalHeap::smallAllocGlobalRefill(ShuffleVector &shuffleVector, size_t sizeClass,
+                                                                  LifetimeGroup group) {
   const size_t sizeMax = SizeMap::ByteSizeForClass(sizeClass);
 
-  _global->allocSmallMiniheaps(sizeClass, sizeMax, shuffleVector.miniheaps(), _current);
+  _global->allocSmallMiniheaps(sizeClass, sizeMax, shuffleVector.miniheaps(), _current, group);
+  // the compact window is full
+  if (unlikely(shuffleVector.miniheaps().size() == 0)) {
+    return nullptr;
+  }
   shuffleVector.reinit();
 
   d_assert(!shuffleVector.isExhausted());
@@ -17,6 +17,7 @@
 #include <atomic>
 
 #include "internal.h"
+#include "lifetime_classifier.h"
 #include "mini_heap.h"
 #include "shuffle_vector.h"
 
@@ -59,13 +60,24 @@ public:
 
   ~ThreadLocalHeap() {
     releaseAll();
+    freeGroupShuffleVectors();
   }
 
   void releaseAll();
 
-  void *ATTRIBUTE_NEVER_INLINE CACHELINE_ALIGNED_FN smallAllocSlowpath(size_t sizeClass);
-  void *ATTRIBUTE_NEVER_INLINE CACHELINE_ALIGNED_FN smallAllocGlobalRefill(ShuffleVector &shuffleVector,
-                                                                           size_t sizeClass);
+  void *ATTRIBUTE_NEVER_INLINE CACHELINE_ALIGNED_FN
+  smallAllocSlowpath(size_t sizeClass, LifetimeGroup group = LifetimeGroup::Default);
+  void *ATTRIBUTE_NEVER_INLINE CACHELINE_ALIGNED_FN smallAllocGlobalRefill(
+      ShuffleVector &shuffleVector, size_t sizeClass, LifetimeGroup group = LifetimeGroup::Default);
+
+  // malloc variant used when lifetime segregation is enabled: the
+  // allocation site (returnAddress) picks the lifetime group, and so
+  // the set of MiniHeaps, the object is allocated from.
+  void *ATTRIBUTE_NEVER_INLINE segregatedMalloc(size_t sz, const void *returnAddress);
+
+  // malloc from the MiniHeaps of an explicitly requested lifetime
+  // group, e.g. from mesh_malloc_hint.
+  void *ATTRIBUTE_NEVER_INLINE groupMalloc(size_t sz, LifetimeGroup group);
 
   inline void *memalign(size_t alignment, size_t size) {
     // Check for non power-of-two alignment.
@@ -165,6 +177,15 @@ public:
     return ptr;
   }
 
+  inline void *cxxNewSegregated(size_t sz, const void *returnAddress) {
+    void *ptr = segregatedMalloc(sz, returnAddress);
+    if (unlikely(ptr == NULL && sz != 0)) {
+      throw std::bad_alloc();
+    }
+
+    return ptr;
+  }
+
   // semiansiheap ensures we never see size == 0
   inline void *ATTRIBUTE_ALWAYS_INLINE malloc(size_t sz) {
     uint32_t sizeClass = 0;
@@ -186,9 +207,13 @@ public:
     if (unlikely(ptr == nullptr))
       return;
 
+    if (unlikely(LifetimeClassifier::enabled())) {
+      _sampler.onFree(_global->lifetimeClassifier(), ptr);
+    }
+
     auto mh = _global->miniheapFor(ptr);
     if (likely(mh && mh->current() == _current && !mh->hasMeshed())) {
-      ShuffleVector &shuffleVector = _shuffleVector[mh->sizeClass()];
+      ShuffleVector &shuffleVector = shuffleVectorFor(mh);
       shuffleVector.free(mh, ptr);
       return;
     }
@@ -205,7 +230,7 @@ public:
 
     auto mh = _global->miniheapFor(ptr);
     if (likely(mh && mh->current() == _current)) {
-      ShuffleVector &shuffleVector = _shuffleVector[mh->sizeClass()];
+      ShuffleVector &shuffleVector = shuffleVectorFor(mh);
       return shuffleVector.getSize();
     }
 
@@ -228,18 +253,50 @@ public:
 
   static ATTRIBUTE_NEVER_INLINE ThreadLocalHeap *GetHeap();
 
+  // set this thread's heap aside, so its next call into mesh takes a
+  // slow path
+  static inline void ParkHeap() {
+    _threadLocalData.parkedHeap = _threadLocalData.fastpathHeap;
+    _threadLocalData.fastpathHeap = nullptr;
+  }
+
+  // back to the parked heap (if any), after finishing the copy of a
+  // forked child's heap
+  static ThreadLocalHeap *UnparkHeap();
+
   static ThreadLocalHeap *CreateThreadLocalHeap();
 
 protected:
+  // MiniHeaps attached to this thread are always in the Default group
+  // unless lifetime segregation is enabled, so the per-group shuffle
+  // vectors are only allocated on first use.
+  inline ShuffleVector &ATTRIBUTE_ALWAYS_INLINE shuffleVectorFor(const MiniHeap *mh) {
+    const auto group = mh->lifetimeGroup();
+    if (likely(group == LifetimeGroup::Default)) {
+      return _shuffleVector[mh->sizeClass()];
+    }
+    d_assert(_groupShuffleVectors[static_cast<size_t>(group)] != nullptr);
+    return _groupShuffleVectors[static_cast<size_t>(group)][mh->sizeClass()];
+  }
+
+  ShuffleVector &shuffleVectorFor(LifetimeGroup group, size_t sizeClass);
+  void *smallGroupMalloc(size_t sizeClass, LifetimeGroup group);
+  void freeGroupShuffleVectors();
+
   ShuffleVector _shuffleVector[kNumBins] CACHELINE_ALIGNED;
   GlobalHeap *_global;
   pid_t _current{0};
   MWC _prng;
   const size_t _maxObjectSize;
   LocalHeapStats _stats{};
+  ShuffleVector *_groupShuffleVectors[kLifetimeGroupCount]{};
+  LifetimeSampler _sampler{};
 
   struct ThreadLocalData {
     ThreadLocalHeap *fastpathHeap;
+    // in a forked child, the forking thread's heap until its first
+    // call into mesh (see MeshableArena::forkCopyPending)
+    ThreadLocalHeap *parkedHeap;
   };
   static __thread ThreadLocalData _threadLocalData CACHELINE_ALIGNED ATTR_INITIAL_EXEC;
 };
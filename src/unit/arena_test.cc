@@ -0,0 +1,660 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2019 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <thread>
+
+#include "gtest/gtest.h"
+
+#include "internal.h"
+#include "runtime.h"
+
+using namespace mesh;
+
+TEST(ArenaTest, GrowsBySegments) {
+  GlobalHeap &gheap = runtime().heap();
+
+  static constexpr size_t AllocSize = 2UL * 1024 * 1024 * 1024 - kPageSize;
+  static constexpr size_t AllocCount = kArenaSegmentSize / AllocSize + 1;
+
+  void *ptrs[AllocCount];
+  for (size_t i = 0; i < AllocCount; i++) {
+    ptrs[i] = gheap.malloc(AllocSize);
+    ASSERT_NE(ptrs[i], nullptr);
+    ASSERT_TRUE(gheap.contains(ptrs[i]));
+
+    // no allocation straddles a segment boundary
+    const auto start = reinterpret_cast<char *>(ptrs[i]) - gheap.arenaBegin();
+    ASSERT_EQ(start / kArenaSegmentSize, (start + AllocSize - 1) / kArenaSegmentSize);
+  }
+
+  ASSERT_GE(gheap.segmentCount(), 2UL);
+  ASSERT_FALSE(gheap.contains(gheap.arenaEnd()));
+
+  char *last = reinterpret_cast<char *>(ptrs[AllocCount - 1]);
+  last[0] = 'a';
+  last[AllocSize - 1] = 'z';
+  ASSERT_EQ(last[0], 'a');
+  ASSERT_EQ(last[AllocSize - 1], 'z');
+  ASSERT_EQ(gheap.getSize(last), AllocSize);
+
+  for (size_t i = 0; i < AllocCount; i++) {
+    gheap.free(ptrs[i]);
+  }
+  gheap.scavenge(true);
+}
+
+TEST(ArenaTest, SpansAcrossShards) {
+  GlobalHeap &gheap = runtime().heap();
+
+  // a large span can cross from one of a segment's files to the next
+  static constexpr size_t AllocSize = kArenaShardSize + kArenaShardSize / 2;
+  auto ptr = reinterpret_cast<volatile char *>(gheap.malloc(AllocSize));
+  ASSERT_NE(ptr, nullptr);
+  const size_t start = const_cast<char *>(ptr) - gheap.arenaBegin();
+  ASSERT_NE(start / kArenaShardSize, (start + AllocSize - 1) / kArenaShardSize);
+
+  const size_t boundary = (start / kArenaShardSize + 1) * kArenaShardSize - start;
+  ptr[0] = 'a';
+  ptr[boundary - 1] = 'b';
+  ptr[boundary] = 'c';
+  ptr[AllocSize - 1] = 'd';
+  ASSERT_EQ(ptr[0], 'a');
+  ASSERT_EQ(ptr[boundary - 1], 'b');
+  ASSERT_EQ(ptr[boundary], 'c');
+  ASSERT_EQ(ptr[AllocSize - 1], 'd');
+
+  // and purging it punches holes in both
+  gheap.free(const_cast<char *>(ptr));
+  gheap.scavenge(true);
+  ASSERT_EQ(ptr[0], 0);
+  ASSERT_EQ(ptr[boundary - 1], 0);
+  ASSERT_EQ(ptr[boundary], 0);
+  ASSERT_EQ(ptr[AllocSize - 1], 0);
+}
+
+TEST(ArenaTest, HugePageRegions) {
+  const auto tid = gettid();
+  GlobalHeap &gheap = runtime().heap();
+
+  static constexpr size_t StrLen = 128;
+  const auto sizeClass = SizeMap::SizeClass(StrLen);
+
+  char name[64];
+  snprintf(name, sizeof(name), "mesh.class.%d.huge_pages", sizeClass);
+  size_t old = 0;
+  size_t oldLen = sizeof(old);
+  size_t enabled = 1;
+  ASSERT_EQ(gheap.mallctl(name, &old, &oldLen, &enabled, sizeof(enabled)), 0);
+  ASSERT_EQ(old, 0UL);
+
+  ASSERT_EQ(reinterpret_cast<uintptr_t>(gheap.arenaBegin()) % kHugePageSize, 0UL);
+  const auto regionCount = gheap.hugePageRegionCount();
+
+  FixedArray<MiniHeap, 1> array{};
+  gheap.allocSmallMiniheaps(sizeClass, StrLen, array, tid);
+  MiniHeap *mh = array[0];
+  ASSERT_TRUE(mh->isHugePage());
+  ASSERT_EQ(gheap.hugePageRegionCount(), regionCount + 1);
+  // the first span is carved from the start of a fresh region
+  ASSERT_EQ(mh->getSpanStart(gheap.arenaBegin()) % kHugePageSize, 0UL);
+
+  void *ptr = mh->mallocAt(gheap.arenaBegin(), 0);
+  gheap.releaseMiniheaps(array);
+
+  // a mostly-empty, detached span in a huge page region is still not
+  // offered for meshing
+  ASSERT_EQ(gheap.meshingCandidates(sizeClass).size(), 0UL);
+
+  gheap.free(ptr);
+  gheap.flushAllBins();
+  gheap.scavenge(true);
+
+  // the emptied region is given back to the arena
+  ASSERT_EQ(gheap.hugePageRegionCount(), regionCount);
+
+  enabled = 0;
+  ASSERT_EQ(gheap.mallctl(name, &old, &oldLen, &enabled, sizeof(enabled)), 0);
+  ASSERT_EQ(old, 1UL);
+}
+
+TEST(ArenaTest, DirtyDecay) {
+  GlobalHeap &gheap = runtime().heap();
+
+  gheap.scavenge(true);
+  ASSERT_EQ(gheap.dirtyPageCount(), 0UL);
+
+  size_t old = 0;
+  size_t oldLen = sizeof(old);
+  size_t decayMs = 1000;
+  ASSERT_EQ(gheap.mallctl("mesh.dirty_decay_ms", &old, &oldLen, &decayMs, sizeof(decayMs)), 0);
+  ASSERT_EQ(old, static_cast<size_t>(kDefaultDirtyDecay.count()));
+
+  static constexpr size_t PageCount = 64;
+  void *ptr = gheap.malloc(PageCount * kPageSize);
+  gheap.free(ptr);
+  const auto freed = time::now();
+  // freshly dirtied pages are kept for reuse
+  ASSERT_EQ(gheap.dirtyPageCount(), PageCount);
+
+  auto decay = [&](time::time_point now) {
+    gheap.lock();
+    gheap.decayDirty(now);
+    gheap.unlock();
+  };
+
+  // a quarter of the way through the decay period, some (but not
+  // all) of them have been purged
+  decay(freed + std::chrono::milliseconds{250});
+  ASSERT_GT(gheap.dirtyPageCount(), 0UL);
+  ASSERT_LT(gheap.dirtyPageCount(), PageCount);
+
+  // and once the period is over, all of them
+  decay(freed + std::chrono::milliseconds{1050});
+  ASSERT_EQ(gheap.dirtyPageCount(), 0UL);
+
+  // with no decay, a free purges its own pages straight away
+  decayMs = 0;
+  ASSERT_EQ(gheap.mallctl("mesh.dirty_decay_ms", &old, &oldLen, &decayMs, sizeof(decayMs)), 0);
+  ptr = gheap.malloc(PageCount * kPageSize);
+  gheap.free(ptr);
+  ASSERT_EQ(gheap.dirtyPageCount(), 0UL);
+
+  decayMs = kDefaultDirtyDecay.count();
+  ASSERT_EQ(gheap.mallctl("mesh.dirty_decay_ms", &old, &oldLen, &decayMs, sizeof(decayMs)), 0);
+}
+
+TEST(ArenaTest, BackgroundPurge) {
+  GlobalHeap &gheap = runtime().heap();
+
+  gheap.scavenge(true);
+  gheap.lock();
+  gheap.setBackgroundPurge(true);
+  gheap.unlock();
+
+  size_t old = 0;
+  size_t oldLen = sizeof(old);
+  size_t decayMs = 0;
+  ASSERT_EQ(gheap.mallctl("mesh.dirty_decay_ms", &old, &oldLen, &decayMs, sizeof(decayMs)), 0);
+
+  static constexpr size_t PageCount = 64;
+  void *ptr = gheap.malloc(PageCount * kPageSize);
+  gheap.free(ptr);
+
+  // the free only queued the pages for purging
+  ASSERT_EQ(gheap.dirtyPageCount(), 0UL);
+  ASSERT_EQ(gheap.purgeQueuePageCount(), PageCount);
+
+  ASSERT_TRUE(gheap.purgeQueuedSpan());
+  ASSERT_FALSE(gheap.purgeQueuedSpan());
+  ASSERT_EQ(gheap.purgeQueuePageCount(), 0UL);
+
+  // and the purged pages are reused like any clean ones
+  ptr = gheap.malloc(PageCount * kPageSize);
+  gheap.free(ptr);
+  ASSERT_TRUE(gheap.purgeQueuedSpan());
+
+  gheap.lock();
+  gheap.setBackgroundPurge(false);
+  gheap.unlock();
+  decayMs = kDefaultDirtyDecay.count();
+  ASSERT_EQ(gheap.mallctl("mesh.dirty_decay_ms", &old, &oldLen, &decayMs, sizeof(decayMs)), 0);
+}
+
+TEST(ArenaTest, CriticalSection) {
+  GlobalHeap &gheap = runtime().heap();
+
+  gheap.scavenge(true);
+
+  size_t old = 0;
+  size_t oldLen = sizeof(old);
+  size_t decayMs = 0;
+  ASSERT_EQ(gheap.mallctl("mesh.dirty_decay_ms", &old, &oldLen, &decayMs, sizeof(decayMs)), 0);
+
+  static constexpr size_t PageCount = 64;
+  static constexpr size_t SmallPageCount = 8;
+  void *ptr1 = gheap.malloc(PageCount * kPageSize);
+  void *ptr2 = gheap.malloc(SmallPageCount * kPageSize);
+  void *ptr3 = gheap.malloc(SmallPageCount * kPageSize);
+
+  // however deep inside, frees leave their pages dirty
+  GlobalHeap::enterCritical();
+  GlobalHeap::enterCritical();
+  gheap.free(ptr1);
+  ASSERT_EQ(gheap.dirtyPageCount(), PageCount);
+  GlobalHeap::exitCritical();
+  gheap.free(ptr2);
+  ASSERT_EQ(gheap.dirtyPageCount(), PageCount + SmallPageCount);
+  GlobalHeap::exitCritical();
+
+  // until the next free outside of one
+  gheap.free(ptr3);
+  ASSERT_EQ(gheap.dirtyPageCount(), 0UL);
+
+  // with a purger thread, the work is handed to it
+  gheap.lock();
+  gheap.setBackgroundPurge(true);
+  gheap.unlock();
+
+  ptr1 = gheap.malloc(PageCount * kPageSize);
+  GlobalHeap::enterCritical();
+  gheap.free(ptr1);
+  ASSERT_EQ(gheap.dirtyPageCount(), PageCount);
+  ASSERT_EQ(gheap.purgeQueuePageCount(), 0UL);
+
+  ASSERT_TRUE(gheap.takeDeferredWork());
+  ASSERT_FALSE(gheap.takeDeferredWork());
+  std::thread purger([&]() { gheap.runDeferredWork(); });
+  purger.join();
+  GlobalHeap::exitCritical();
+
+  ASSERT_EQ(gheap.dirtyPageCount(), 0UL);
+  ASSERT_EQ(gheap.purgeQueuePageCount(), PageCount);
+  while (gheap.purgeQueuedSpan()) {
+  }
+
+  gheap.lock();
+  gheap.setBackgroundPurge(false);
+  gheap.unlock();
+  decayMs = kDefaultDirtyDecay.count();
+  ASSERT_EQ(gheap.mallctl("mesh.dirty_decay_ms", &old, &oldLen, &decayMs, sizeof(decayMs)), 0);
+}
+
+TEST(ArenaTest, RangeEntries) {
+  GlobalHeap &gheap = runtime().heap();
+
+  static constexpr size_t PageCount = 4 * kMinRangeSpanPages;
+  char *ptr = reinterpret_cast<char *>(gheap.malloc(PageCount * kPageSize));
+  ASSERT_NE(ptr, nullptr);
+
+  // every page of the span maps to its miniheap, not just the first
+  MiniHeap *mh = gheap.miniheapFor(ptr);
+  ASSERT_NE(mh, nullptr);
+  ASSERT_EQ(gheap.miniheapFor(ptr + kPageSize), mh);
+  ASSERT_EQ(gheap.miniheapFor(ptr + (PageCount / 2) * kPageSize + 17), mh);
+  ASSERT_EQ(gheap.miniheapFor(ptr + PageCount * kPageSize - 1), mh);
+  ASSERT_TRUE(gheap.isTracked(ptr + (PageCount - 1) * kPageSize));
+  ASSERT_EQ(gheap.getSize(ptr + 3 * kPageSize), PageCount * kPageSize);
+
+  gheap.free(ptr);
+
+  ASSERT_FALSE(gheap.isTracked(ptr));
+  ASSERT_FALSE(gheap.isTracked(ptr + (PageCount / 2) * kPageSize));
+
+  // long enough for entries at the first two range levels, plus
+  // pages of its own at either end
+  static constexpr size_t BigPageCount = 3 * 4096 + 100;
+  char *big = reinterpret_cast<char *>(gheap.malloc(BigPageCount * kPageSize));
+  ASSERT_NE(big, nullptr);
+  mh = gheap.miniheapFor(big);
+  ASSERT_NE(mh, nullptr);
+  for (size_t i = 0; i < BigPageCount; i++) {
+    ASSERT_EQ(gheap.miniheapFor(big + i * kPageSize), mh);
+  }
+
+  gheap.free(big);
+  for (size_t i = 0; i < BigPageCount; i++) {
+    ASSERT_FALSE(gheap.isTracked(big + i * kPageSize));
+  }
+}
+
+TEST(ArenaTest, Prefault) {
+  GlobalHeap &gheap = runtime().heap();
+
+  static constexpr size_t PageCount = 64;
+
+  size_t old = 0;
+  size_t oldLen = sizeof(old);
+  size_t threshold = PageCount * kPageSize;
+  ASSERT_EQ(gheap.mallctl("mesh.prefault_threshold", &old, &oldLen, &threshold, sizeof(threshold)), 0);
+  ASSERT_EQ(old, 0UL);
+
+  // only clean pages are prefaulted
+  gheap.scavenge(true);
+  size_t before = 0;
+  ASSERT_EQ(gheap.mallctl("stats.prefaulted", &before, &oldLen, nullptr, 0), 0);
+
+  // below the threshold
+  void *small = gheap.malloc(PageCount / 2 * kPageSize);
+  size_t after = 0;
+  ASSERT_EQ(gheap.mallctl("stats.prefaulted", &after, &oldLen, nullptr, 0), 0);
+  ASSERT_EQ(after, before);
+
+  void *ptr = gheap.malloc(PageCount * kPageSize);
+  ASSERT_EQ(gheap.mallctl("stats.prefaulted", &after, &oldLen, nullptr, 0), 0);
+  ASSERT_EQ(after, before + PageCount * kPageSize);
+
+  // the pages are in memory before they are touched
+  unsigned char resident[PageCount];
+  ASSERT_EQ(mincore(ptr, PageCount * kPageSize, resident), 0);
+  for (size_t i = 0; i < PageCount; i++) {
+    ASSERT_TRUE(resident[i] & 1);
+  }
+
+  gheap.free(ptr);
+  gheap.free(small);
+
+  threshold = 0;
+  ASSERT_EQ(gheap.mallctl("mesh.prefault_threshold", &old, &oldLen, &threshold, sizeof(threshold)), 0);
+}
+
+TEST(ArenaTest, PartialPagePurge) {
+  const auto tid = gettid();
+  GlobalHeap &gheap = runtime().heap();
+
+  // 8 objects on 4 pages
+  static constexpr size_t ObjectSize = 2048;
+  static constexpr size_t PageCount = 4;
+  const auto sizeClass = SizeMap::SizeClass(ObjectSize);
+
+  FixedArray<MiniHeap, 1> array{};
+  gheap.allocSmallMiniheaps(sizeClass, ObjectSize, array, tid);
+  MiniHeap *mh = array[0];
+  ASSERT_EQ(mh->span().length, PageCount);
+
+  char *objects[8];
+  for (size_t i = 0; i < 8; i++) {
+    objects[i] = reinterpret_cast<char *>(mh->mallocAt(gheap.arenaBegin(), i));
+    ASSERT_NE(objects[i], nullptr);
+    memset(objects[i], 'a' + i, ObjectSize);
+  }
+  gheap.releaseMiniheaps(array);
+
+  size_t before = 0;
+  size_t len = sizeof(before);
+  ASSERT_EQ(gheap.mallctl("stats.partial_purged", &before, &len, nullptr, 0), 0);
+
+  // the middle two pages end up with no live objects
+  for (size_t i = 2; i < 6; i++) {
+    gheap.free(objects[i]);
+  }
+  // and a page with one live object isn't purged
+  gheap.free(objects[7]);
+  gheap.scavenge(true);
+
+  size_t after = 0;
+  ASSERT_EQ(gheap.mallctl("stats.partial_purged", &after, &len, nullptr, 0), 0);
+  ASSERT_EQ(after, before + 2 * kPageSize);
+
+  const auto spanStart = reinterpret_cast<void *>(mh->getSpanStart(gheap.arenaBegin()));
+  unsigned char resident[PageCount];
+  ASSERT_EQ(mincore(spanStart, PageCount * kPageSize, resident), 0);
+  ASSERT_TRUE(resident[0] & 1);
+  ASSERT_FALSE(resident[1] & 1);
+  ASSERT_FALSE(resident[2] & 1);
+  ASSERT_TRUE(resident[3] & 1);
+
+  ASSERT_EQ(objects[0][ObjectSize - 1], 'a');
+  ASSERT_EQ(objects[6][0], 'g');
+
+  // purging again is a no-op
+  gheap.scavenge(true);
+  ASSERT_EQ(gheap.mallctl("stats.partial_purged", &after, &len, nullptr, 0), 0);
+  ASSERT_EQ(after, before + 2 * kPageSize);
+
+  // when the MiniHeap is reused for a refill, the purged pages are
+  // faulted back in like clean ones
+  size_t old = 0;
+  size_t prefault = 1;
+  ASSERT_EQ(gheap.mallctl("mesh.prefault", &old, &len, &prefault, sizeof(prefault)), 0);
+  ASSERT_EQ(gheap.mallctl("stats.prefaulted", &before, &len, nullptr, 0), 0);
+  gheap.allocSmallMiniheaps(sizeClass, ObjectSize, array, tid);
+  ASSERT_EQ(array[0], mh);
+  ASSERT_EQ(gheap.mallctl("stats.prefaulted", &after, &len, nullptr, 0), 0);
+  ASSERT_EQ(after, before + 2 * kPageSize);
+  ASSERT_EQ(mincore(spanStart, PageCount * kPageSize, resident), 0);
+  ASSERT_TRUE(resident[1] & 1);
+  ASSERT_TRUE(resident[2] & 1);
+  ASSERT_EQ(objects[2][0], 0);
+  ASSERT_EQ(objects[5][ObjectSize - 1], 0);
+
+  prefault = 0;
+  ASSERT_EQ(gheap.mallctl("mesh.prefault", &old, &len, &prefault, sizeof(prefault)), 0);
+  gheap.releaseMiniheaps(array);
+  gheap.free(objects[0]);
+  gheap.free(objects[1]);
+  gheap.free(objects[6]);
+  gheap.flushAllBins();
+}
+
+TEST(ArenaTest, LazyForkCopy) {
+  mesh::real::init();
+  runtime().installSegfaultHandler();
+  GlobalHeap &gheap = runtime().heap();
+
+  auto ptr = reinterpret_cast<volatile char *>(gheap.malloc(64 * kPageSize));
+  ptr[0] = 'a';
+
+  // a child that exits without using the heap never copies it
+  pid_t pid = fork();
+  if (pid == 0) {
+    _exit(gheap.forkCopyPending() ? 0 : 1);
+  }
+  int status = 0;
+  ASSERT_EQ(waitpid(pid, &status, 0), pid);
+  ASSERT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+  // one that takes longer than we wait for it still sees the heap as
+  // it was at the fork, even once we have changed it
+  pid = fork();
+  if (pid == 0) {
+    usleep(std::chrono::microseconds(5 * kForkChildCopyWait).count());
+    bool ok = ptr[0] == 'a';
+    ptr[0] = 'c';
+    ok = ok && ptr[0] == 'c' && !gheap.forkCopyPending();
+    _exit(ok ? 0 : 1);
+  }
+  ptr[0] = 'b';
+  ASSERT_EQ(waitpid(pid, &status, 0), pid);
+  ASSERT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  ASSERT_EQ(ptr[0], 'b');
+
+  // and one that writes to the heap right away has us move off its
+  // files without waiting
+  pid = fork();
+  if (pid == 0) {
+    ptr[0] = 'd';
+    _exit(ptr[0] == 'd' && !gheap.forkCopyPending() ? 0 : 1);
+  }
+  ASSERT_EQ(waitpid(pid, &status, 0), pid);
+  ASSERT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  ASSERT_EQ(ptr[0], 'b');
+
+  gheap.free(const_cast<char *>(ptr));
+}
+
+TEST(ArenaTest, ForkChildWait) {
+  mesh::real::init();
+  runtime().installSegfaultHandler();
+  GlobalHeap &gheap = runtime().heap();
+
+  auto ptr = reinterpret_cast<volatile char *>(gheap.malloc(64 * kPageSize));
+  ptr[0] = 'a';
+
+  // fork a child that outlives the wait, returning how long the fork
+  // took the parent
+  auto timeFork = [&](size_t waitMs) {
+    size_t old = 0;
+    size_t oldLen = sizeof(old);
+    gheap.mallctl("mesh.fork_child_wait_ms", &old, &oldLen, &waitMs, sizeof(waitMs));
+
+    const auto start = time::now();
+    const pid_t pid = fork();
+    if (pid == 0) {
+      usleep(std::chrono::microseconds(40 * kForkChildCopyWait).count());
+      _exit(ptr[0] == 'a' ? 0 : 1);
+    }
+    const auto elapsed = time::now() - start;
+    ptr[0] = 'b';
+
+    int status = 0;
+    EXPECT_EQ(waitpid(pid, &status, 0), pid);
+    EXPECT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    ptr[0] = 'a';
+    return elapsed;
+  };
+
+  // both move the heap once the wait is over
+  static constexpr auto kLongWait = 25 * kForkChildCopyWait;
+  const auto waited = timeFork(kLongWait.count());
+  const auto unwaited = timeFork(0);
+  EXPECT_GE(waited, kLongWait);
+  EXPECT_LT(unwaited + kLongWait / 2, waited);
+
+  size_t old = 0;
+  size_t oldLen = sizeof(old);
+  size_t waitMs = kForkChildCopyWait.count();
+  ASSERT_EQ(gheap.mallctl("mesh.fork_child_wait_ms", &old, &oldLen, &waitMs, sizeof(waitMs)), 0);
+  ASSERT_EQ(old, 0UL);
+
+  gheap.free(const_cast<char *>(ptr));
+}
+
+TEST(ArenaTest, ForkMoveWhileWriting) {
+  mesh::real::init();
+  runtime().installSegfaultHandler();
+  GlobalHeap &gheap = runtime().heap();
+
+  // spread over several of the chunks the parent moves separately
+  static constexpr size_t kSpanCount = 64;
+  static constexpr size_t kSpanPages = 64;
+  volatile char *spans[kSpanCount];
+  for (size_t i = 0; i < kSpanCount; i++) {
+    spans[i] = reinterpret_cast<volatile char *>(gheap.malloc(kSpanPages * kPageSize));
+    spans[i][0] = 'a';
+    spans[i][kPageSize] = 'a';
+  }
+
+  // a thread that keeps writing to the heap through the fork, and
+  // then some
+  std::atomic<char> value{'b'};
+  std::atomic<size_t> passes{0};
+  std::atomic<bool> done{false};
+  std::thread writer([&]() {
+    while (!done) {
+      for (size_t i = 0; i < kSpanCount; i++) {
+        spans[i][0] = value;
+      }
+      passes++;
+    }
+  });
+
+  const pid_t pid = fork();
+  if (pid == 0) {
+    // none of its writes since the fork show up here
+    char seen[kSpanCount];
+    for (size_t i = 0; i < kSpanCount; i++) {
+      seen[i] = spans[i][0];
+    }
+    usleep(std::chrono::microseconds(5 * kForkChildCopyWait).count());
+    bool ok = true;
+    for (size_t i = 0; i < kSpanCount; i++) {
+      ok = ok && (seen[i] == 'a' || seen[i] == 'b') && spans[i][0] == seen[i] && spans[i][kPageSize] == 'a';
+    }
+    _exit(ok ? 0 : 1);
+  }
+  ASSERT_GT(pid, 0);
+
+  value = 'c';
+  const size_t passesBefore = passes;
+  int status = 0;
+  ASSERT_EQ(waitpid(pid, &status, 0), pid);
+  while (passes < passesBefore + 2) {
+    sched_yield();
+  }
+  done = true;
+  writer.join();
+  ASSERT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  ASSERT_FALSE(gheap.forkInProgress());
+
+  for (size_t i = 0; i < kSpanCount; i++) {
+    ASSERT_EQ(spans[i][0], 'c');
+    ASSERT_EQ(spans[i][kPageSize], 'a');
+    gheap.free(const_cast<char *>(spans[i]));
+  }
+}
+
+TEST(ArenaTest, ForkMoveGrowsArena) {
+  mesh::real::init();
+  runtime().installSegfaultHandler();
+  GlobalHeap &gheap = runtime().heap();
+
+  // whatever is on fd 0 (opening /dev/null there if nothing is) is
+  // still there once the fork is over
+  struct stat before {};
+  if (fstat(STDIN_FILENO, &before) != 0) {
+    ASSERT_EQ(open("/dev/null", O_RDONLY), STDIN_FILENO);
+    ASSERT_EQ(fstat(STDIN_FILENO, &before), 0);
+  }
+
+  // moved by several threads, started here rather than in the fork
+  gheap.setForkCopyThreads(4);
+
+  // enough of a heap that the parent is still moving it when the
+  // thread below gets the lock
+  static constexpr size_t kSpanCount = 64;
+  static constexpr size_t kSpanSize = 4 * 1024 * 1024;
+  void *spans[kSpanCount];
+  for (size_t i = 0; i < kSpanCount; i++) {
+    spans[i] = gheap.malloc(kSpanSize);
+    memset(spans[i], 'a', kSpanSize);
+  }
+
+  // grows the arena by at least a shard once the fork unlocks the heap
+  static constexpr size_t kMaxGrowCount = 32;
+  void *grown[kMaxGrowCount]{};
+  std::atomic<bool> forking{false};
+  std::atomic<bool> forked{false};
+  const size_t shardsBefore = gheap.shardCount();
+  std::thread grower([&]() {
+    while (!forked && (!forking || !gheap.forkInProgress())) {
+      sched_yield();
+    }
+    for (size_t i = 0; i < kMaxGrowCount && gheap.shardCount() <= shardsBefore; i++) {
+      grown[i] = gheap.malloc(kArenaShardSize);
+    }
+  });
+
+  forking = true;
+  const pid_t pid = fork();
+  if (pid == 0) {
+    usleep(std::chrono::microseconds(5 * kForkChildCopyWait).count());
+    _exit(0);
+  }
+  ASSERT_GT(pid, 0);
+  forked = true;
+  grower.join();
+
+  int status = 0;
+  ASSERT_EQ(waitpid(pid, &status, 0), pid);
+  ASSERT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  ASSERT_GT(gheap.shardCount(), shardsBefore);
+
+  struct stat after {};
+  ASSERT_EQ(fstat(STDIN_FILENO, &after), 0);
+  ASSERT_EQ(after.st_dev, before.st_dev);
+  ASSERT_EQ(after.st_ino, before.st_ino);
+
+  for (size_t i = 0; i < kMaxGrowCount; i++) {
+    if (grown[i] != nullptr) {
+      gheap.free(grown[i]);
+    }
+  }
+  for (size_t i = 0; i < kSpanCount; i++) {
+    ASSERT_EQ(reinterpret_cast<char *>(spans[i])[kSpanSize - 1], 'a');
+    gheap.free(spans[i]);
+  }
+  gheap.setForkCopyThreads(1);
+}
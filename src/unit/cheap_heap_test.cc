@@ -0,0 +1,65 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2019 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+#include <stdint.h>
+#include <string.h>
+
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "internal.h"
+
+#include "cheap_heap.h"
+
+using namespace mesh;
+
+TEST(CheapHeapTest, CommitsAsItFills) {
+  static constexpr size_t ObjectSize = 64;
+  static constexpr size_t MaxCount = 1024 * 1024;
+  static CheapHeap<ObjectSize, MaxCount> heap{};
+
+  // several commit chunks' worth, each object written all the way
+  // through
+  static constexpr size_t Count = 3 * kCheapHeapCommitSize / ObjectSize + 5;
+  std::vector<void *> ptrs{};
+  for (size_t i = 0; i < Count; i++) {
+    auto ptr = heap.alloc();
+    ASSERT_NE(ptr, nullptr);
+    memset(ptr, static_cast<int>(i), ObjectSize);
+    ptrs.push_back(ptr);
+  }
+  for (size_t i = 0; i < Count; i++) {
+    ASSERT_EQ(reinterpret_cast<uint8_t *>(ptrs[i])[ObjectSize - 1], static_cast<uint8_t>(i));
+  }
+
+  // every object fits on the freelist, and is handed out again
+  for (auto ptr : ptrs) {
+    heap.free(ptr);
+  }
+  for (size_t i = 0; i < Count; i++) {
+    auto ptr = heap.alloc();
+    ASSERT_GE(ptr, heap.arenaBegin());
+    ASSERT_LE(ptr, ptrs.back());
+  }
+}
+
+TEST(CheapHeapTest, PartitionedHeapCommitsAsItFills) {
+  static PartitionedHeap heap{};
+
+  static constexpr size_t ObjectSize = 16;
+  static constexpr size_t Count = 2 * kCheapHeapCommitSize / ObjectSize + 5;
+  std::vector<void *> ptrs{};
+  for (size_t i = 0; i < Count; i++) {
+    auto ptr = heap.malloc(ObjectSize);
+    ASSERT_TRUE(heap.contains(ptr));
+    memset(ptr, static_cast<int>(i), ObjectSize);
+    ptrs.push_back(ptr);
+  }
+  for (size_t i = 0; i < Count; i++) {
+    ASSERT_EQ(reinterpret_cast<uint8_t *>(ptrs[i])[0], static_cast<uint8_t>(i));
+    heap.free(ptrs[i]);
+  }
+}
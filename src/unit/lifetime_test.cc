@@ -0,0 +1,180 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2019 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+#include <stdlib.h>
+
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "internal.h"
+#include "lifetime_classifier.h"
+#include "plasma/mesh.h"
+#include "runtime.h"
+#include "thread_local_heap.h"
+
+using namespace mesh;
+
+static constexpr uint32_t StrLen = 128;
+
+TEST(LifetimeTest, Classifier) {
+  LifetimeClassifier classifier{};
+
+  const auto site = LifetimeClassifier::siteFor(reinterpret_cast<void *>(0x401234));
+  ASSERT_LT(site, 1UL << kLifetimeSiteBits);
+  ASSERT_EQ(classifier.groupFor(site), LifetimeGroup::Default);
+
+  for (size_t i = 0; i < 64; i++)
+    classifier.record(site, 10 * kLongLivedLifetime.count());
+  ASSERT_EQ(classifier.groupFor(site), LifetimeGroup::LongLived);
+
+  for (size_t i = 0; i < 64; i++)
+    classifier.record(site, 0);
+  ASSERT_EQ(classifier.groupFor(site), LifetimeGroup::Default);
+
+  // a new site's first sample classifies it on its own
+  const auto other = LifetimeClassifier::siteFor(reinterpret_cast<void *>(0x405678));
+  ASSERT_NE(other, site);
+  classifier.record(other, 2 * kLongLivedLifetime.count());
+  ASSERT_EQ(classifier.groupFor(other), LifetimeGroup::LongLived);
+}
+
+TEST(LifetimeTest, SeparateTrackers) {
+  const auto tid = gettid();
+  GlobalHeap &gheap = runtime().heap();
+
+  gheap.setMeshPeriodMs(kZeroMs);
+  ASSERT_EQ(gheap.getAllocatedMiniheapCount(), 0UL);
+
+  const auto sizeClass = SizeMap::SizeClass(StrLen);
+  FixedArray<MiniHeap, 1> array{};
+
+  gheap.allocSmallMiniheaps(sizeClass, StrLen, array, tid, LifetimeGroup::LongLived);
+  MiniHeap *longLived = array[0];
+  ASSERT_EQ(longLived->lifetimeGroup(), LifetimeGroup::LongLived);
+
+  void *ptr = longLived->mallocAt(gheap.arenaBegin(), 0);
+  gheap.releaseMiniheaps(array);
+
+  // a partially-full long-lived span is never reused for the default
+  // group, nor offered as a default-group meshing candidate
+  gheap.allocSmallMiniheaps(sizeClass, StrLen, array, tid);
+  MiniHeap *other = array[0];
+  array.clear();
+  ASSERT_NE(other, longLived);
+  ASSERT_EQ(other->lifetimeGroup(), LifetimeGroup::Default);
+  ASSERT_EQ(gheap.meshingCandidates(sizeClass, LifetimeGroup::Default).size(), 0UL);
+  ASSERT_EQ(gheap.meshingCandidates(sizeClass, LifetimeGroup::LongLived).size(), 1UL);
+
+  other->unsetAttached();
+  gheap.freeMiniheap(other);
+  gheap.free(ptr);
+  gheap.flushAllBins();
+  gheap.scavenge(true);
+
+  ASSERT_EQ(gheap.getAllocatedMiniheapCount(), 0UL);
+}
+
+TEST(LifetimeTest, GroupMalloc) {
+  GlobalHeap &gheap = runtime().heap();
+  auto heap = ThreadLocalHeap::GetHeap();
+
+  void *shortLived = heap->groupMalloc(StrLen, LifetimeGroup::ShortLived);
+  void *longLived = heap->groupMalloc(StrLen, LifetimeGroup::LongLived);
+  void *other = heap->malloc(StrLen);
+
+  MiniHeap *shortMH = gheap.miniheapFor(shortLived);
+  MiniHeap *longMH = gheap.miniheapFor(longLived);
+  MiniHeap *otherMH = gheap.miniheapFor(other);
+  ASSERT_EQ(shortMH->lifetimeGroup(), LifetimeGroup::ShortLived);
+  ASSERT_EQ(longMH->lifetimeGroup(), LifetimeGroup::LongLived);
+  ASSERT_EQ(otherMH->lifetimeGroup(), LifetimeGroup::Default);
+  ASSERT_NE(shortMH, longMH);
+  ASSERT_NE(shortMH, otherMH);
+
+  ASSERT_EQ(heap->getSize(shortLived), StrLen);
+
+  heap->free(shortLived);
+  heap->free(longLived);
+  heap->free(other);
+
+  heap->releaseAll();
+  gheap.flushAllBins();
+}
+
+TEST(LifetimeTest, CompactMalloc) {
+  GlobalHeap &gheap = runtime().heap();
+  auto heap = ThreadLocalHeap::GetHeap();
+
+  static constexpr size_t LargeSize = 64 * kPageSize;
+  void *small = heap->groupMalloc(StrLen, LifetimeGroup::Compact);
+  void *large = heap->groupMalloc(LargeSize, LifetimeGroup::Compact);
+  ASSERT_NE(small, nullptr);
+  ASSERT_NE(large, nullptr);
+
+  MiniHeap *smallMH = gheap.miniheapFor(small);
+  MiniHeap *largeMH = gheap.miniheapFor(large);
+  ASSERT_EQ(smallMH->lifetimeGroup(), LifetimeGroup::Compact);
+  ASSERT_EQ(largeMH->lifetimeGroup(), LifetimeGroup::Compact);
+
+  // both spans lie in the window, past its first page
+  for (auto mh : {smallMH, largeMH}) {
+    const auto span = mh->span();
+    ASSERT_GE(span.offset, 1UL);
+    ASSERT_LE(span.offset + span.length, kCompactArenaPages);
+  }
+
+  const void *base = gheap.arenaBegin();
+  for (auto ptr : {small, large}) {
+    const uint32_t off = mesh_compact_encode(base, ptr);
+    ASSERT_NE(off, 0U);
+    ASSERT_EQ(mesh_compact_decode(base, off), ptr);
+  }
+
+  heap->free(small);
+  heap->free(large);
+
+  heap->releaseAll();
+  gheap.flushAllBins();
+}
+
+TEST(LifetimeTest, CompactWindowSpared) {
+  GlobalHeap &gheap = runtime().heap();
+  char *const windowEnd = reinterpret_cast<char *>(gheap.arenaBegin()) + kCompactArenaSize;
+
+  // fill the window with ordinary spans (address space only: the
+  // pages are never touched) until the arena extends past it
+  static constexpr size_t ChunkSize = 1024UL * 1024 * 1024;
+  std::vector<char *> ptrs{};
+  while (ptrs.empty() || ptrs.back() < windowEnd) {
+    auto ptr = reinterpret_cast<char *>(gheap.malloc(ChunkSize));
+    ASSERT_NE(ptr, nullptr);
+    ptrs.push_back(ptr);
+  }
+
+  // a span freed inside the window isn't reused by ordinary
+  // allocations, but is there for compact ones
+  char *inWindow = ptrs.front();
+  ASSERT_LT(inWindow, windowEnd);
+  gheap.free(inWindow);
+  ptrs.erase(ptrs.begin());
+  // it is over the dirty page limit, so partly purged: put it back
+  // together in the clean list
+  gheap.scavenge(true);
+
+  auto ordinary = reinterpret_cast<char *>(gheap.malloc(ChunkSize));
+  ASSERT_GE(ordinary, windowEnd);
+  ptrs.push_back(ordinary);
+
+  auto compact = reinterpret_cast<char *>(gheap.malloc(ChunkSize, LifetimeGroup::Compact));
+  ASSERT_NE(compact, nullptr);
+  ASSERT_LT(compact, windowEnd);
+  ptrs.push_back(compact);
+
+  for (auto ptr : ptrs) {
+    gheap.free(ptr);
+  }
+  gheap.scavenge(true);
+}
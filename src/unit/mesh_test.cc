@@ -116,6 +116,10 @@ static void meshTest(bool invert) {
 
   ASSERT_EQ(mh1->meshCount(), 2ULL);
 
+  // offsets of objects in the meshed span resolve through the arena
+  ASSERT_EQ(gheap.spanStartFor(s2), reinterpret_cast<uintptr_t>(s2) - (ObjCount - 1) * StrLen);
+  ASSERT_EQ(mh1->getOff(gheap.arenaBegin(), s2), ObjCount - 1);
+
   // now free the objects by going through the global heap -- it
   // should redirect both objects to the same miniheap
   gheap.free(s1);
@@ -141,3 +145,182 @@ TEST(MeshTest, TryMesh) {
 TEST(MeshTest, TryMeshInverse) {
   meshTest(true);
 }
+
+TEST(MeshTest, ClassPolicy) {
+  if (!kMeshingEnabled) {
+    GTEST_SKIP();
+  }
+
+  const auto tid = gettid();
+  GlobalHeap &gheap = runtime().heap();
+  const int sizeClass = SizeMap::SizeClass(StrLen);
+
+  // disable automatic meshing for this test
+  gheap.setMeshPeriodMs(kZeroMs);
+
+  ASSERT_EQ(gheap.getAllocatedMiniheapCount(), 0UL);
+
+  char name[64];
+  size_t val = 0;
+  size_t len = sizeof(val);
+  snprintf(name, sizeof(name), "mesh.class.%d.size", sizeClass);
+  ASSERT_EQ(gheap.mallctl(name, &val, &len, nullptr, 0), 0);
+  ASSERT_EQ(val, StrLen);
+
+  double cutoff = 0;
+  double newCutoff = .5;
+  snprintf(name, sizeof(name), "mesh.class.%d.occupancy_cutoff", sizeClass);
+  ASSERT_EQ(gheap.mallctl(name, &cutoff, &len, &newCutoff, sizeof(newCutoff)), 0);
+  ASSERT_EQ(cutoff, kOccupancyCutoff);
+  ASSERT_EQ(gheap.mallctl(name, &cutoff, &len, nullptr, 0), 0);
+  ASSERT_EQ(cutoff, newCutoff);
+  newCutoff = 2;
+  ASSERT_EQ(gheap.mallctl(name, &cutoff, &len, &newCutoff, sizeof(newCutoff)), -1);
+  newCutoff = kOccupancyCutoff;
+  ASSERT_EQ(gheap.mallctl(name, &cutoff, &len, &newCutoff, sizeof(newCutoff)), 0);
+
+  ASSERT_EQ(gheap.mallctl("mesh.class.25.enabled", &val, &len, nullptr, 0), -1);
+  ASSERT_EQ(gheap.mallctl("mesh.class.x.enabled", &val, &len, nullptr, 0), -1);
+
+  FixedArray<MiniHeap, 1> array{};
+
+  gheap.allocSmallMiniheaps(sizeClass, StrLen, array, tid);
+  MiniHeap *mh1 = array[0];
+  array.clear();
+
+  gheap.allocSmallMiniheaps(sizeClass, StrLen, array, tid);
+  MiniHeap *mh2 = array[0];
+  array.clear();
+
+  char *s1 = reinterpret_cast<char *>(mh1->mallocAt(gheap.arenaBegin(), 0));
+  char *s2 = reinterpret_cast<char *>(mh2->mallocAt(gheap.arenaBegin(), ObjCount - 1));
+
+  // detach both miniheaps so they become meshing candidates
+  {
+    const auto f1 = reinterpret_cast<char *>(mh1->mallocAt(gheap.arenaBegin(), 2));
+    const auto f2 = reinterpret_cast<char *>(mh2->mallocAt(gheap.arenaBegin(), 2));
+
+    mh1->unsetAttached();
+    mh2->unsetAttached();
+
+    gheap.free(f1);
+    gheap.free(f2);
+  }
+
+  size_t enabled = 0;
+  snprintf(name, sizeof(name), "mesh.class.%d.enabled", sizeClass);
+  ASSERT_EQ(gheap.mallctl(name, &val, &len, &enabled, sizeof(enabled)), 0);
+  ASSERT_EQ(val, 1UL);
+
+  size_t meshes = 0;
+  char statName[64];
+  snprintf(statName, sizeof(statName), "stats.class.%d.meshes", sizeClass);
+  ASSERT_EQ(gheap.mallctl(statName, &meshes, &len, nullptr, 0), 0);
+
+  // a disabled class is never meshed
+  ASSERT_EQ(gheap.mallctl("mesh.compact", &val, &len, nullptr, 0), 0);
+  ASSERT_EQ(gheap.getAllocatedMiniheapCount(), 2UL);
+  ASSERT_EQ(gheap.mallctl(statName, &val, &len, nullptr, 0), 0);
+  ASSERT_EQ(val, meshes);
+
+  enabled = 1;
+  ASSERT_EQ(gheap.mallctl(name, &val, &len, &enabled, sizeof(enabled)), 0);
+  ASSERT_EQ(val, 0UL);
+
+  // ensure the next compaction isn't skipped as ineffective
+  gheap.free(mh1->mallocAt(gheap.arenaBegin(), 3));
+
+  ASSERT_EQ(gheap.mallctl("mesh.compact", &val, &len, nullptr, 0), 0);
+  ASSERT_EQ(gheap.mallctl(statName, &val, &len, nullptr, 0), 0);
+  ASSERT_EQ(val, meshes + 1);
+
+  MiniHeap *mh = gheap.miniheapFor(s1);
+  ASSERT_EQ(mh, gheap.miniheapFor(s2));
+  ASSERT_EQ(mh->meshCount(), 2ULL);
+
+  gheap.free(s1);
+  gheap.free(s2);
+  ASSERT_TRUE(mh->isEmpty());
+
+  gheap.freeMiniheap(mh);
+  gheap.scavenge(true);
+
+  ASSERT_EQ(gheap.getAllocatedMiniheapCount(), 0UL);
+}
+
+TEST(MeshTest, StalePlanRevalidated) {
+  if (!kMeshingEnabled) {
+    GTEST_SKIP();
+  }
+
+  const auto tid = gettid();
+  GlobalHeap &gheap = runtime().heap();
+  const int sizeClass = SizeMap::SizeClass(StrLen);
+
+  // disable automatic meshing for this test
+  gheap.setMeshPeriodMs(kZeroMs);
+
+  ASSERT_EQ(gheap.getAllocatedMiniheapCount(), 0UL);
+
+  FixedArray<MiniHeap, 1> array{};
+
+  gheap.allocSmallMiniheaps(sizeClass, StrLen, array, tid);
+  MiniHeap *mh1 = array[0];
+  array.clear();
+
+  gheap.allocSmallMiniheaps(sizeClass, StrLen, array, tid);
+  MiniHeap *mh2 = array[0];
+  array.clear();
+
+  char *s1 = reinterpret_cast<char *>(mh1->mallocAt(gheap.arenaBegin(), 0));
+  char *s2 = reinterpret_cast<char *>(mh2->mallocAt(gheap.arenaBegin(), ObjCount - 1));
+
+  // detach both miniheaps so they become meshing candidates
+  {
+    const auto f1 = reinterpret_cast<char *>(mh1->mallocAt(gheap.arenaBegin(), 2));
+    const auto f2 = reinterpret_cast<char *>(mh2->mallocAt(gheap.arenaBegin(), 2));
+
+    mh1->unsetAttached();
+    mh2->unsetAttached();
+
+    gheap.free(f1);
+    gheap.free(f2);
+  }
+
+  MWC prng(internal::seed(), internal::seed());
+  const MeshPolicy policy{};
+  internal::vector<MeshCandidate> candidates{};
+
+  gheap.lock();
+  const size_t count =
+      method::snapshotCandidates(prng, gheap.trackerFor(LifetimeGroup::Default, sizeClass), policy, candidates);
+  gheap.unlock();
+  ASSERT_EQ(count, 2UL);
+
+  // an allocation between the snapshot and the commit makes the
+  // bitmaps overlap, which the search can't see
+  char *s3 = reinterpret_cast<char *>(mh2->mallocAt(gheap.arenaBegin(), 0));
+
+  internal::vector<std::pair<MiniHeap *, MiniHeap *>> found{};
+  auto meshFound = function<void(std::pair<MiniHeap *, MiniHeap *> &&)>(
+      [&](std::pair<MiniHeap *, MiniHeap *> &&miniheaps) { found.push_back(std::move(miniheaps)); });
+  ASSERT_EQ(method::shiftedSplitting(candidates.data(), count, policy, meshFound), 1UL);
+  ASSERT_EQ(found.size(), 1UL);
+
+  gheap.lock();
+  ASSERT_FALSE(gheap.stillMeshableLocked(found[0].first, found[0].second));
+  gheap.unlock();
+
+  gheap.free(s3);
+
+  gheap.lock();
+  ASSERT_TRUE(gheap.stillMeshableLocked(found[0].first, found[0].second));
+  gheap.unlock();
+
+  gheap.free(s1);
+  gheap.free(s2);
+  gheap.flushAllBins();
+  gheap.scavenge(true);
+
+  ASSERT_EQ(gheap.getAllocatedMiniheapCount(), 0UL);
+}
@@ -0,0 +1,41 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2019 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+#include <stdint.h>
+
+#include "gtest/gtest.h"
+
+#include "internal.h"
+#include "page_map.h"
+
+using namespace mesh;
+
+TEST(PageMapTest, LazyLeaves) {
+  static PageMap<uint32_t> map{};
+  static constexpr size_t LeafLength = PageMap<uint32_t>::kLeafLength;
+
+  ASSERT_EQ(map.leafCount(), 0UL);
+  ASSERT_EQ(map.find(0), nullptr);
+  ASSERT_EQ(map.find(LeafLength * 3 + 7), nullptr);
+
+  map.at(5) = 55;
+  ASSERT_EQ(map.leafCount(), 1UL);
+  ASSERT_EQ(*map.find(5), 55U);
+  // the rest of the leaf reads as zero
+  ASSERT_NE(map.find(LeafLength - 1), nullptr);
+  ASSERT_EQ(*map.find(LeafLength - 1), 0U);
+  ASSERT_EQ(map.find(LeafLength), nullptr);
+
+  // entries at the far end of the arena get their own leaf
+  const size_t last = kArenaMaxSize / kPageSize - 1;
+  map.at(last) = 77;
+  ASSERT_EQ(map.leafCount(), 2UL);
+  ASSERT_EQ(*map.find(last), 77U);
+  ASSERT_EQ(*map.find(5), 55U);
+
+  // leaves are huge page aligned
+  ASSERT_EQ(reinterpret_cast<uintptr_t>(map.find(0)) % kHugePageSize, 0UL);
+  ASSERT_EQ(map.bytes(), 2 * kHugePageSize);
+}
@@ -0,0 +1,67 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2019 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "gtest/gtest.h"
+
+#include "internal.h"
+#include "runtime.h"
+#include "shared_heap.h"
+
+using namespace mesh;
+
+TEST(SharedHeapTest, SendRecv) {
+  GlobalHeap &gheap = runtime().heap();
+
+  auto heap = SharedHeap::create("mesh_test", 64 * kPageSize);
+  ASSERT_NE(heap, nullptr);
+  ASSERT_TRUE(heap->isOwner());
+  ASSERT_FALSE(gheap.contains(heap->base()));
+  ASSERT_EQ(SharedHeap::heapFor(heap->base()), heap);
+
+  char *msg = reinterpret_cast<char *>(heap->malloc(3 * kPageSize - 1));
+  ASSERT_NE(msg, nullptr);
+  ASSERT_TRUE(heap->contains(msg));
+  ASSERT_EQ(gheap.getSize(msg), 3 * kPageSize);
+  memset(msg, 'x', 3 * kPageSize);
+
+  // too big for what's left
+  ASSERT_EQ(heap->malloc(62 * kPageSize), nullptr);
+
+  int socks[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, socks), 0);
+  ASSERT_EQ(heap->send(socks[0]), 0);
+  auto peer = SharedHeap::recv(socks[1]);
+  close(socks[0]);
+  close(socks[1]);
+  ASSERT_NE(peer, nullptr);
+
+  // our own mapping is in the way, so the peer's lands elsewhere
+  ASSERT_NE(peer->base(), heap->base());
+  ASSERT_EQ(peer->capacity(), heap->capacity());
+  ASSERT_FALSE(peer->isOwner());
+  ASSERT_EQ(peer->malloc(kPageSize), nullptr);
+  ASSERT_EQ(SharedHeap::heapFor(peer->base()), nullptr);
+
+  // both mappings see the same pages
+  char *peerMsg = peer->base() + (msg - heap->base());
+  ASSERT_EQ(peerMsg[3 * kPageSize - 1], 'x');
+  peerMsg[0] = 'y';
+  ASSERT_EQ(msg[0], 'y');
+
+  // freed with a plain free, and the pages are handed out again
+  gheap.free(msg);
+  ASSERT_EQ(gheap.getSize(msg), 0UL);
+  auto big = heap->malloc(64 * kPageSize);
+  ASSERT_EQ(big, heap->base());
+  heap->free(big);
+
+  SharedHeap::destroy(peer);
+  SharedHeap::destroy(heap);
+  ASSERT_EQ(SharedHeap::heapFor(msg), nullptr);
+}
@@ -0,0 +1,192 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// Copyright 2019 The Mesh Authors. All rights reserved.
+// Use of this source code is governed by the Apache License,
+// Version 2.0, that can be found in the LICENSE file.
+
+#include "gtest/gtest.h"
+
+#include "internal.h"
+#include "span_free_list.h"
+
+using namespace mesh;
+
+TEST(SpanFreeList, BestFit) {
+  SpanFreeList list{};
+  Span result(0, 0);
+
+  ASSERT_TRUE(list.empty());
+  ASSERT_FALSE(list.findBestFit(1, result));
+
+  list.add(Span(100, 4));
+  list.add(Span(10, 4));
+  list.add(Span(50, 2));
+  list.add(Span(2000, 1000));
+  list.add(Span(1000, 300));
+  list.add(Span(5000, 300));
+  ASSERT_EQ(list.pageCount(), 4UL + 4 + 2 + 1000 + 300 + 300);
+
+  // smallest class that fits, then lowest address
+  ASSERT_TRUE(list.findBestFit(3, result));
+  ASSERT_EQ(result.offset, 10UL);
+  ASSERT_EQ(result.length, 4UL);
+
+  ASSERT_TRUE(list.findBestFit(2, result));
+  ASSERT_EQ(result.offset, 50UL);
+
+  ASSERT_TRUE(list.findBestFit(4, result));
+  ASSERT_EQ(result.offset, 100UL);
+
+  // exact classes are exhausted, so this comes from the large class
+  ASSERT_TRUE(list.findBestFit(1, result));
+  ASSERT_EQ(result.offset, 1000UL);
+  ASSERT_EQ(result.length, 300UL);
+
+  // best fit, not first fit, among large spans
+  ASSERT_TRUE(list.findBestFit(500, result));
+  ASSERT_EQ(result.offset, 2000UL);
+  ASSERT_FALSE(list.findBestFit(500, result));
+
+  ASSERT_TRUE(list.findBestFit(300, result));
+  ASSERT_EQ(result.offset, 5000UL);
+  ASSERT_TRUE(list.empty());
+
+  list.add(Span(7, 1));
+  list.add(Span(8, 257));
+  size_t count = 0;
+  list.forEach([&](const Span &span) { count += span.length; });
+  ASSERT_EQ(count, 258UL);
+
+  list.clear();
+  ASSERT_TRUE(list.empty());
+  ASSERT_FALSE(list.findBestFit(1, result));
+}
+
+TEST(SpanFreeList, Coalesce) {
+  SpanFreeList list{};
+  Span result(0, 0);
+
+  list.add(Span(10, 2));
+  list.add(Span(14, 2));
+  // fills the hole, merging with both neighbours
+  const auto merged = list.add(Span(12, 2));
+  ASSERT_EQ(merged.offset, 10UL);
+  ASSERT_EQ(merged.length, 6UL);
+
+  size_t spanCount = 0;
+  list.forEach([&](const Span &span) { spanCount++; });
+  ASSERT_EQ(spanCount, 1UL);
+  ASSERT_EQ(list.pageCount(), 6UL);
+
+  // not adjacent
+  list.add(Span(17, 1));
+  ASSERT_TRUE(list.findBestFit(1, result));
+  ASSERT_EQ(result.offset, 17UL);
+
+  ASSERT_TRUE(list.findBestFit(6, result));
+  ASSERT_EQ(result.offset, 10UL);
+  ASSERT_EQ(result.length, 6UL);
+  ASSERT_TRUE(list.empty());
+}
+
+TEST(SpanFreeList, AlignedFit) {
+  SpanFreeList list{};
+  Span result(0, 0);
+
+  // 6 pages, but no 4 page range aligned to 8 inside
+  list.add(Span(1, 6));
+  // 10 pages with one aligned range, at 24
+  list.add(Span(19, 10));
+  list.add(Span(100, 300));
+
+  // the 6 page span is skipped even though it's the best fit by length
+  ASSERT_TRUE(list.findAlignedFit(4, 8, 0, result));
+  ASSERT_EQ(result.offset, 24UL);
+  ASSERT_EQ(result.length, 4UL);
+  // the head and tail stay in the list, without touching the others
+  ASSERT_EQ(list.pageCount(), 6UL + 10 + 300 - 4);
+  ASSERT_TRUE(list.findBestFit(5, result));
+  ASSERT_EQ(result.offset, 19UL);
+  ASSERT_EQ(result.length, 5UL);
+  ASSERT_TRUE(list.findBestFit(1, result));
+  ASSERT_EQ(result.offset, 28UL);
+
+  // alignment relative to a base that isn't itself aligned
+  ASSERT_TRUE(list.findAlignedFit(16, 16, 3, result));
+  ASSERT_EQ(result.offset, 109UL);
+  ASSERT_EQ(result.length, 16UL);
+  ASSERT_EQ(list.pageCount(), 6UL + 300 - 16);
+
+  ASSERT_FALSE(list.findAlignedFit(512, 1, 0, result));
+  ASSERT_TRUE(list.findAlignedFit(6, 1, 0, result));
+  ASSERT_EQ(result.offset, 1UL);
+}
+
+TEST(SpanFreeList, BestFitAbove) {
+  SpanFreeList list{};
+  Span result(0, 0);
+
+  list.add(Span(10, 4));
+  list.add(Span(100, 4));
+  list.add(Span(1000, 300));
+  list.add(Span(2000, 1000));
+  list.add(Span(5000, 300));
+
+  // the best fit starting at or above the offset, in either kind of
+  // class
+  ASSERT_TRUE(list.findBestFit(3, result, 50));
+  ASSERT_EQ(result.offset, 100UL);
+  ASSERT_TRUE(list.findBestFit(200, result, 1500));
+  ASSERT_EQ(result.offset, 5000UL);
+  ASSERT_FALSE(list.findBestFit(200, result, 6000));
+
+  ASSERT_TRUE(list.findAlignedFit(8, 16, 0, result, 1500));
+  ASSERT_EQ(result.offset, 2000UL);
+}
+
+TEST(SpanFreeList, AlignedFitProbeLimit) {
+  SpanFreeList list{};
+  Span result(0, 0);
+
+  // plenty of spans long enough for 512 pages, but none holding 512
+  // pages aligned to 512
+  for (size_t i = 0; i < 100; i++) {
+    list.add(Span(1 + i * 1024, 600));
+  }
+  list.add(Span(200000, 2000));
+
+  // only a few of them are probed before the long span is used
+  ASSERT_TRUE(list.findAlignedFit(512, 512, 0, result));
+  ASSERT_EQ(result.offset, 200192UL);
+  ASSERT_EQ(result.length, 512UL);
+  ASSERT_EQ(list.pageCount(), 100UL * 600 + 2000 - 512);
+}
+
+TEST(SpanFreeList, LowestFit) {
+  SpanFreeList list{};
+  Span result(0, 0);
+
+  list.add(Span(0, 4));
+  list.add(Span(10, 3));
+  list.add(Span(20, 100));
+
+  // the lowest range that fits, even if a later span fits better, and
+  // never before begin
+  ASSERT_TRUE(list.findLowestFit(3, 1, 200, result));
+  ASSERT_EQ(result.offset, 1UL);
+  ASSERT_EQ(result.length, 3UL);
+  ASSERT_EQ(list.pageCount(), 1UL + 3 + 100);
+
+  // nor running past end
+  ASSERT_FALSE(list.findLowestFit(8, 1, 27, result));
+  ASSERT_TRUE(list.findLowestFit(7, 1, 27, result));
+  ASSERT_EQ(result.offset, 20UL);
+
+  // the head and tail of a span stay in the list
+  ASSERT_TRUE(list.findLowestFit(2, 11, 200, result));
+  ASSERT_EQ(result.offset, 11UL);
+  ASSERT_TRUE(list.findBestFit(1, result));
+  ASSERT_EQ(result.offset, 0UL);
+  ASSERT_TRUE(list.findBestFit(1, result));
+  ASSERT_EQ(result.offset, 10UL);
+  ASSERT_EQ(list.pageCount(), 93UL);
+}
@@ -254,6 +254,10 @@ operator new(size_t sz)
     return mesh::cxxNewSlowpath(sz);
   }
 
+  if (unlikely(LifetimeClassifier::enabled())) {
+    return localHeap->cxxNewSegregated(sz, __builtin_return_address(0));
+  }
+
   return localHeap->cxxNew(sz);
 }
 
@@ -291,6 +295,10 @@ MESH_EXPORT CACHELINE_ALIGNED_FN void *operator new[](size_t sz)
     return mesh::cxxNewSlowpath(sz);
   }
 
+  if (unlikely(LifetimeClassifier::enabled())) {
+    return localHeap->cxxNewSegregated(sz, __builtin_return_address(0));
+  }
+
   return localHeap->cxxNew(sz);
 }
 